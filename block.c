@@ -4760,7 +4760,8 @@ BlockDriverState *bdrv_insert_node(BlockDriverState *bs, QDict *node_options,
  * check are stored in res.
  */
 int coroutine_fn bdrv_co_check(BlockDriverState *bs,
-                               BdrvCheckResult *res, BdrvCheckMode fix)
+                               BdrvCheckResult *res, BdrvCheckMode fix,
+                               BdrvCheckStatusCB *status_cb, void *cb_opaque)
 {
     if (bs->drv == NULL) {
         return -ENOMEDIUM;
@@ -4770,7 +4771,7 @@ int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    return bs->drv->bdrv_co_check(bs, res, fix, status_cb, cb_opaque);
 }
 
 /*
@@ -5633,6 +5634,36 @@ BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
     return drv->bdrv_get_specific_stats(bs);
 }
 
+/*
+ * Find a host file descriptor and the offset in it from which the @bytes
+ * at @offset of @bs can be read directly, e.g. with sendfile(), without
+ * going through the block layer.
+ *
+ * This is only possible when no driver on the way transforms the data and
+ * nothing in the block layer needs to see the read: -ENOTSUP is returned
+ * for encrypted nodes, with copy-on-read, in drained sections and while
+ * serialising requests are in flight.  The caller must hold an in-flight
+ * reference on @bs while it reads from @fd.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     int *fd, int64_t *host_offset)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_get_host_fd || bs->encrypted ||
+        qatomic_read(&bs->copy_on_read) ||
+        qatomic_read(&bs->quiesce_counter) ||
+        qatomic_read(&bs->serialising_in_flight))
+    {
+        return -ENOTSUP;
+    }
+
+    return drv->bdrv_get_host_fd(bs, offset, bytes, fd, host_offset);
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
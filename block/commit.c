@@ -21,6 +21,7 @@
 #include "qapi/qmp/qerror.h"
 #include "qemu/ratelimit.h"
 #include "sysemu/block-backend.h"
+#include "block/aio_task.h"
 
 enum {
     /*
@@ -31,6 +32,15 @@ enum {
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
 };
 
+/* A range whose copy failed and that waits for the error action */
+typedef struct CommitRange {
+    int64_t offset;
+    int64_t bytes;
+    int ret;
+    bool error_in_source;
+    QSIMPLEQ_ENTRY(CommitRange) next;
+} CommitRange;
+
 typedef struct CommitBlockJob {
     BlockJob common;
     BlockDriverState *commit_top_bs;
@@ -42,8 +52,21 @@ typedef struct CommitBlockJob {
     bool base_read_only;
     bool chain_frozen;
     char *backing_file_str;
+    int max_workers;
+    int64_t max_chunk;
+
+    AioTaskPool *pool;
+    QSIMPLEQ_HEAD(, CommitRange) failed;
+    QSIMPLEQ_HEAD(, CommitRange) retry;
 } CommitBlockJob;
 
+typedef struct CommitTask {
+    AioTask task;
+    CommitBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+} CommitTask;
+
 static int commit_prepare(Job *job)
 {
     CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
@@ -112,88 +135,191 @@ static void commit_clean(Job *job)
     blk_unref(s->top);
 }
 
+static int coroutine_fn commit_task_entry(AioTask *task)
+{
+    CommitTask *t = container_of(task, CommitTask, task);
+    CommitBlockJob *s = t->s;
+    bool error_in_source = true;
+    CommitRange *r;
+    void *buf;
+    int ret;
+
+    assert(t->bytes < SIZE_MAX);
+
+    buf = blk_blockalign(s->top, t->bytes);
+    ret = blk_co_pread(s->top, t->offset, t->bytes, buf, 0);
+    if (ret >= 0) {
+        ret = blk_co_pwrite(s->base, t->offset, t->bytes, buf, 0);
+        if (ret < 0) {
+            error_in_source = false;
+        }
+    }
+    qemu_vfree(buf);
+
+    if (ret < 0) {
+        r = g_new(CommitRange, 1);
+        *r = (CommitRange) {
+            .offset = t->offset,
+            .bytes = t->bytes,
+            .ret = ret,
+            .error_in_source = error_in_source,
+        };
+        QSIMPLEQ_INSERT_TAIL(&s->failed, r, next);
+        return ret;
+    }
+
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
+static void coroutine_fn commit_start_task(CommitBlockJob *s,
+                                           int64_t offset, int64_t bytes)
+{
+    CommitTask *t = g_new(CommitTask, 1);
+
+    *t = (CommitTask) {
+        .task.func = commit_task_entry,
+        .s = s,
+        .offset = offset,
+        .bytes = bytes,
+    };
+    aio_task_pool_start_task(s->pool, &t->task);
+}
+
+/* Called when the job pauses, so that no request is left in flight */
+static void coroutine_fn commit_pause(Job *job)
+{
+    CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
+
+    if (s->pool) {
+        aio_task_pool_wait_all(s->pool);
+    }
+}
+
 static int coroutine_fn commit_run(Job *job, Error **errp)
 {
     CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
-    int64_t offset;
+    CommitRange *r;
+    int64_t offset = 0;
+    int64_t extent_end = 0; /* end of the range whose status is known */
+    bool copy = false;
     uint64_t delay_ns = 0;
     int ret = 0;
     int64_t n = 0; /* bytes */
-    void *buf = NULL;
     int64_t len, base_len;
 
     ret = len = blk_getlength(s->top);
     if (len < 0) {
-        goto out;
+        return ret;
     }
     job_progress_set_remaining(&s->common.job, len);
 
     ret = base_len = blk_getlength(s->base);
     if (base_len < 0) {
-        goto out;
+        return ret;
     }
 
     if (base_len < len) {
         ret = blk_truncate(s->base, len, false, PREALLOC_MODE_OFF, 0, NULL);
         if (ret) {
-            goto out;
+            return ret;
         }
     }
 
-    buf = blk_blockalign(s->top, COMMIT_BUFFER_SIZE);
+    s->pool = aio_task_pool_new(s->max_workers);
 
-    for (offset = 0; offset < len; offset += n) {
-        bool copy;
-        bool error_in_source = true;
-
-        /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+    for (;;) {
+        /* Note that requests may be in flight here; commit_pause() waits
+         * for them so that bdrv_drain_all() returns.
          */
         job_sleep_ns(&s->common.job, delay_ns);
+        delay_ns = 0;
         if (job_is_cancelled(&s->common.job)) {
+            ret = 0;
             break;
         }
-        /* Copy if allocated above the base */
-        ret = bdrv_is_allocated_above(blk_bs(s->top), s->base_overlay, true,
-                                      offset, COMMIT_BUFFER_SIZE, &n);
-        copy = (ret > 0);
-        trace_commit_one_iteration(s, offset, n, ret);
-        if (copy) {
-            assert(n < SIZE_MAX);
 
-            ret = blk_co_pread(s->top, offset, n, buf, 0);
-            if (ret >= 0) {
-                ret = blk_co_pwrite(s->base, offset, n, buf, 0);
-                if (ret < 0) {
-                    error_in_source = false;
-                }
-            }
-        }
-        if (ret < 0) {
+        r = QSIMPLEQ_FIRST(&s->failed);
+        if (r) {
             BlockErrorAction action =
                 block_job_error_action(&s->common, s->on_error,
-                                       error_in_source, -ret);
+                                       r->error_in_source, -r->ret);
+
+            QSIMPLEQ_REMOVE_HEAD(&s->failed, next);
             if (action == BLOCK_ERROR_ACTION_REPORT) {
-                goto out;
-            } else {
-                n = 0;
+                ret = r->ret;
+                g_free(r);
+                break;
+            }
+            QSIMPLEQ_INSERT_TAIL(&s->retry, r, next);
+            continue;
+        }
+
+        r = QSIMPLEQ_FIRST(&s->retry);
+        if (r) {
+            QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+            commit_start_task(s, r->offset, r->bytes);
+            delay_ns = block_job_ratelimit_get_delay(&s->common, r->bytes);
+            g_free(r);
+            continue;
+        }
+
+        if (offset >= len) {
+            if (aio_task_pool_empty(s->pool)) {
+                ret = 0;
+                break;
+            }
+            aio_task_pool_wait_one(s->pool);
+            continue;
+        }
+
+        if (offset >= extent_end) {
+            /*
+             * Copy if allocated above the base.  The whole rest of the
+             * image is queried at once, so that long unallocated runs are
+             * skipped with a single query.
+             */
+            ret = bdrv_is_allocated_above(blk_bs(s->top), s->base_overlay,
+                                          true, offset, len - offset, &n);
+            trace_commit_one_iteration(s, offset, n, ret);
+            if (ret < 0) {
+                BlockErrorAction action =
+                    block_job_error_action(&s->common, s->on_error, true,
+                                           -ret);
+                if (action == BLOCK_ERROR_ACTION_REPORT) {
+                    break;
+                }
                 continue;
             }
+            extent_end = offset + n;
+            copy = (ret > 0);
         }
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
 
+        n = extent_end - offset;
         if (copy) {
+            n = MIN(n, s->max_chunk);
+            commit_start_task(s, offset, n);
             delay_ns = block_job_ratelimit_get_delay(&s->common, n);
         } else {
-            delay_ns = 0;
+            /* Publish progress */
+            job_progress_update(&s->common.job, n);
         }
+        offset += n;
     }
 
-    ret = 0;
+    aio_task_pool_wait_all(s->pool);
+    aio_task_pool_free(s->pool);
+    s->pool = NULL;
 
-out:
-    qemu_vfree(buf);
+    /* Left over when the job was cancelled or failed */
+    while ((r = QSIMPLEQ_FIRST(&s->failed))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->failed, next);
+        g_free(r);
+    }
+    while ((r = QSIMPLEQ_FIRST(&s->retry))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+        g_free(r);
+    }
 
     return ret;
 }
@@ -207,7 +333,8 @@ static const BlockJobDriver commit_job_driver = {
         .run           = commit_run,
         .prepare       = commit_prepare,
         .abort         = commit_abort,
-        .clean         = commit_clean
+        .clean         = commit_clean,
+        .pause         = commit_pause,
     },
 };
 
@@ -248,7 +375,8 @@ void commit_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, BlockDriverState *top,
                   int creation_flags, int64_t speed,
                   BlockdevOnError on_error, const char *backing_file_str,
-                  const char *filter_node_name, Error **errp)
+                  const char *filter_node_name, StreamCommitPerf *perf,
+                  Error **errp)
 {
     CommitBlockJob *s;
     BlockDriverState *iter;
@@ -264,6 +392,18 @@ void commit_start(const char *job_id, BlockDriverState *bs,
         return;
     }
 
+    if (perf->max_workers < 1) {
+        error_setg(errp, "max-workers must be greater than zero");
+        return;
+    }
+
+    if (perf->max_chunk < 0 || perf->max_chunk > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-chunk must be zero (which means the default) "
+                   "or positive and at most %" PRId64,
+                   (int64_t)BDRV_REQUEST_MAX_BYTES);
+        return;
+    }
+
     base_size = bdrv_getlength(base);
     if (base_size < 0) {
         error_setg_errno(errp, -base_size, "Could not inquire base image size");
@@ -393,6 +533,10 @@ void commit_start(const char *job_id, BlockDriverState *bs,
 
     s->backing_file_str = g_strdup(backing_file_str);
     s->on_error = on_error;
+    s->max_workers = perf->max_workers;
+    s->max_chunk = perf->max_chunk ?: COMMIT_BUFFER_SIZE;
+    QSIMPLEQ_INIT(&s->failed);
+    QSIMPLEQ_INIT(&s->retry);
 
     trace_commit_start(bs, base, top, s);
     job_start(&s->common.job);
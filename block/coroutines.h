@@ -28,7 +28,8 @@
 #include "block/block_int.h"
 
 int coroutine_fn bdrv_co_check(BlockDriverState *bs,
-                               BdrvCheckResult *res, BdrvCheckMode fix);
+                               BdrvCheckResult *res, BdrvCheckMode fix,
+                               BdrvCheckStatusCB *status_cb, void *cb_opaque);
 int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp);
 
 int generated_co_wrapper
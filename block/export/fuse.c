@@ -19,11 +19,15 @@
 #define FUSE_USE_VERSION 31
 
 #include "qemu/osdep.h"
+#include "qemu/coroutine.h"
+#include "qemu/queue.h"
+#include "block/accounting.h"
 #include "block/aio.h"
 #include "block/block.h"
 #include "block/export.h"
 #include "block/fuse.h"
 #include "block/qapi.h"
+#include "block/thread-pool.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
 #include "sysemu/block-backend.h"
@@ -36,16 +40,30 @@
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
 
+/*
+ * A request read from the FUSE device.  Requests are processed in
+ * coroutines, so that several of them can wait for the block layer at
+ * the same time; each one needs its own buffer.
+ */
+typedef struct FuseRequest {
+    struct FuseExport *exp;
+    struct fuse_buf fuse_buf;
+    QSLIST_ENTRY(FuseRequest) next;
+} FuseRequest;
+
 typedef struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
+    /* Requests whose buffers can be reused */
+    QSLIST_HEAD(, FuseRequest) free_requests;
     bool mounted, fd_handler_set_up;
 
     char *mountpoint;
     bool writable;
     bool growable;
+    /* Serializes resizing, see fuse_do_truncate() */
+    CoMutex resize_lock;
 } FuseExport;
 
 static GHashTable *exports;
@@ -117,6 +135,7 @@ static int fuse_export_create(BlockExport *blk_exp,
     exp->mountpoint = g_strdup(args->mountpoint);
     exp->writable = blk_exp_args->writable;
     exp->growable = args->growable;
+    qemu_co_mutex_init(&exp->resize_lock);
 
     ret = setup_fuse_export(exp, args->mountpoint, errp);
     if (ret < 0) {
@@ -194,29 +213,51 @@ fail:
 }
 
 /**
- * Callback to be invoked when the FUSE session FD can be read from.
- * (This is basically the FUSE event loop.)
+ * Read one request from the FUSE device and process it.  The request is
+ * read before the coroutine yields for the first time, so the FD is not
+ * readable any more for this request when read_from_fuse_export()
+ * returns.
  */
-static void read_from_fuse_export(void *opaque)
+static void coroutine_fn co_read_from_fuse_export(void *opaque)
 {
-    FuseExport *exp = opaque;
+    FuseRequest *request = opaque;
+    FuseExport *exp = request->exp;
     int ret;
 
-    blk_exp_ref(&exp->common);
-
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
+        ret = fuse_session_receive_buf(exp->fuse_session, &request->fuse_buf);
     } while (ret == -EINTR);
-    if (ret < 0) {
-        goto out;
+    if (ret > 0) {
+        fuse_session_process_buf(exp->fuse_session, &request->fuse_buf);
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
-
-out:
+    QSLIST_INSERT_HEAD(&exp->free_requests, request, next);
     blk_exp_unref(&exp->common);
 }
 
+/**
+ * Callback to be invoked when the FUSE session FD can be read from.
+ * (This is basically the FUSE event loop.)
+ */
+static void read_from_fuse_export(void *opaque)
+{
+    FuseExport *exp = opaque;
+    FuseRequest *request;
+    Coroutine *co;
+
+    request = QSLIST_FIRST(&exp->free_requests);
+    if (request) {
+        QSLIST_REMOVE_HEAD(&exp->free_requests, next);
+    } else {
+        request = g_new0(FuseRequest, 1);
+        request->exp = exp;
+    }
+
+    blk_exp_ref(&exp->common);
+    co = qemu_coroutine_create(co_read_from_fuse_export, request);
+    qemu_coroutine_enter(co);
+}
+
 static void fuse_export_shutdown(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
@@ -244,6 +285,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    FuseRequest *request;
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -253,7 +295,12 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    /* Every request holds a reference, so all of them are free now */
+    while ((request = QSLIST_FIRST(&exp->free_requests))) {
+        QSLIST_REMOVE_HEAD(&exp->free_requests, next);
+        free(request->fuse_buf.mem);
+        g_free(request);
+    }
     g_free(exp->mountpoint);
 }
 
@@ -295,6 +342,10 @@ static void fuse_init(void *userdata, struct fuse_conn_info *conn)
     conn->max_read = FUSE_MAX_BOUNCE_BYTES;
 
     conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
+
+    /* Let fuse_reply_data() splice read data from the image file */
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE |
+                                   FUSE_CAP_SPLICE_MOVE);
 }
 
 /**
@@ -353,17 +404,37 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_attr(req, &statbuf, 1.);
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+/*
+ * Resize the export to @size.  Requests run concurrently, so this is done
+ * under exp->resize_lock: the length checked by a request may be stale,
+ * and the RESIZE permission of non-growable exports must not be taken
+ * and dropped by two requests at once.  With @grow_only, nothing is done
+ * if the export is at least @size long once the lock is held.
+ */
+static int coroutine_fn fuse_do_truncate(FuseExport *exp, int64_t size,
+                                         bool req_zero_write,
+                                         PreallocMode prealloc,
+                                         bool grow_only)
 {
     uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
+    int64_t length;
     int ret;
 
     if (req_zero_write) {
         truncate_flags |= BDRV_REQ_ZERO_WRITE;
     }
 
+    qemu_co_mutex_lock(&exp->resize_lock);
+
+    if (grow_only) {
+        length = blk_getlength(exp->common.blk);
+        if (length < 0 || length >= size) {
+            ret = length < 0 ? length : 0;
+            goto out;
+        }
+    }
+
     /* Growable exports have a permanent RESIZE permission */
     if (!exp->growable) {
         blk_get_perm(exp->common.blk, &blk_perm, &blk_shared_perm);
@@ -371,7 +442,7 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
         ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
                            blk_shared_perm, NULL);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
     }
 
@@ -383,14 +454,17 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
         blk_set_perm(exp->common.blk, blk_perm, blk_shared_perm, &error_abort);
     }
 
+out:
+    qemu_co_mutex_unlock(&exp->resize_lock);
     return ret;
 }
 
 /**
  * Let clients set file attributes.  Only resizing is supported.
  */
-static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
-                         int to_set, struct fuse_file_info *fi)
+static void coroutine_fn fuse_setattr(fuse_req_t req, fuse_ino_t inode,
+                                      struct stat *statbuf, int to_set,
+                                      struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int ret;
@@ -405,7 +479,8 @@ static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
         return;
     }
 
-    ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+    ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF,
+                           false);
     if (ret < 0) {
         fuse_reply_err(req, -ret);
         return;
@@ -423,11 +498,82 @@ static void fuse_open(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_open(req, fi);
 }
 
+typedef struct FuseReadDirect {
+    fuse_req_t req;
+    struct fuse_bufvec bufv;
+} FuseReadDirect;
+
+/* Runs in a worker thread, the splice can block on the disk */
+static int fuse_read_direct_worker(void *opaque)
+{
+    FuseReadDirect *data = opaque;
+
+    /* This sends the reply, or an error reply if reading fails */
+    fuse_reply_data(data->req, &data->bufv, FUSE_BUF_SPLICE_MOVE);
+    return 0;
+}
+
+/**
+ * Reply to a read with data spliced from the host file straight into the
+ * FUSE device, when the image data can be read from a host file as it is
+ * (see bdrv_get_host_fd()).  Returns -ENOTSUP without replying if that is
+ * not possible.
+ */
+static int coroutine_fn fuse_co_read_direct(FuseExport *exp, fuse_req_t req,
+                                            size_t size, off_t offset)
+{
+    BlockBackend *blk = exp->common.blk;
+    FuseReadDirect data;
+    BlockAcctCookie cookie;
+    ThreadPool *pool;
+    int64_t host_offset;
+    struct stat st;
+    int fd, ret;
+
+    if (!size || blk_get_public(blk)->throttle_group_member.throttle_state) {
+        return -ENOTSUP;
+    }
+
+    blk_inc_in_flight(blk);
+    ret = bdrv_get_host_fd(blk_bs(blk), offset, size, &fd, &host_offset);
+    if (ret < 0) {
+        blk_dec_in_flight(blk);
+        return -ENOTSUP;
+    }
+
+    /*
+     * The image length is rounded up to sectors, the part after the end
+     * of the file must read as zeroes and not be a short read
+     */
+    if (fstat(fd, &st) < 0 ||
+        (S_ISREG(st.st_mode) && host_offset + size > st.st_size)) {
+        blk_dec_in_flight(blk);
+        return -ENOTSUP;
+    }
+
+    data = (FuseReadDirect) {
+        .req = req,
+        .bufv = FUSE_BUFVEC_INIT(size),
+    };
+    data.bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    data.bufv.buf[0].fd = fd;
+    data.bufv.buf[0].pos = host_offset;
+
+    block_acct_start(blk_get_stats(blk), &cookie, size, BLOCK_ACCT_READ);
+    pool = aio_get_thread_pool(exp->common.ctx);
+    thread_pool_submit_co(pool, fuse_read_direct_worker, &data);
+    block_acct_done(blk_get_stats(blk), &cookie);
+
+    blk_dec_in_flight(blk);
+    return 0;
+}
+
 /**
  * Handle client reads from the exported image.
  */
-static void fuse_read(fuse_req_t req, fuse_ino_t inode,
-                      size_t size, off_t offset, struct fuse_file_info *fi)
+static void coroutine_fn fuse_read(fuse_req_t req, fuse_ino_t inode,
+                                   size_t size, off_t offset,
+                                   struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
@@ -454,6 +600,10 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         size = length - offset;
     }
 
+    if (fuse_co_read_direct(exp, req, size, offset) == 0) {
+        return;
+    }
+
     buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
     if (!buf) {
         fuse_reply_err(req, ENOMEM);
@@ -473,8 +623,9 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
 /**
  * Handle client writes to the exported image.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static void coroutine_fn fuse_write(fuse_req_t req, fuse_ino_t inode,
+                                    const char *buf, size_t size,
+                                    off_t offset, struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
@@ -503,7 +654,8 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 
     if (offset + size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            ret = fuse_do_truncate(exp, offset + size, true,
+                                   PREALLOC_MODE_OFF, true);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
@@ -524,9 +676,9 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 /**
  * Let clients perform various fallocate() operations.
  */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static void coroutine_fn fuse_fallocate(fuse_req_t req, fuse_ino_t inode,
+                                        int mode, off_t offset, off_t length,
+                                        struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t blk_len;
@@ -564,7 +716,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > blk_len) {
             /* No need for zeroes, we are going to write them ourselves */
             ret = fuse_do_truncate(exp, offset + length, false,
-                                   PREALLOC_MODE_OFF);
+                                   PREALLOC_MODE_OFF, true);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
@@ -588,7 +740,8 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
 
         if (offset > blk_len) {
             /* No preallocation needed here */
-            ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
+            ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF,
+                                   true);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
@@ -596,7 +749,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         }
 
         ret = fuse_do_truncate(exp, offset + length, true,
-                               PREALLOC_MODE_FALLOC);
+                               PREALLOC_MODE_FALLOC, true);
     } else {
         ret = -EOPNOTSUPP;
     }
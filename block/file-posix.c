@@ -132,6 +132,16 @@
 #define RAW_LOCK_PERM_BASE             100
 #define RAW_LOCK_SHARED_BASE           200
 
+/* Number of data and hole extents remembered for raw_co_block_status() */
+#define RAW_BSC_EXTENTS 16
+
+typedef struct RawBlockStatusExtent {
+    off_t start;
+    off_t end;          /* INT64_MAX for a trailing hole, start if unused */
+    bool data;
+    uint64_t last_use;
+} RawBlockStatusExtent;
+
 typedef struct BDRVRawState {
     int fd;
     bool use_lock;
@@ -172,6 +182,10 @@ typedef struct BDRVRawState {
     } stats;
 
     PRManager *pr_mgr;
+
+    /* Extents found by find_allocation(), see raw_bsc_lookup() */
+    RawBlockStatusExtent bsc[RAW_BSC_EXTENTS];
+    uint64_t bsc_clock;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -184,6 +198,103 @@ typedef struct BDRVRawReopenState {
 static int fd_open(BlockDriverState *bs);
 static int64_t raw_getlength(BlockDriverState *bs);
 
+/*
+ * Extents cannot change behind our back as long as nobody else may write
+ * to the file, so only use the cache then
+ */
+static bool raw_bsc_usable(BDRVRawState *s)
+{
+    return !(s->shared_perm & BLK_PERM_WRITE);
+}
+
+/*
+ * Look up @start in the extents that find_allocation() returned before.
+ * Returns -ENOENT if it is not cached, otherwise the same as
+ * find_allocation().
+ */
+static int raw_bsc_lookup(BDRVRawState *s, off_t start,
+                          off_t *data, off_t *hole)
+{
+    int i;
+
+    if (!raw_bsc_usable(s)) {
+        return -ENOENT;
+    }
+
+    for (i = 0; i < RAW_BSC_EXTENTS; i++) {
+        RawBlockStatusExtent *e = &s->bsc[i];
+
+        if (start < e->start || start >= e->end) {
+            continue;
+        }
+
+        e->last_use = ++s->bsc_clock;
+        if (e->data) {
+            *data = start;
+            *hole = e->end;
+        } else if (e->end == INT64_MAX) {
+            return -ENXIO;
+        } else {
+            *hole = start;
+            *data = e->end;
+        }
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+/* Remember the result @ret of find_allocation() for @start */
+static void raw_bsc_add(BDRVRawState *s, off_t start, int ret,
+                        off_t data, off_t hole)
+{
+    RawBlockStatusExtent *e = &s->bsc[0];
+    int i;
+
+    if (!raw_bsc_usable(s) || (ret < 0 && ret != -ENXIO)) {
+        return;
+    }
+
+    /* Replace an unused or else the least recently used extent */
+    for (i = 1; i < RAW_BSC_EXTENTS && e->start != e->end; i++) {
+        if (s->bsc[i].start == s->bsc[i].end ||
+            s->bsc[i].last_use < e->last_use) {
+            e = &s->bsc[i];
+        }
+    }
+
+    e->start = start;
+    e->last_use = ++s->bsc_clock;
+    if (ret == -ENXIO) {
+        e->end = INT64_MAX;
+        e->data = false;
+    } else if (data == start) {
+        e->end = hole;
+        e->data = true;
+    } else {
+        e->end = data;
+        e->data = false;
+    }
+}
+
+/*
+ * Forget the extents that overlap a range that has been written,
+ * discarded or zeroed.  Must be called after the request completed, so
+ * that an extent looked up while it was in flight does not survive it.
+ */
+static void raw_bsc_invalidate(BDRVRawState *s, off_t offset, off_t bytes)
+{
+    int i;
+
+    for (i = 0; i < RAW_BSC_EXTENTS; i++) {
+        RawBlockStatusExtent *e = &s->bsc[i];
+
+        if (e->start < offset + bytes && offset < e->end) {
+            e->end = e->start;
+        }
+    }
+}
+
 typedef struct RawPosixAIOData {
     BlockDriverState *bs;
     int aio_type;
@@ -1143,6 +1254,7 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     qemu_close(s->fd);
     s->fd = rs->fd;
+    raw_bsc_invalidate(s, 0, INT64_MAX);
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -2044,8 +2156,13 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                        uint64_t bytes, QEMUIOVector *qiov,
                                        int flags)
 {
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
     assert(flags == 0);
-    return raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_WRITE);
+    ret = raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_WRITE);
+    raw_bsc_invalidate(s, offset, bytes);
+    return ret;
 }
 
 static void raw_aio_plug(BlockDriverState *bs)
@@ -2186,7 +2303,9 @@ static int coroutine_fn raw_co_truncate(BlockDriverState *bs, int64_t offset,
 
     if (S_ISREG(st.st_mode)) {
         /* Always resizes to the exact @offset */
-        return raw_regular_truncate(bs, s->fd, offset, prealloc, errp);
+        ret = raw_regular_truncate(bs, s->fd, offset, prealloc, errp);
+        raw_bsc_invalidate(s, 0, INT64_MAX);
+        return ret;
     }
 
     if (prealloc != PREALLOC_MODE_OFF) {
@@ -2711,6 +2830,7 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
                                             int64_t *map,
                                             BlockDriverState **file)
 {
+    BDRVRawState *s = bs->opaque;
     off_t data = 0, hole = 0;
     int ret;
 
@@ -2728,7 +2848,13 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
         return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
     }
 
-    ret = find_allocation(bs, offset, &data, &hole);
+    ret = raw_bsc_lookup(s, offset, &data, &hole);
+    if (ret == -ENOENT) {
+        ret = find_allocation(bs, offset, &data, &hole);
+        raw_bsc_add(s, offset, ret, data, hole);
+    } else {
+        trace_file_bsc_hit(bs, offset);
+    }
     if (ret == -ENXIO) {
         /* Trailing hole */
         *pnum = bytes;
@@ -2918,6 +3044,7 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int bytes, bool blkdev)
     }
 
     ret = raw_thread_pool_submit(bs, handle_aiocb_discard, &acb);
+    raw_bsc_invalidate(s, offset, bytes);
     raw_account_discard(s, bytes, ret);
     return ret;
 }
@@ -2935,6 +3062,7 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes,
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
     ThreadPoolFunc *handler;
+    int ret;
 
 #ifdef CONFIG_FALLOCATE
     if (offset + bytes > bs->total_sectors * BDRV_SECTOR_SIZE) {
@@ -2992,7 +3120,9 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes,
         handler = handle_aiocb_write_zeroes;
     }
 
-    return raw_thread_pool_submit(bs, handler, &acb);
+    ret = raw_thread_pool_submit(bs, handler, &acb);
+    raw_bsc_invalidate(s, offset, bytes);
+    return ret;
 }
 
 static int coroutine_fn raw_co_pwrite_zeroes(
@@ -3007,6 +3137,24 @@ static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static int raw_get_host_fd(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, int *fd, int64_t *host_offset)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /*
+     * O_DIRECT reads bypass the page cache, which reading through the
+     * file descriptor wouldn't
+     */
+    if (s->fd < 0 || (bs->open_flags & BDRV_O_NOCACHE)) {
+        return -ENOTSUP;
+    }
+
+    *fd = s->fd;
+    *host_offset = offset;
+    return 0;
+}
+
 static BlockStatsSpecificFile get_blockstats_specific_file(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -3150,6 +3298,9 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     raw_handle_perm_lock(bs, RAW_PL_COMMIT, perm, shared, NULL);
     s->perm = perm;
     s->shared_perm = shared;
+
+    /* Others may have written while write permission was shared */
+    raw_bsc_invalidate(s, 0, INT64_MAX);
 }
 
 static void raw_abort_perm_update(BlockDriverState *bs)
@@ -3187,6 +3338,7 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     RawPosixAIOData acb;
     BDRVRawState *s = bs->opaque;
     BDRVRawState *src_s;
+    int ret;
 
     assert(dst->bs == bs);
     if (src->bs->drv->bdrv_co_copy_range_to != raw_co_copy_range_to) {
@@ -3210,7 +3362,9 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
         },
     };
 
-    return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
+    ret = raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
+    raw_bsc_invalidate(s, dst_offset, bytes);
+    return ret;
 }
 
 BlockDriver bdrv_file = {
@@ -3247,6 +3401,7 @@ BlockDriver bdrv_file = {
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
     .bdrv_get_specific_stats = raw_get_specific_stats,
@@ -3621,6 +3776,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
     .bdrv_get_specific_stats = hdev_get_specific_stats,
@@ -27,6 +27,12 @@
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
+/* Upper bound for x-perf.max-in-flight */
+#define MIRROR_MAX_IN_FLIGHT_LIMIT 1024
+/* How long the request size and depth are measured before tuning them */
+#define MIRROR_ADAPT_INTERVAL_NS (500 * SCALE_MS)
+/* Completed copy requests needed for a measurement to count */
+#define MIRROR_ADAPT_MIN_OPS 4
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -84,6 +90,34 @@ typedef struct MirrorBlockJob {
     int in_active_write_counter;
     bool prepared;
     bool in_drain;
+
+    /*
+     * Current maximum length and number of parallel copy requests, and
+     * their bounds.  The current values are only tuned when the job was
+     * started with x-perf (@adaptive).
+     */
+    int64_t io_bytes, min_io_bytes, max_io_bytes;
+    int io_depth, min_io_depth, max_io_depth;
+    bool adaptive;
+
+    /* Copy requests completed since @adapt_start_ns */
+    int64_t adapt_start_ns;
+    int64_t adapt_bytes;
+    int64_t adapt_latency_ns;
+    int adapt_ops;
+    /* Whether there was nothing left to copy at some point */
+    bool adapt_idle;
+    /* Result of the previous measurement, 0 after a step was undone */
+    uint64_t adapt_last_bps;
+    int64_t adapt_last_latency_ns;
+    /* Values before the last step */
+    int64_t adapt_prev_io_bytes;
+    int adapt_prev_io_depth;
+    /* Whether the depth or the request size is tuned */
+    bool adapt_depth;
+    /* Which way the next step on each value goes */
+    int adapt_depth_dir;
+    int adapt_bytes_dir;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -105,6 +139,8 @@ struct MirrorOp {
     bool is_pseudo_op;
     bool is_active_write;
     bool is_in_flight;
+    /* When the copy was started, for the tuning of mirror_adapt() */
+    int64_t start_ns;
     CoQueue waiting_requests;
     Coroutine *co;
 
@@ -196,6 +232,12 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
         }
+        if (op->start_ns) {
+            s->adapt_bytes += op->bytes;
+            s->adapt_latency_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                   op->start_ns;
+            s->adapt_ops++;
+        }
     }
     qemu_iovec_destroy(&op->qiov);
 
@@ -373,6 +415,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->in_flight++;
     s->bytes_in_flight += op->bytes;
     op->is_in_flight = true;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
     ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
@@ -464,7 +507,6 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -540,9 +582,9 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
                                       nb_chunks * s->granularity,
                                       &io_bytes, NULL, NULL);
         if (ret < 0) {
-            io_bytes = MIN(nb_chunks * s->granularity, max_io_bytes);
+            io_bytes = MIN(nb_chunks * s->granularity, s->io_bytes);
         } else if (ret & BDRV_BLOCK_DATA) {
-            io_bytes = MIN(io_bytes, max_io_bytes);
+            io_bytes = MIN(io_bytes, s->io_bytes);
         }
 
         io_bytes -= io_bytes % s->granularity;
@@ -561,7 +603,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->io_depth) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -821,7 +863,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->io_depth) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -877,6 +919,130 @@ static int mirror_flush(MirrorBlockJob *s)
     return ret;
 }
 
+/* Start a new measurement for mirror_adapt() */
+static void mirror_adapt_reset(MirrorBlockJob *s)
+{
+    s->adapt_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->adapt_bytes = 0;
+    s->adapt_latency_ns = 0;
+    s->adapt_ops = 0;
+    s->adapt_idle = false;
+}
+
+/* The direction of the value selected by s->adapt_depth */
+static int *mirror_adapt_dir(MirrorBlockJob *s)
+{
+    return s->adapt_depth ? &s->adapt_depth_dir : &s->adapt_bytes_dir;
+}
+
+/*
+ * Double or halve the depth or the request size, as selected by
+ * s->adapt_depth and its direction.  Returns false if it already is at
+ * its bound in that direction.
+ */
+static bool mirror_adapt_move(MirrorBlockJob *s)
+{
+    int dir = *mirror_adapt_dir(s);
+
+    if (s->adapt_depth) {
+        int depth = dir > 0 ? MIN(s->io_depth * 2, s->max_io_depth)
+                            : MAX(s->io_depth / 2, s->min_io_depth);
+        if (depth == s->io_depth) {
+            return false;
+        }
+        s->io_depth = depth;
+    } else {
+        /* Keep whole granularity chunks, as mirror_iteration() uses them */
+        int64_t bytes = dir > 0 ?
+                        MIN(s->io_bytes * 2, s->max_io_bytes) :
+                        MAX(QEMU_ALIGN_DOWN(s->io_bytes / 2, s->granularity),
+                            s->min_io_bytes);
+        if (bytes == s->io_bytes) {
+            return false;
+        }
+        s->io_bytes = bytes;
+    }
+    return true;
+}
+
+/*
+ * Take a step on the selected value in its direction if possible, else
+ * the other way, else on the other value.
+ */
+static void mirror_adapt_step(MirrorBlockJob *s)
+{
+    int i;
+
+    s->adapt_prev_io_bytes = s->io_bytes;
+    s->adapt_prev_io_depth = s->io_depth;
+    for (i = 0; i < 4 && !mirror_adapt_move(s); i++) {
+        if (i % 2 == 0) {
+            *mirror_adapt_dir(s) = -*mirror_adapt_dir(s);
+        } else {
+            s->adapt_depth = !s->adapt_depth;
+        }
+    }
+}
+
+/*
+ * Tune the number and length of the parallel copy requests by hill
+ * climbing on the throughput.  Every MIRROR_ADAPT_INTERVAL_NS, the
+ * throughput of the copies that completed is compared with the previous
+ * measurement: a step that made it better is followed by another one the
+ * same way, a step that made it worse, or that added latency for no
+ * gain, is undone and the other value is tried instead.  The next step on
+ * the value that was undone goes the other way.
+ *
+ * Intervals in which the job ran out of work, or was rate limited, tell
+ * nothing about the target and are not used.
+ */
+static void mirror_adapt(MirrorBlockJob *s, int64_t cnt)
+{
+    int64_t elapsed;
+    int64_t latency_ns;
+    uint64_t bps;
+    bool better;
+
+    if (cnt == 0) {
+        s->adapt_idle = true;
+    }
+
+    elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->adapt_start_ns;
+    if (elapsed < MIRROR_ADAPT_INTERVAL_NS) {
+        return;
+    }
+    if (s->adapt_idle || s->common.speed ||
+        s->adapt_ops < MIRROR_ADAPT_MIN_OPS) {
+        mirror_adapt_reset(s);
+        return;
+    }
+
+    bps = s->adapt_bytes * (double)NANOSECONDS_PER_SECOND / elapsed;
+    latency_ns = s->adapt_latency_ns / s->adapt_ops;
+    better = bps * 20 > s->adapt_last_bps * 21;
+
+    if (s->adapt_last_bps &&
+        (bps * 20 < s->adapt_last_bps * 19 ||
+         (!better && latency_ns * 4 > s->adapt_last_latency_ns * 5))) {
+        /* Measure again from where we were, then try the other value */
+        s->io_bytes = s->adapt_prev_io_bytes;
+        s->io_depth = s->adapt_prev_io_depth;
+        *mirror_adapt_dir(s) = -*mirror_adapt_dir(s);
+        s->adapt_depth = !s->adapt_depth;
+        s->adapt_last_bps = 0;
+    } else {
+        if (s->adapt_last_bps && !better) {
+            s->adapt_depth = !s->adapt_depth;
+        }
+        mirror_adapt_step(s);
+        s->adapt_last_bps = bps;
+        s->adapt_last_latency_ns = latency_ns;
+    }
+
+    trace_mirror_adapt(s, bps, latency_ns, s->io_bytes, s->io_depth);
+    mirror_adapt_reset(s);
+}
+
 static int coroutine_fn mirror_run(Job *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
@@ -973,6 +1139,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     assert(!s->dbi);
     s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap);
+    mirror_adapt_reset(s);
     for (;;) {
         uint64_t delay_ns = 0;
         int64_t cnt, delta;
@@ -997,6 +1164,10 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
          * the current remaining operation length */
         job_progress_set_remaining(&s->common.job, s->bytes_in_flight + cnt);
 
+        if (s->adaptive) {
+            mirror_adapt(s, cnt);
+        }
+
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that bdrv_drain_all() returns.
          * We do so every BLKOCK_JOB_SLICE_TIME nanoseconds, or when there is
@@ -1004,7 +1175,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->io_depth || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1162,6 +1333,14 @@ static void coroutine_fn mirror_pause(Job *job)
     mirror_wait_for_all_io(s);
 }
 
+static void coroutine_fn mirror_resume(Job *job)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
+
+    /* The time spent paused must not count as slow copying */
+    mirror_adapt_reset(s);
+}
+
 static bool mirror_drained_poll(BlockJob *job)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
@@ -1186,6 +1365,18 @@ static void mirror_cancel(Job *job)
     bdrv_cancel_in_flight(target);
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (s->adaptive) {
+        info->has_mirror = true;
+        info->mirror = g_new0(BlockJobInfoMirror, 1);
+        info->mirror->chunk_size = s->io_bytes;
+        info->mirror->max_in_flight = s->io_depth;
+    }
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(MirrorBlockJob),
@@ -1196,10 +1387,12 @@ static const BlockJobDriver mirror_job_driver = {
         .prepare                = mirror_prepare,
         .abort                  = mirror_abort,
         .pause                  = mirror_pause,
+        .resume                 = mirror_resume,
         .complete               = mirror_complete,
         .cancel                 = mirror_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1212,9 +1405,11 @@ static const BlockJobDriver commit_active_job_driver = {
         .prepare                = mirror_prepare,
         .abort                  = mirror_abort,
         .pause                  = mirror_pause,
+        .resume                 = mirror_resume,
         .complete               = mirror_complete,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
@@ -1575,13 +1770,16 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
-                             Error **errp)
+                             const MirrorPerf *perf, Error **errp)
 {
     MirrorBlockJob *s;
     MirrorBDSOpaque *bs_opaque;
     BlockDriverState *mirror_top_bs;
     bool target_is_backing;
     uint64_t target_perms, target_shared_perms;
+    int64_t io_bytes, min_io_bytes, max_io_bytes;
+    int io_depth, min_io_depth, max_io_depth;
+    bool default_buf_size;
     int ret;
 
     if (granularity == 0) {
@@ -1595,10 +1793,90 @@ static BlockJob *mirror_start_job(
         return NULL;
     }
 
-    if (buf_size == 0) {
+    default_buf_size = buf_size == 0;
+    if (default_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
 
+    io_bytes = MAX(buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    io_depth = MAX_IN_FLIGHT;
+    min_io_bytes = max_io_bytes = io_bytes;
+    min_io_depth = max_io_depth = io_depth;
+
+    if (perf) {
+        if ((perf->has_min_chunk &&
+             (perf->min_chunk < 1 ||
+              perf->min_chunk > BDRV_REQUEST_MAX_BYTES)) ||
+            (perf->has_max_chunk &&
+             (perf->max_chunk < 1 ||
+              perf->max_chunk > BDRV_REQUEST_MAX_BYTES)))
+        {
+            error_setg(errp, "x-perf chunk sizes must be between 1 and %d",
+                       BDRV_REQUEST_MAX_BYTES);
+            return NULL;
+        }
+        if (perf->has_min_chunk && perf->has_max_chunk &&
+            perf->min_chunk > perf->max_chunk) {
+            error_setg(errp, "min-chunk must not be greater than max-chunk");
+            return NULL;
+        }
+        if ((perf->has_min_in_flight &&
+             (perf->min_in_flight < 1 ||
+              perf->min_in_flight > MIRROR_MAX_IN_FLIGHT_LIMIT)) ||
+            (perf->has_max_in_flight &&
+             (perf->max_in_flight < 1 ||
+              perf->max_in_flight > MIRROR_MAX_IN_FLIGHT_LIMIT)))
+        {
+            error_setg(errp, "x-perf request counts must be between 1 and %d",
+                       MIRROR_MAX_IN_FLIGHT_LIMIT);
+            return NULL;
+        }
+        if (perf->has_min_in_flight && perf->has_max_in_flight &&
+            perf->min_in_flight > perf->max_in_flight) {
+            error_setg(errp,
+                       "min-in-flight must not be greater than max-in-flight");
+            return NULL;
+        }
+
+        /* A bound that is not given is the fixed value, or the other one */
+        if (perf->has_min_chunk) {
+            min_io_bytes = perf->min_chunk;
+            max_io_bytes = MAX(max_io_bytes, min_io_bytes);
+        }
+        if (perf->has_max_chunk) {
+            max_io_bytes = perf->max_chunk;
+            min_io_bytes = MIN(min_io_bytes, max_io_bytes);
+        }
+        if (perf->has_min_in_flight) {
+            min_io_depth = perf->min_in_flight;
+            max_io_depth = MAX(max_io_depth, min_io_depth);
+        }
+        if (perf->has_max_in_flight) {
+            max_io_depth = perf->max_in_flight;
+            min_io_depth = MIN(min_io_depth, max_io_depth);
+        }
+
+        if (default_buf_size) {
+            buf_size = MAX(buf_size, max_io_bytes);
+            buf_size = MAX(buf_size, max_io_depth * min_io_bytes);
+        } else if (min_io_bytes > buf_size) {
+            error_setg(errp, "min-chunk must not be greater than buf-size");
+            return NULL;
+        }
+        max_io_bytes = MIN(max_io_bytes, buf_size);
+
+        io_bytes = MIN(MAX(io_bytes, min_io_bytes), max_io_bytes);
+        io_depth = MIN(MAX(io_depth, min_io_depth), max_io_depth);
+    }
+
+    /*
+     * Copy requests are made of whole granularity chunks, so that the
+     * length shown by query-block-jobs is the one that is used
+     */
+    io_bytes = ROUND_UP(io_bytes, granularity);
+    min_io_bytes = ROUND_UP(min_io_bytes, granularity);
+    max_io_bytes = ROUND_UP(max_io_bytes, granularity);
+
     if (bdrv_skip_filters(bs) == bdrv_skip_filters(target)) {
         error_setg(errp, "Can't mirror node into itself");
         return NULL;
@@ -1737,6 +2015,15 @@ static BlockJob *mirror_start_job(
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->io_bytes = io_bytes;
+    s->min_io_bytes = min_io_bytes;
+    s->max_io_bytes = max_io_bytes;
+    s->io_depth = io_depth;
+    s->min_io_depth = min_io_depth;
+    s->max_io_depth = max_io_depth;
+    s->adaptive = perf != NULL;
+    s->adapt_depth_dir = 1;
+    s->adapt_bytes_dir = 1;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -1848,7 +2135,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, const MirrorPerf *perf,
+                  Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -1865,7 +2153,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, errp);
+                     filter_node_name, true, copy_mode, perf, errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -1892,7 +2180,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     errp);
+                     NULL, errp);
     if (!job) {
         goto error_restore_flags;
     }
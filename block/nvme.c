@@ -32,6 +32,8 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_DOORBELL_SIZE 4096
+/* Maximum number of queue pairs, including the admin queue */
+#define NVME_MAX_QUEUES 64
 
 /*
  * We have to leave one slot empty as that is the full queue case where
@@ -74,6 +76,11 @@ typedef struct {
     /* Read from I/O code path, initialized under BQL */
     BDRVNVMeState   *s;
     int             index;
+    /* The CQ raises no interrupt, completions are reaped by poll_bh */
+    bool            poll_only;
+
+    /* The AioContext that submits to this queue pair, NULL if none */
+    AioContext      *aio_context;
 
     /* Fields protected by BQL */
     uint8_t     *prp_list_pages;
@@ -89,6 +96,7 @@ typedef struct {
 
     /* Thread-safe, no lock necessary */
     QEMUBH      *completion_bh;
+    QEMUBH      *poll_bh;
 } NVMeQueuePair;
 
 struct BDRVNVMeState {
@@ -102,10 +110,18 @@ struct BDRVNVMeState {
     } *doorbells;
     /* The submission/completion queue pairs.
      * [0]: admin queue.
-     * [1..]: io queues.
+     * [1]: io queue of the node's AioContext.
+     * [2..]: io queues created on demand for other AioContexts.
      */
     NVMeQueuePair **queues;
     unsigned queue_count;
+    unsigned max_queues;
+    /* Serializes the creation of io queues on demand */
+    CoMutex queue_lock;
+    /* The controller refused to create another io queue */
+    bool queues_exhausted;
+    /* Create the io queue of the node's AioContext without interrupts */
+    bool poll_only;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -140,8 +156,10 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_POLL_ONLY "poll-only"
 
 static void nvme_process_completion_bh(void *opaque);
+static void nvme_poll_bh(void *opaque);
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -157,6 +175,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_POLL_ONLY,
+            .type = QEMU_OPT_BOOL,
+            .help = "Poll the io queue instead of using interrupts",
+        },
         { /* end of list */ }
     },
 };
@@ -184,12 +207,34 @@ static bool nvme_init_queue(BDRVNVMeState *s, NVMeQueue *q,
     return true;
 }
 
-static void nvme_free_queue_pair(NVMeQueuePair *q)
+/* Let @aio_context submit to @q and reap its completions */
+static void nvme_bind_queue_pair(NVMeQueuePair *q, AioContext *aio_context)
 {
-    trace_nvme_free_queue_pair(q->index, q);
+    q->completion_bh = aio_bh_new(aio_context, nvme_process_completion_bh, q);
+    if (q->poll_only) {
+        q->poll_bh = aio_bh_new(aio_context, nvme_poll_bh, q);
+    }
+    qatomic_store_release(&q->aio_context, aio_context);
+}
+
+/* Called with no command in flight on @q */
+static void nvme_unbind_queue_pair(NVMeQueuePair *q)
+{
+    qatomic_set(&q->aio_context, NULL);
     if (q->completion_bh) {
         qemu_bh_delete(q->completion_bh);
+        q->completion_bh = NULL;
+    }
+    if (q->poll_bh) {
+        qemu_bh_delete(q->poll_bh);
+        q->poll_bh = NULL;
     }
+}
+
+static void nvme_free_queue_pair(NVMeQueuePair *q)
+{
+    trace_nvme_free_queue_pair(q->index, q);
+    nvme_unbind_queue_pair(q);
     qemu_vfree(q->prp_list_pages);
     qemu_vfree(q->sq.queue);
     qemu_vfree(q->cq.queue);
@@ -211,7 +256,7 @@ static void nvme_free_req_queue_cb(void *opaque)
 static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
                                              AioContext *aio_context,
                                              unsigned idx, size_t size,
-                                             Error **errp)
+                                             bool poll_only, Error **errp)
 {
     int i, r;
     NVMeQueuePair *q;
@@ -234,8 +279,9 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
     qemu_mutex_init(&q->lock);
     q->s = s;
     q->index = idx;
+    q->poll_only = poll_only;
     qemu_co_queue_init(&q->free_req_queue);
-    q->completion_bh = aio_bh_new(aio_context, nvme_process_completion_bh, q);
+    nvme_bind_queue_pair(q, aio_context);
     r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages, bytes,
                           false, &prp_list_iova);
     if (r) {
@@ -282,6 +328,9 @@ static void nvme_kick(NVMeQueuePair *q)
     *q->sq.doorbell = cpu_to_le32(q->sq.tail);
     q->inflight += q->need_kick;
     q->need_kick = 0;
+    if (q->poll_bh) {
+        qemu_bh_schedule(q->poll_bh);
+    }
 }
 
 /* Find a free request element if any, otherwise:
@@ -323,7 +372,7 @@ static void nvme_put_free_req_locked(NVMeQueuePair *q, NVMeRequest *req)
 static void nvme_wake_free_req_locked(NVMeQueuePair *q)
 {
     if (!qemu_co_queue_empty(&q->free_req_queue)) {
-        replay_bh_schedule_oneshot_event(q->s->aio_context,
+        replay_bh_schedule_oneshot_event(q->aio_context,
                 nvme_free_req_queue_cb, q);
     }
 }
@@ -483,6 +532,29 @@ static void nvme_submit_command(NVMeQueuePair *q, NVMeRequest *req,
     qemu_mutex_unlock(&q->lock);
 }
 
+typedef struct {
+    Coroutine *co;
+    int ret;
+    AioContext *ctx;
+} NVMeCoData;
+
+static void nvme_rw_cb_bh(void *opaque)
+{
+    NVMeCoData *data = opaque;
+    qemu_coroutine_enter(data->co);
+}
+
+static void nvme_rw_cb(void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+    data->ret = ret;
+    if (!data->co) {
+        /* The rw coroutine hasn't yielded, don't try to enter. */
+        return;
+    }
+    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
+}
+
 static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
 {
     int *pret = opaque;
@@ -507,6 +579,36 @@ static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
     return ret;
 }
 
+/* Must be called in the node's AioContext */
+static coroutine_fn int nvme_co_admin_cmd(BlockDriverState *bs, NvmeCmd *cmd)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *q = s->queues[INDEX_ADMIN];
+    NVMeRequest *req;
+    NVMeCoData data = {
+        .ctx = qemu_get_current_aio_context(),
+        .ret = -EINPROGRESS,
+    };
+
+    req = nvme_get_free_req(q);
+    assert(req);
+    nvme_submit_command(q, req, cmd, nvme_rw_cb, &data);
+
+    data.co = qemu_coroutine_self();
+    while (data.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return data.ret;
+}
+
+static int nvme_admin_cmd(BlockDriverState *bs, NvmeCmd *cmd)
+{
+    if (qemu_in_coroutine()) {
+        return nvme_co_admin_cmd(bs, cmd);
+    }
+    return nvme_admin_cmd_sync(bs, cmd);
+}
+
 /* Returns true on success, false on failure. */
 static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
@@ -625,12 +727,34 @@ static bool nvme_poll_queue(NVMeQueuePair *q)
     return progress;
 }
 
+/*
+ * A poll-only queue pair keeps its BH scheduled while commands are in
+ * flight, so that its AioContext busy-polls the completion queue instead
+ * of waiting for an interrupt.
+ */
+static void nvme_poll_bh(void *opaque)
+{
+    NVMeQueuePair *q = opaque;
+
+    nvme_poll_queue(q);
+
+    qemu_mutex_lock(&q->lock);
+    if (q->inflight) {
+        qemu_bh_schedule(q->poll_bh);
+    }
+    qemu_mutex_unlock(&q->lock);
+}
+
+/* Poll the queue pairs that use the shared interrupt */
 static bool nvme_poll_queues(BDRVNVMeState *s)
 {
     bool progress = false;
     int i;
 
     for (i = 0; i < s->queue_count; i++) {
+        if (s->queues[i]->poll_only) {
+            continue;
+        }
         if (nvme_poll_queue(s->queues[i])) {
             progress = true;
         }
@@ -648,7 +772,13 @@ static void nvme_handle_event(EventNotifier *n)
     nvme_poll_queues(s);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+/*
+ * Create an io queue pair for @aio_context.  Must be called in the node's
+ * AioContext, which processes the admin commands.
+ */
+static NVMeQueuePair *nvme_add_io_queue(BlockDriverState *bs,
+                                        AioContext *aio_context,
+                                        bool poll_only, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     unsigned n = s->queue_count;
@@ -656,19 +786,18 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     NvmeCmd cmd;
     unsigned queue_size = NVME_QUEUE_SIZE;
 
-    assert(n <= UINT16_MAX);
-    q = nvme_create_queue_pair(s, bdrv_get_aio_context(bs),
-                               n, queue_size, errp);
+    assert(n < s->max_queues);
+    q = nvme_create_queue_pair(s, aio_context, n, queue_size, poll_only, errp);
     if (!q) {
-        return false;
+        return NULL;
     }
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .dptr.prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
-        .cdw11 = cpu_to_le32(NVME_CQ_IEN | NVME_CQ_PC),
+        .cdw11 = cpu_to_le32((poll_only ? 0 : NVME_CQ_IEN) | NVME_CQ_PC),
     };
-    if (nvme_admin_cmd_sync(bs, &cmd)) {
+    if (nvme_admin_cmd(bs, &cmd)) {
         error_setg(errp, "Failed to create CQ io queue [%u]", n);
         goto out_error;
     }
@@ -678,17 +807,78 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
         .cdw11 = cpu_to_le32(NVME_SQ_PC | (n << 16)),
     };
-    if (nvme_admin_cmd_sync(bs, &cmd)) {
+    if (nvme_admin_cmd(bs, &cmd)) {
         error_setg(errp, "Failed to create SQ io queue [%u]", n);
         goto out_error;
     }
-    s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
-    s->queue_count++;
-    return true;
+    qatomic_store_release(&s->queue_count, n + 1);
+    return q;
 out_error:
     nvme_free_queue_pair(q);
-    return false;
+    return NULL;
+}
+
+static NVMeQueuePair *nvme_find_io_queue(BDRVNVMeState *s,
+                                         AioContext *aio_context)
+{
+    unsigned count = qatomic_load_acquire(&s->queue_count);
+
+    for (unsigned i = INDEX_IO(0); i < count; i++) {
+        NVMeQueuePair *q = s->queues[i];
+
+        if (qatomic_load_acquire(&q->aio_context) == aio_context) {
+            return q;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Return the io queue pair of the current AioContext.  The node's
+ * AioContext uses the queue pair created when the node was opened.  Any
+ * other AioContext gets a poll-only queue pair of its own on first use, so
+ * that requests from several threads go to independent hardware queues.
+ * Once the controller refuses to create more, the node's queue pair is
+ * shared.
+ */
+static coroutine_fn NVMeQueuePair *nvme_co_get_io_queue(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    NVMeQueuePair *q;
+    Error *local_err = NULL;
+
+    /* The common case, where the lookup and the lock are not needed */
+    if (ctx == bdrv_get_aio_context(bs)) {
+        return s->queues[INDEX_IO(0)];
+    }
+
+    q = nvme_find_io_queue(s, ctx);
+    if (q) {
+        return q;
+    }
+
+    qemu_co_mutex_lock(&s->queue_lock);
+    q = nvme_find_io_queue(s, ctx);
+    if (!q) {
+        /* Queue pairs left behind by a previous AioContext can be reused */
+        q = nvme_find_io_queue(s, NULL);
+        if (q) {
+            nvme_bind_queue_pair(q, ctx);
+        } else if (!s->queues_exhausted && s->queue_count < s->max_queues) {
+            aio_co_reschedule_self(bdrv_get_aio_context(bs));
+            q = nvme_add_io_queue(bs, ctx, true, &local_err);
+            aio_co_reschedule_self(ctx);
+            if (!q) {
+                warn_reportf_err(local_err, "Sharing the NVMe io queue: ");
+                s->queues_exhausted = true;
+            }
+        }
+    }
+    qemu_co_mutex_unlock(&s->queue_lock);
+
+    return q ?: s->queues[INDEX_IO(0)];
 }
 
 static bool nvme_poll_cb(void *opaque)
@@ -715,6 +905,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_co_mutex_init(&s->queue_lock);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
@@ -761,6 +952,9 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     s->page_size = 1u << (12 + NVME_CAP_MPSMIN(cap));
     s->doorbell_scale = (4 << NVME_CAP_DSTRD(cap)) / sizeof(uint32_t);
+    s->max_queues = MIN(NVME_MAX_QUEUES,
+                        NVME_DOORBELL_SIZE /
+                        (sizeof(*s->doorbells) * s->doorbell_scale));
     bs->bl.opt_mem_alignment = s->page_size;
     bs->bl.request_alignment = s->page_size;
     timeout_ms = MIN(500 * NVME_CAP_TO(cap), 30000);
@@ -794,8 +988,9 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up admin queue. */
-    s->queues = g_new(NVMeQueuePair *, 1);
-    q = nvme_create_queue_pair(s, aio_context, 0, NVME_QUEUE_SIZE, errp);
+    s->queues = g_new0(NVMeQueuePair *, s->max_queues);
+    q = nvme_create_queue_pair(s, aio_context, 0, NVME_QUEUE_SIZE, false,
+                               errp);
     if (!q) {
         ret = -EINVAL;
         goto out;
@@ -840,7 +1035,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    if (!nvme_add_io_queue(bs, aio_context, s->poll_only, errp)) {
         ret = -EIO;
     }
 out:
@@ -947,6 +1142,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
+    s->poll_only = qemu_opt_get_bool(opts, NVME_BLOCK_OPT_POLL_ONLY, false);
     ret = nvme_init(bs, device, namespace, errp);
     qemu_opts_del(opts);
     if (ret) {
@@ -1088,29 +1284,6 @@ fail:
     return r;
 }
 
-typedef struct {
-    Coroutine *co;
-    int ret;
-    AioContext *ctx;
-} NVMeCoData;
-
-static void nvme_rw_cb_bh(void *opaque)
-{
-    NVMeCoData *data = opaque;
-    qemu_coroutine_enter(data->co);
-}
-
-static void nvme_rw_cb(void *opaque, int ret)
-{
-    NVMeCoData *data = opaque;
-    data->ret = ret;
-    if (!data->co) {
-        /* The rw coroutine hasn't yielded, don't try to enter. */
-        return;
-    }
-    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
-}
-
 static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
                                             uint64_t offset, uint64_t bytes,
                                             QEMUIOVector *qiov,
@@ -1119,7 +1292,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_co_get_io_queue(bs);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1132,7 +1305,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1237,14 +1410,14 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_co_get_io_queue(bs);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1268,7 +1441,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_co_get_io_queue(bs);
     NVMeRequest *req;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
@@ -1285,7 +1458,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1321,7 +1494,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_co_get_io_queue(bs);
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
@@ -1335,7 +1508,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1447,10 +1620,7 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
     BDRVNVMeState *s = bs->opaque;
 
     for (unsigned i = 0; i < s->queue_count; i++) {
-        NVMeQueuePair *q = s->queues[i];
-
-        qemu_bh_delete(q->completion_bh);
-        q->completion_bh = NULL;
+        nvme_unbind_queue_pair(s->queues[i]);
     }
 
     aio_set_event_notifier(bdrv_get_aio_context(bs),
@@ -1467,12 +1637,9 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     aio_set_event_notifier(new_context, &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
                            false, nvme_handle_event, nvme_poll_cb);
 
-    for (unsigned i = 0; i < s->queue_count; i++) {
-        NVMeQueuePair *q = s->queues[i];
-
-        q->completion_bh =
-            aio_bh_new(new_context, nvme_process_completion_bh, q);
-    }
+    /* The queue pairs of other AioContexts stay unbound until reused */
+    nvme_bind_queue_pair(s->queues[INDEX_ADMIN], new_context);
+    nvme_bind_queue_pair(s->queues[INDEX_IO(0)], new_context);
 }
 
 static void nvme_aio_plug(BlockDriverState *bs)
@@ -1489,6 +1656,9 @@ static void nvme_aio_unplug(BlockDriverState *bs)
     s->plugged = false;
     for (unsigned i = INDEX_IO(0); i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
+        if (!qatomic_read(&q->aio_context)) {
+            continue;
+        }
         qemu_mutex_lock(&q->lock);
         nvme_kick(q);
         nvme_process_completion(q);
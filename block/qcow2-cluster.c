@@ -1545,6 +1545,87 @@ out:
     return ret;
 }
 
+/*
+ * Gives the clusters that are left in the cluster pool back to the free
+ * space of the image.  They have a refcount of one but are not referenced
+ * by any L2 table yet.
+ *
+ * This must be called before anything that expects every allocated
+ * cluster to be in use (image checks, truncation), and before the image
+ * is closed or inactivated, because otherwise the clusters are leaked.
+ */
+void qcow2_release_cluster_pool(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->cluster_pool_clusters == 0) {
+        return;
+    }
+
+    trace_qcow2_release_cluster_pool(bs, s->cluster_pool_offset,
+                                     s->cluster_pool_clusters);
+    qcow2_free_clusters(bs, s->cluster_pool_offset,
+                        s->cluster_pool_clusters << s->cluster_bits,
+                        QCOW2_DISCARD_NEVER);
+    s->cluster_pool_offset = 0;
+    s->cluster_pool_clusters = 0;
+}
+
+/*
+ * Takes up to *nb_clusters clusters from the start of the cluster pool.
+ * If *host_offset is not INV_OFFSET, the clusters are only taken if the
+ * pool starts there; otherwise the pool is refilled first if it is empty.
+ *
+ * Returns true and updates *host_offset and *nb_clusters if clusters were
+ * taken from the pool, false if the caller must allocate on its own (the
+ * pool is disabled, or doesn't match *host_offset).  Returns a negative
+ * errno in *ret if refilling the pool failed.
+ */
+static bool cluster_pool_take(BlockDriverState *bs, uint64_t *host_offset,
+                              uint64_t *nb_clusters, int *ret)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t pool_size = s->cluster_pool_size >> s->cluster_bits;
+    uint64_t n;
+
+    *ret = 0;
+
+    if (*host_offset != INV_OFFSET) {
+        if (s->cluster_pool_clusters == 0 ||
+            s->cluster_pool_offset != *host_offset) {
+            return false;
+        }
+    } else if (s->cluster_pool_clusters == 0) {
+        int64_t offset;
+
+        if (pool_size == 0) {
+            return false;
+        }
+
+        /*
+         * Allocate what the request needs plus a full pool in one go, so
+         * that the refcount blocks are only touched once for all of it.
+         */
+        offset = qcow2_alloc_clusters(bs, (*nb_clusters + pool_size) <<
+                                      s->cluster_bits);
+        if (offset < 0) {
+            *ret = offset;
+            return true;
+        }
+        trace_qcow2_refill_cluster_pool(bs, offset, *nb_clusters + pool_size);
+        s->cluster_pool_offset = offset;
+        s->cluster_pool_clusters = *nb_clusters + pool_size;
+    }
+
+    n = MIN(*nb_clusters, s->cluster_pool_clusters);
+    *host_offset = s->cluster_pool_offset;
+    *nb_clusters = n;
+    s->cluster_pool_offset += n << s->cluster_bits;
+    s->cluster_pool_clusters -= n;
+
+    return true;
+}
+
 /*
  * Allocates new clusters for the given guest_offset.
  *
@@ -1557,6 +1638,9 @@ out:
  * this case if the cluster at host_offset is already in use. If *host_offset
  * is INV_OFFSET, the clusters can be allocated anywhere in the image file.
  *
+ * When the cluster pool is enabled, the clusters are taken from it and their
+ * refcounts need no update here.
+ *
  * *host_offset is updated to contain the offset into the image file at which
  * the first allocated cluster starts.
  *
@@ -1568,6 +1652,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
                                    uint64_t *host_offset, uint64_t *nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
+    int ret;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
@@ -1581,6 +1666,9 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
+    if (cluster_pool_take(bs, host_offset, nb_clusters, &ret)) {
+        return ret;
+    }
     if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
@@ -0,0 +1,236 @@
+/*
+ * Sequential read-ahead for qcow2
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/coroutine.h"
+#include "block/block_int.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/*
+ * Once reads have been sequential for a few requests, a background
+ * coroutine looks up the mapping of the next window, which loads the
+ * L2 slices it needs (and a few more) into the L2 cache, and reads the
+ * first run of data clusters into a buffer.  The data can come either
+ * from the data file or, for unallocated clusters, from the backing
+ * chain, so reading a cold overlay also reads ahead in its backing file.
+ *
+ * The buffer is keyed by the child it was read from and the offset in
+ * that child.  It is only used while the write generation of the child
+ * is the one it had when the read started, so any write to the child
+ * (data, metadata, discard or truncate) invalidates it.
+ */
+
+/* Sequential requests before the read-ahead starts */
+#define QCOW2_READAHEAD_MIN_STREAK 2
+
+void qcow2_readahead_drop(BlockDriverState *bs)
+{
+    Qcow2Readahead *ra = &((BDRVQcow2State *)bs->opaque)->readahead;
+
+    qemu_vfree(ra->buf);
+    ra->buf = NULL;
+    ra->buf_child = NULL;
+    ra->buf_bytes = 0;
+    ra->window = 0;
+    ra->streak = 0;
+    ra->ahead_offset = 0;
+    ra->ahead_end = 0;
+}
+
+/*
+ * Update the sequential stream detection for a read of @bytes at
+ * @offset, and wait for the read-ahead that is running for it
+ */
+void coroutine_fn qcow2_readahead_start_read(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Readahead *ra = &s->readahead;
+
+    if (!ra->max_size) {
+        return;
+    }
+
+    if (offset == ra->next_offset) {
+        ra->streak++;
+        if (ra->streak >= QCOW2_READAHEAD_MIN_STREAK) {
+            ra->window = ra->window ? ra->window * 2
+                                    : MAX(bytes * 2, s->cluster_size);
+            ra->window = MIN(ra->window, ra->max_size);
+        }
+    } else {
+        ra->streak = 0;
+        ra->window = 0;
+    }
+    ra->next_offset = offset + bytes;
+
+    while (ra->pending_bytes && offset >= ra->pending_offset &&
+           offset < ra->pending_offset + ra->pending_bytes)
+    {
+        qemu_co_queue_wait(&ra->waiters, NULL);
+    }
+}
+
+/*
+ * Copy the part of the read-ahead buffer that starts at @child_offset in
+ * @child into @qiov.  Returns the number of bytes copied, which may be
+ * less than @bytes; 0 if the buffer does not start the request.
+ */
+uint64_t qcow2_readahead_copy(BlockDriverState *bs, BdrvChild *child,
+                              uint64_t child_offset, uint64_t bytes,
+                              QEMUIOVector *qiov, size_t qiov_offset)
+{
+    Qcow2Readahead *ra = &((BDRVQcow2State *)bs->opaque)->readahead;
+    uint64_t n;
+
+    if (!ra->buf || ra->buf_child != child ||
+        ra->buf_gen != qatomic_read(&child->bs->write_gen) ||
+        child_offset < ra->buf_start ||
+        child_offset >= ra->buf_start + ra->buf_bytes)
+    {
+        return 0;
+    }
+
+    n = MIN(bytes, ra->buf_start + ra->buf_bytes - child_offset);
+    qemu_iovec_from_buf(qiov, qiov_offset,
+                        ra->buf + (child_offset - ra->buf_start), n);
+    return n;
+}
+
+static void coroutine_fn qcow2_readahead_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Readahead *ra = &s->readahead;
+    uint64_t offset = ra->pending_offset;
+    uint64_t end = offset + ra->pending_bytes;
+    uint64_t l2_span = (uint64_t) s->l2_slice_size << s->cluster_bits;
+    uint64_t host_offset = 0, child_offset = 0, l2_offset;
+    unsigned int cur_bytes = 0, n;
+    QCow2SubclusterType type;
+    BdrvChild *child = NULL;
+    unsigned int gen = 0;
+    void *buf = NULL;
+    int i, ret;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    /* Skip what reads as zeroes, stop at what can't be read directly */
+    while (offset < end) {
+        cur_bytes = end - offset;
+        ret = qcow2_get_host_offset(bs, offset, &cur_bytes, &host_offset,
+                                    &type);
+        if (ret < 0) {
+            end = offset;
+            break;
+        }
+        if (type == QCOW2_SUBCLUSTER_NORMAL && !bs->encrypted) {
+            child = s->data_file;
+            child_offset = host_offset;
+            break;
+        }
+        if ((type == QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN ||
+             type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC) && bs->backing) {
+            child = bs->backing;
+            child_offset = offset;
+            break;
+        }
+        if (type != QCOW2_SUBCLUSTER_ZERO_PLAIN &&
+            type != QCOW2_SUBCLUSTER_ZERO_ALLOC &&
+            type != QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN &&
+            type != QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC) {
+            end = offset;
+            break;
+        }
+        offset += cur_bytes;
+    }
+
+    /* Load the L2 slices that the following windows are going to need */
+    l2_offset = QEMU_ALIGN_UP(end, l2_span);
+    for (i = 0; i < ra->l2_slices &&
+                l2_offset < bs->total_sectors * BDRV_SECTOR_SIZE; i++) {
+        n = 1;
+        if (qcow2_get_host_offset(bs, l2_offset, &n, &host_offset,
+                                  &type) < 0) {
+            break;
+        }
+        l2_offset += l2_span;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (!child) {
+        goto out;
+    }
+
+    end = offset + cur_bytes;
+    trace_qcow2_readahead(bs, offset, cur_bytes, child == bs->backing);
+
+    buf = qemu_try_blockalign(child->bs, cur_bytes);
+    if (!buf) {
+        goto out;
+    }
+
+    gen = qatomic_read(&child->bs->write_gen);
+    if (child == bs->backing) {
+        BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
+    } else {
+        BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+    }
+    ret = bdrv_co_pread(child, child_offset, cur_bytes, buf, 0);
+
+    /* Drop what a write or a drained section may have made stale */
+    if (ret < 0 || bs->quiesce_counter ||
+        gen != qatomic_read(&child->bs->write_gen)) {
+        qemu_vfree(buf);
+        goto out;
+    }
+
+    qemu_vfree(ra->buf);
+    ra->buf = buf;
+    ra->buf_child = child;
+    ra->buf_start = child_offset;
+    ra->buf_bytes = cur_bytes;
+    ra->buf_gen = gen;
+
+out:
+    ra->ahead_offset = ra->pending_offset;
+    ra->ahead_end = end;
+    ra->pending_bytes = 0;
+    qemu_co_queue_restart_all(&ra->waiters);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Start reading the next window in the background if the reads are
+ * sequential and the previous read-ahead is not far enough ahead
+ */
+void qcow2_readahead_kick(BlockDriverState *bs)
+{
+    Qcow2Readahead *ra = &((BDRVQcow2State *)bs->opaque)->readahead;
+    uint64_t size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t offset = ra->next_offset;
+    Coroutine *co;
+
+    if (!ra->window || ra->pending_bytes || bs->quiesce_counter ||
+        offset >= size) {
+        return;
+    }
+
+    if (offset >= ra->ahead_offset &&
+        offset + ra->window / 2 <= ra->ahead_end) {
+        return;
+    }
+
+    ra->pending_offset = offset;
+    ra->pending_bytes = MIN(ra->window, size - offset);
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_readahead_entry, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
@@ -25,6 +25,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qcow2.h"
+#include "qemu/bitmap.h"
 #include "qemu/range.h"
 #include "qemu/bswap.h"
 #include "qemu/cutils.h"
@@ -84,6 +85,194 @@ static Qcow2SetRefcountFunc *const set_refcount_funcs[] = {
 /*********************************************************/
 /* refcount handling */
 
+/*********************************************************/
+/* in-memory map of used clusters */
+
+/*
+ * Forget everything the used cluster map knows; it is rebuilt from the
+ * refcount blocks when it is needed again.  Must be called whenever the
+ * refcounts are changed behind update_refcount()'s back.
+ */
+static void used_clusters_drop(BDRVQcow2State *s)
+{
+    if (s->used_clusters) {
+        hbitmap_free(s->used_clusters);
+        s->used_clusters = NULL;
+    }
+    g_free(s->used_clusters_loaded);
+    s->used_clusters_loaded = NULL;
+    s->used_clusters_refblocks = 0;
+}
+
+/*
+ * Makes sure the map covers the refcount blocks up to (and excluding)
+ * @nb_refblocks.  Clusters behind the last refcount block are free, so the
+ * map doesn't need to cover the whole refcount table.
+ */
+static void used_clusters_grow(BDRVQcow2State *s, uint64_t nb_refblocks)
+{
+    if (!s->used_clusters) {
+        s->used_clusters = hbitmap_alloc(nb_refblocks <<
+                                         s->refcount_block_bits, 0);
+        s->used_clusters_loaded = bitmap_new(nb_refblocks);
+        s->used_clusters_refblocks = nb_refblocks;
+    } else if (nb_refblocks > s->used_clusters_refblocks) {
+        hbitmap_truncate(s->used_clusters,
+                         nb_refblocks << s->refcount_block_bits);
+        s->used_clusters_loaded =
+            bitmap_zero_extend(s->used_clusters_loaded,
+                               s->used_clusters_refblocks, nb_refblocks);
+        s->used_clusters_refblocks = nb_refblocks;
+    }
+}
+
+/*
+ * Called when refcount block @refblock_index is hooked up in the refcount
+ * table, so that the map reads it next time instead of taking it for empty.
+ */
+static void used_clusters_invalidate(BDRVQcow2State *s, uint64_t refblock_index)
+{
+    if (!s->used_clusters) {
+        return;
+    }
+    if (refblock_index >= s->used_clusters_refblocks) {
+        used_clusters_grow(s, refblock_index + 1);
+        return;
+    }
+    clear_bit(refblock_index, s->used_clusters_loaded);
+    hbitmap_reset(s->used_clusters, refblock_index << s->refcount_block_bits,
+                  s->refcount_block_size);
+}
+
+/*
+ * Keeps the map in sync with a refcount change made by update_refcount().
+ * Refcount blocks that haven't been loaded yet will be read with the new
+ * value anyway.
+ */
+static void used_clusters_update(BDRVQcow2State *s, uint64_t cluster_index,
+                                 uint64_t refcount)
+{
+    uint64_t refblock_index = cluster_index >> s->refcount_block_bits;
+
+    if (!s->used_clusters || refblock_index >= s->used_clusters_refblocks ||
+        !test_bit(refblock_index, s->used_clusters_loaded)) {
+        return;
+    }
+    if (refcount) {
+        hbitmap_set(s->used_clusters, cluster_index, 1);
+    } else {
+        hbitmap_reset(s->used_clusters, cluster_index, 1);
+    }
+}
+
+/* Reads refcount block @refblock_index into the map if it isn't there yet */
+static int used_clusters_load(BlockDriverState *bs, uint64_t refblock_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t first_cluster = refblock_index << s->refcount_block_bits;
+    int64_t refblock_offset;
+    void *refblock;
+    uint64_t i, start;
+    int ret;
+
+    if (test_bit(refblock_index, s->used_clusters_loaded)) {
+        return 0;
+    }
+
+    refblock_offset = s->refcount_table[refblock_index] & REFT_OFFSET_MASK;
+    if (refblock_offset) {
+        if (offset_into_cluster(s, refblock_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#"
+                                    PRIx64 " unaligned (reftable index: %#"
+                                    PRIx64 ")", refblock_offset,
+                                    refblock_index);
+            return -EIO;
+        }
+
+        ret = qcow2_cache_get(bs, s->refcount_block_cache, refblock_offset,
+                              &refblock);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* Set runs of used clusters at once */
+        for (i = 0; i < s->refcount_block_size; i++) {
+            if (!s->get_refcount(refblock, i)) {
+                continue;
+            }
+            start = i;
+            while (i + 1 < s->refcount_block_size &&
+                   s->get_refcount(refblock, i + 1)) {
+                i++;
+            }
+            hbitmap_set(s->used_clusters, first_cluster + start, i + 1 - start);
+        }
+
+        qcow2_cache_put(s->refcount_block_cache, &refblock);
+    }
+
+    set_bit(refblock_index, s->used_clusters_loaded);
+    return 0;
+}
+
+/*
+ * Returns the index of the first cluster of a run of @nb_clusters free
+ * clusters that starts at or after @start, or -errno.
+ */
+static int64_t used_clusters_find_free(BlockDriverState *bs, uint64_t start,
+                                       uint64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t end, i;
+    int64_t next;
+    int ret;
+
+    if (!s->used_clusters) {
+        used_clusters_grow(s, s->max_refcount_table_index + 1);
+    }
+    end = s->used_clusters_refblocks << s->refcount_block_bits;
+
+    while (start < end) {
+        ret = used_clusters_load(bs, start >> s->refcount_block_bits);
+        if (ret < 0) {
+            return ret;
+        }
+
+        next = hbitmap_next_zero(s->used_clusters, start, end - start);
+        if (next < 0) {
+            return end;
+        }
+        if (!test_bit(next >> s->refcount_block_bits,
+                      s->used_clusters_loaded)) {
+            /* Not read yet, so it only looks free */
+            start = next;
+            continue;
+        }
+        start = next;
+
+        /* Make sure the whole run has been read before checking it */
+        for (i = start >> s->refcount_block_bits;
+             i < s->used_clusters_refblocks &&
+             i <= (start + nb_clusters - 1) >> s->refcount_block_bits;
+             i++)
+        {
+            ret = used_clusters_load(bs, i);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        next = hbitmap_next_dirty(s->used_clusters, start,
+                                  MIN(nb_clusters, end - start));
+        if (next < 0) {
+            return start;
+        }
+        start = next;
+    }
+
+    return start;
+}
+
 static void update_max_refcount_table_index(BDRVQcow2State *s)
 {
     unsigned i = s->refcount_table_size - 1;
@@ -92,6 +281,9 @@ static void update_max_refcount_table_index(BDRVQcow2State *s)
     }
     /* Set s->max_refcount_table_index to the index of the last used entry */
     s->max_refcount_table_index = i;
+
+    /* The refcount structures have been replaced */
+    used_clusters_drop(s);
 }
 
 int qcow2_refcount_init(BlockDriverState *bs)
@@ -133,6 +325,12 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     g_free(s->refcount_table);
+    used_clusters_drop(s);
+}
+
+void qcow2_refcount_reset_used_clusters(BlockDriverState *bs)
+{
+    used_clusters_drop(bs->opaque);
 }
 
 
@@ -446,6 +644,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
          * that refcount_table_index < s->max_refcount_table_index */
         s->max_refcount_table_index =
             MAX(s->max_refcount_table_index, refcount_table_index);
+        used_clusters_invalidate(s, refcount_table_index);
 
         /* The new refcount block may be where the caller intended to put its
          * data, so let it restart the search. */
@@ -882,6 +1081,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         s->set_refcount(refcount_block, block_index, refcount);
+        used_clusters_update(s, cluster_index, refcount);
 
         if (refcount == 0) {
             void *table;
@@ -967,8 +1167,8 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
                                     uint64_t max)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
-    int ret;
+    uint64_t nb_clusters;
+    int64_t start;
 
     /* We can't allocate clusters if they may still be queued for discard. */
     if (s->cache_discards) {
@@ -976,17 +1176,11 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
     }
 
     nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
-
-        if (ret < 0) {
-            return ret;
-        } else if (refcount != 0) {
-            goto retry;
-        }
+    start = used_clusters_find_free(bs, s->free_cluster_index, nb_clusters);
+    if (start < 0) {
+        return start;
     }
+    s->free_cluster_index = start + nb_clusters;
 
     /* Make sure that all offsets in the "allocated" range are representable
      * in the requested max */
@@ -1582,6 +1776,213 @@ int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
     return 0;
 }
 
+/*
+ * Progress reporting for qcow2_co_check(); a phase is one pass over (part of)
+ * the image metadata.
+ */
+static void check_phase_start(BlockDriverState *bs, const char *phase,
+                              int64_t total)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CheckStatus *st = &s->check_status;
+
+    st->phase = phase;
+    st->done = 0;
+    st->total = total;
+    st->bytes = 0;
+    if (st->cb) {
+        st->cb(bs, st->phase, st->done, st->total, st->bytes, st->opaque);
+    }
+}
+
+static void check_phase_progress(BlockDriverState *bs, int64_t done,
+                                 int64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CheckStatus *st = &s->check_status;
+
+    st->done += done;
+    st->bytes += bytes;
+    if (st->cb) {
+        st->cb(bs, st->phase, st->done, st->total, st->bytes, st->opaque);
+    }
+}
+
+static void check_phase_end(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CheckStatus *st = &s->check_status;
+
+    check_phase_progress(bs, st->total - st->done, 0);
+}
+
+/*
+ * The check walks tables (such as the L2 tables of an L1 table) one after the
+ * other.  Waiting for every read before issuing the next one leaves the
+ * storage mostly idle, so TableReadahead keeps a window of reads in flight
+ * while the caller processes the tables in order, which keeps the results
+ * and messages of the check independent of the order of completion.
+ */
+#define CHECK_READAHEAD_BYTES (16 * MiB)
+#define CHECK_READAHEAD_MAX_TABLES 64
+
+typedef struct TableReadahead TableReadahead;
+
+typedef struct TableReadaheadSlot {
+    TableReadahead *ra;
+    int index;
+    uint64_t offset;
+    void *table;
+    int ret;
+    bool done;
+    CoQueue wait;
+} TableReadaheadSlot;
+
+struct TableReadahead {
+    BlockDriverState *bs;
+    const uint64_t *entries;    /* in host byte order */
+    uint64_t offset_mask;
+    int nb_entries;
+    size_t table_size;
+
+    int next_entry;
+    int nb_slots;
+    uint64_t issued;
+    uint64_t consumed;
+    uint8_t *buf;
+    TableReadaheadSlot *slots;
+};
+
+static void coroutine_fn table_readahead_co(void *opaque)
+{
+    TableReadaheadSlot *slot = opaque;
+    TableReadahead *ra = slot->ra;
+    int ret;
+
+    ret = bdrv_co_pread(ra->bs->file, slot->offset, ra->table_size,
+                        slot->table, 0);
+    slot->ret = ret < 0 ? ret : 0;
+    slot->done = true;
+    qemu_co_queue_restart_all(&slot->wait);
+}
+
+/*
+ * Prepares reading the tables of the non-zero entries of @entries, whose
+ * offsets are the entries masked with @offset_mask.  Returns -ENOMEM if the buffers
+ * can't be allocated.
+ */
+static int table_readahead_init(TableReadahead *ra, BlockDriverState *bs,
+                                const uint64_t *entries, int nb_entries,
+                                uint64_t offset_mask, size_t table_size)
+{
+    int i;
+
+    *ra = (TableReadahead) {
+        .bs             = bs,
+        .entries        = entries,
+        .offset_mask    = offset_mask,
+        .nb_entries     = nb_entries,
+        .table_size     = table_size,
+    };
+
+    /* Outside of coroutines, the tables are read synchronously */
+    if (qemu_in_coroutine()) {
+        ra->nb_slots = MIN(CHECK_READAHEAD_MAX_TABLES,
+                           MAX(CHECK_READAHEAD_BYTES / table_size, 1));
+    } else {
+        ra->nb_slots = 1;
+    }
+
+    ra->buf = qemu_try_blockalign(bs->file->bs, ra->nb_slots * table_size);
+    if (!ra->buf) {
+        return -ENOMEM;
+    }
+    ra->slots = g_new0(TableReadaheadSlot, ra->nb_slots);
+    for (i = 0; i < ra->nb_slots; i++) {
+        ra->slots[i].ra = ra;
+        ra->slots[i].table = ra->buf + i * table_size;
+        qemu_co_queue_init(&ra->slots[i].wait);
+    }
+    return 0;
+}
+
+/* Issues reads until the window is full */
+static void table_readahead_fill(TableReadahead *ra)
+{
+    while (ra->issued - ra->consumed < ra->nb_slots &&
+           ra->next_entry < ra->nb_entries)
+    {
+        TableReadaheadSlot *slot;
+        uint64_t entry = ra->entries[ra->next_entry];
+        uint64_t offset = entry & ra->offset_mask;
+
+        if (!entry) {
+            ra->next_entry++;
+            continue;
+        }
+
+        slot = &ra->slots[ra->issued % ra->nb_slots];
+        slot->index = ra->next_entry++;
+        slot->offset = offset;
+        slot->done = false;
+        ra->issued++;
+
+        if (qemu_in_coroutine()) {
+            qemu_coroutine_enter(qemu_coroutine_create(table_readahead_co,
+                                                       slot));
+        } else {
+            int ret = bdrv_pread(ra->bs->file, offset, slot->table,
+                                 ra->table_size);
+            slot->ret = ret < 0 ? ret : 0;
+            slot->done = true;
+        }
+    }
+}
+
+/*
+ * Returns the index of the next non-zero entry, or -1 when there are no more.
+ * *table is set to its table, which stays valid (and may be modified) until
+ * the next call, and *ret to the result of reading it.
+ */
+static int table_readahead_next(TableReadahead *ra, void **table, int *ret)
+{
+    TableReadaheadSlot *slot;
+
+    table_readahead_fill(ra);
+    if (ra->consumed == ra->issued) {
+        return -1;
+    }
+
+    slot = &ra->slots[ra->consumed % ra->nb_slots];
+    while (!slot->done) {
+        qemu_co_queue_wait(&slot->wait, NULL);
+    }
+    ra->consumed++;
+
+    *table = slot->table;
+    *ret = slot->ret;
+    return slot->index;
+}
+
+/* Waits for the reads that are still in flight and frees the buffers */
+static void table_readahead_cleanup(TableReadahead *ra)
+{
+    if (!ra->slots) {
+        return;
+    }
+
+    for (; ra->consumed < ra->issued; ra->consumed++) {
+        TableReadaheadSlot *slot = &ra->slots[ra->consumed % ra->nb_slots];
+
+        while (!slot->done) {
+            qemu_co_queue_wait(&slot->wait, NULL);
+        }
+    }
+    g_free(ra->slots);
+    ra->slots = NULL;
+    qemu_vfree(ra->buf);
+}
+
 /* Flags for check_refcounts_l1() and check_refcounts_l2() */
 enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
@@ -1589,8 +1990,8 @@ enum {
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table at l2_offset, whose contents have been read into
+ * l2_table. While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1598,23 +1999,13 @@ enum {
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags, BdrvCheckMode fix, bool active)
+                              uint64_t *l2_table, int flags, BdrvCheckMode fix,
+                              bool active)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * l2_entry_size(s);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
@@ -1647,7 +2038,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 l2_entry & QCOW2_COMPRESSED_SECTOR_MASK,
                 nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1702,7 +2093,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             res->check_errors++;
                             /* Something is seriously wrong, so abort checking
                              * this L2 table */
-                            goto fail;
+                            return ret;
                         }
 
                         ret = bdrv_pwrite_sync(bs->file, l2e_offset,
@@ -1743,7 +2134,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                                                refcount_table_size,
                                                offset, s->cluster_size);
                 if (ret < 0) {
-                    goto fail;
+                    return ret;
                 }
             }
             break;
@@ -1758,12 +2149,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
-
-fail:
-    g_free(l2_table);
-    return ret;
 }
 
 /*
@@ -1782,8 +2168,9 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               int flags, BdrvCheckMode fix, bool active)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table = NULL, l2_offset, l1_size2;
-    int i, ret;
+    uint64_t *l1_table = NULL, *l2_table, l2_offset, l1_size2;
+    TableReadahead ra = {};
+    int i, ret, read_ret, last_index = -1;
 
     l1_size2 = l1_size * L1E_SIZE;
 
@@ -1812,39 +2199,59 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
+    ret = table_readahead_init(&ra, bs, l1_table, l1_size, L1E_OFFSET_MASK,
+                               s->l2_size * l2_entry_size(s));
+    if (ret < 0) {
+        res->check_errors++;
+        goto fail;
+    }
+
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            ret = qcow2_inc_refcounts_imrt(bs, res,
-                                           refcount_table, refcount_table_size,
-                                           l2_offset, s->cluster_size);
-            if (ret < 0) {
-                goto fail;
-            }
+    while ((i = table_readahead_next(&ra, (void **)&l2_table,
+                                     &read_ret)) >= 0) {
+        l2_offset = l1_table[i] & L1E_OFFSET_MASK;
+
+        /* Mark L2 table as used */
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       l2_offset, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
 
-            /* L2 tables are cluster aligned */
-            if (offset_into_cluster(s, l2_offset)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
+        /* L2 tables are cluster aligned */
+        if (offset_into_cluster(s, l2_offset)) {
+            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                "cluster aligned; L1 entry corrupted\n", l2_offset);
+            res->corruptions++;
+        }
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags,
-                                     fix, active);
-            if (ret < 0) {
-                goto fail;
-            }
+        if (read_ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            res->check_errors++;
+            ret = read_ret;
+            goto fail;
         }
+
+        /* Process and check L2 entries */
+        ret = check_refcounts_l2(bs, res, refcount_table,
+                                 refcount_table_size, l2_offset, l2_table,
+                                 flags, fix, active);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        check_phase_progress(bs, i - last_index, ra.table_size);
+        last_index = i;
     }
+    check_phase_progress(bs, l1_size - 1 - last_index, 0);
+
+    table_readahead_cleanup(&ra);
     g_free(l1_table);
     return 0;
 
 fail:
+    table_readahead_cleanup(&ra);
     g_free(l1_table);
     return ret;
 }
@@ -1861,10 +2268,11 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                               BdrvCheckMode fix)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
-    int ret;
+    uint64_t *l2_table;
+    TableReadahead ra = {};
+    int ret, read_ret;
     uint64_t refcount;
-    int i, j;
+    int i, j, last_index = -1;
     bool repair;
 
     if (fix & BDRV_FIX_ERRORS) {
@@ -1879,11 +2287,24 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         repair = false;
     }
 
-    for (i = 0; i < s->l1_size; i++) {
+    check_phase_start(bs, "Checking COPIED flags", s->l1_size);
+
+    ret = table_readahead_init(&ra, bs, s->l1_table, s->l1_size,
+                               L1E_OFFSET_MASK, s->l2_size * l2_entry_size(s));
+    if (ret < 0) {
+        res->check_errors++;
+        goto fail;
+    }
+
+    while ((i = table_readahead_next(&ra, (void **)&l2_table,
+                                     &read_ret)) >= 0) {
         uint64_t l1_entry = s->l1_table[i];
         uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
         int l2_dirty = 0;
 
+        check_phase_progress(bs, i - last_index, ra.table_size);
+        last_index = i;
+
         if (!l2_offset) {
             continue;
         }
@@ -1913,9 +2334,8 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * l2_entry_size(s));
-        if (ret < 0) {
+        if (read_ret < 0) {
+            ret = read_ret;
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
             res->check_errors++;
@@ -1979,11 +2399,12 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             res->corruptions_fixed += l2_dirty;
         }
     }
+    check_phase_end(bs);
 
     ret = 0;
 
 fail:
-    qemu_vfree(l2_table);
+    table_readahead_cleanup(&ra);
     return ret;
 }
 
@@ -2102,10 +2523,16 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                void **refcount_table, int64_t *nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
-    int64_t i;
+    int64_t i, nb_l1_entries;
     QCowSnapshot *sn;
     int ret;
 
+    nb_l1_entries = s->l1_size;
+    for (i = 0; i < s->nb_snapshots; i++) {
+        nb_l1_entries += s->snapshots[i].l1_size;
+    }
+    check_phase_start(bs, "Counting references", nb_l1_entries);
+
     if (!*refcount_table) {
         int64_t old_size = 0;
         ret = realloc_refcount_array(s, refcount_table,
@@ -2145,6 +2572,7 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                     "L1 table is not cluster aligned; snapshot table entry "
                     "corrupted\n", sn->id_str, sn->name, sn->l1_table_offset);
             res->corruptions++;
+            check_phase_progress(bs, sn->l1_size, 0);
             continue;
         }
         if (sn->l1_size > QCOW_MAX_L1_SIZE / L1E_SIZE) {
@@ -2152,6 +2580,7 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                     "L1 table is too large; snapshot table entry corrupted\n",
                     sn->id_str, sn->name, sn->l1_size);
             res->corruptions++;
+            check_phase_progress(bs, sn->l1_size, 0);
             continue;
         }
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
@@ -2209,7 +2638,14 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     uint64_t refcount1, refcount2;
     int ret;
 
+    check_phase_start(bs, "Comparing refcounts", nb_clusters);
+
     for (i = 0, *highest_cluster = 0; i < nb_clusters; i++) {
+        if (i && !(i & (s->refcount_block_size - 1))) {
+            /* Roughly one refcount block read per step */
+            check_phase_progress(bs, s->refcount_block_size, s->cluster_size);
+        }
+
         ret = qcow2_get_refcount(bs, i, &refcount1);
         if (ret < 0) {
             fprintf(stderr, "Can't get refcount for cluster %" PRId64 ": %s\n",
@@ -2261,6 +2697,8 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
     }
+
+    check_phase_end(bs);
 }
 
 /*
@@ -3430,6 +3868,7 @@ int qcow2_shrink_reftable(BlockDriverState *bs)
             s->refcount_table[i] = 0;
         }
     }
+    used_clusters_drop(s);
 
     if (!s->cache_discards) {
         qcow2_process_discards(bs, ret);
@@ -611,6 +611,9 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
     memset(result, 0, sizeof(*result));
 
+    /* The pool would be reported as leaked clusters */
+    qcow2_release_cluster_pool(bs);
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -642,13 +645,20 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
 static int coroutine_fn qcow2_co_check(BlockDriverState *bs,
                                        BdrvCheckResult *result,
-                                       BdrvCheckMode fix)
+                                       BdrvCheckMode fix,
+                                       BdrvCheckStatusCB *status_cb,
+                                       void *cb_opaque)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
+    s->check_status = (Qcow2CheckStatus) {
+        .cb     = status_cb,
+        .opaque = cb_opaque,
+    };
     ret = qcow2_co_check_locked(bs, result, fix);
+    s->check_status = (Qcow2CheckStatus) {};
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -697,6 +707,9 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_CLUSTER_POOL_SIZE,
+    QCOW2_OPT_READAHEAD_SIZE,
+    QCOW2_OPT_READAHEAD_L2_SLICES,
     NULL
 };
 
@@ -808,6 +821,24 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_CLUSTER_POOL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Data clusters to allocate ahead for allocating writes "
+                    "(in bytes, 0 disables)",
+        },
+        {
+            .name = QCOW2_OPT_READAHEAD_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum read-ahead for sequential reads "
+                    "(in bytes, 0 disables)",
+        },
+        {
+            .name = QCOW2_OPT_READAHEAD_L2_SLICES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of L2 table slices to load beyond the "
+                    "read-ahead window",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -969,6 +1000,9 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t cluster_pool_size;
+    uint64_t readahead_size;
+    uint64_t readahead_l2_slices;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1070,6 +1104,33 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->cluster_pool_size = qemu_opt_get_size(opts, QCOW2_OPT_CLUSTER_POOL_SIZE,
+                                             0);
+    if (r->cluster_pool_size > MAX_CLUSTER_POOL_SIZE) {
+        error_setg(errp, QCOW2_OPT_CLUSTER_POOL_SIZE " must not exceed %"
+                   PRIu64 " bytes", (uint64_t) MAX_CLUSTER_POOL_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->readahead_size = qemu_opt_get_size(opts, QCOW2_OPT_READAHEAD_SIZE, 0);
+    if (r->readahead_size > MAX_READAHEAD_SIZE) {
+        error_setg(errp, QCOW2_OPT_READAHEAD_SIZE " must not exceed %"
+                   PRIu64 " bytes", (uint64_t) MAX_READAHEAD_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->readahead_l2_slices = qemu_opt_get_number(opts,
+                                                 QCOW2_OPT_READAHEAD_L2_SLICES,
+                                                 DEFAULT_READAHEAD_L2_SLICES);
+    if (r->readahead_l2_slices > MAX_READAHEAD_L2_SLICES) {
+        error_setg(errp, QCOW2_OPT_READAHEAD_L2_SLICES " must not exceed %d",
+                   MAX_READAHEAD_L2_SLICES);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1225,6 +1286,13 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    /* What is left in the pool is still used up by the next writes */
+    s->cluster_pool_size = r->cluster_pool_size;
+
+    qcow2_readahead_drop(bs);
+    s->readahead.max_size = r->readahead_size;
+    s->readahead.l2_slices = r->readahead_l2_slices;
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1306,6 +1374,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     uint64_t l1_vm_state_index;
     bool update_header = false;
 
+    qemu_co_queue_init(&s->readahead.waiters);
+
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not read qcow2 header");
@@ -1941,6 +2011,8 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_release_cluster_pool(state->bs);
+
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
         if (ret < 0) {
             goto fail;
@@ -2234,6 +2306,7 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
                                              size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
+    uint64_t n;
 
     switch (subc_type) {
     case QCOW2_SUBCLUSTER_ZERO_PLAIN:
@@ -2245,9 +2318,15 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
     case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
         assert(bs->backing); /* otherwise handled in qcow2_co_preadv_part */
 
+        n = qcow2_readahead_copy(bs, bs->backing, offset, bytes,
+                                 qiov, qiov_offset);
+        if (n == bytes) {
+            return 0;
+        }
+
         BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-        return bdrv_co_preadv_part(bs->backing, offset, bytes,
-                                   qiov, qiov_offset, 0);
+        return bdrv_co_preadv_part(bs->backing, offset + n, bytes - n,
+                                   qiov, qiov_offset + n, 0);
 
     case QCOW2_SUBCLUSTER_COMPRESSED:
         return qcow2_co_preadv_compressed(bs, host_offset,
@@ -2259,9 +2338,15 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
                                              offset, bytes, qiov, qiov_offset);
         }
 
+        n = qcow2_readahead_copy(bs, s->data_file, host_offset, bytes,
+                                 qiov, qiov_offset);
+        if (n == bytes) {
+            return 0;
+        }
+
         BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-        return bdrv_co_preadv_part(s->data_file, host_offset,
-                                   bytes, qiov, qiov_offset, 0);
+        return bdrv_co_preadv_part(s->data_file, host_offset + n,
+                                   bytes - n, qiov, qiov_offset + n, 0);
 
     default:
         g_assert_not_reached();
@@ -2293,6 +2378,8 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
     QCow2SubclusterType type;
     AioTaskPool *aio = NULL;
 
+    qcow2_readahead_start_read(bs, offset, bytes);
+
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
         /* prepare next request */
         cur_bytes = MIN(bytes, INT_MAX);
@@ -2341,6 +2428,10 @@ out:
         g_free(aio);
     }
 
+    if (ret == 0) {
+        qcow2_readahead_kick(bs);
+    }
+
     return ret;
 }
 
@@ -2663,6 +2754,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_release_cluster_pool(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2684,6 +2777,16 @@ static int qcow2_inactivate(BlockDriverState *bs)
     return result;
 }
 
+/*
+ * Snapshot switches, image amendment and backing file changes happen in
+ * drained sections and bypass the write generation, so don't keep data
+ * read ahead across them
+ */
+static void coroutine_fn qcow2_co_drain_begin(BlockDriverState *bs)
+{
+    qcow2_readahead_drop(bs);
+}
+
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -2696,6 +2799,7 @@ static void qcow2_close(BlockDriverState *bs)
     }
 
     cache_clean_timer_del(bs);
+    qcow2_readahead_drop(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
 
@@ -4172,6 +4276,12 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
 
     qemu_co_mutex_lock(&s->lock);
 
+    /*
+     * The pool can lie beyond the end of the image file, where shrinking
+     * and preallocation expect free clusters
+     */
+    qcow2_release_cluster_pool(bs);
+
     /*
      * Even though we store snapshot size for all images, it was not
      * required until v3, so it is not safe to proceed for v2.
@@ -4820,6 +4930,7 @@ static int make_completely_empty(BlockDriverState *bs)
     s->refcount_table[0] = 2 * s->cluster_size;
 
     s->free_cluster_index = 0;
+    qcow2_refcount_reset_used_clusters(bs);
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
     if (offset < 0) {
@@ -4869,6 +4980,8 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
+    qcow2_release_cluster_pool(bs);
+
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
@@ -5910,6 +6023,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_probe         = qcow2_probe,
     .bdrv_open          = qcow2_open,
     .bdrv_close         = qcow2_close,
+    .bdrv_co_drain_begin = qcow2_co_drain_begin,
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
     .bdrv_reopen_commit   = qcow2_reopen_commit,
     .bdrv_reopen_commit_post = qcow2_reopen_commit_post,
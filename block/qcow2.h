@@ -129,6 +129,13 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* The cluster pool is leaked on a crash, so don't let it grow too big */
+#define MAX_CLUSTER_POOL_SIZE (1 * GiB)
+
+#define MAX_READAHEAD_SIZE (32 * MiB)
+#define MAX_READAHEAD_L2_SLICES 64
+#define DEFAULT_READAHEAD_L2_SLICES 2
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -150,6 +157,44 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_CLUSTER_POOL_SIZE "cluster-pool-size"
+#define QCOW2_OPT_READAHEAD_SIZE "readahead-size"
+#define QCOW2_OPT_READAHEAD_L2_SLICES "readahead-l2-slices"
+
+typedef struct Qcow2CheckStatus {
+    BdrvCheckStatusCB *cb;
+    void *opaque;
+    const char *phase;
+    int64_t done;
+    int64_t total;
+    int64_t bytes;
+} Qcow2CheckStatus;
+
+typedef struct Qcow2Readahead {
+    uint64_t max_size;          /* Largest window, 0 disables read-ahead */
+    int l2_slices;              /* L2 slices loaded beyond the window */
+
+    /* Sequential stream detection */
+    uint64_t next_offset;
+    unsigned int streak;
+    uint64_t window;
+
+    /* Window being read in the background, and waiters for it */
+    uint64_t pending_offset;
+    uint64_t pending_bytes;
+    CoQueue waiters;
+
+    /* Guest range that the last read-ahead covered */
+    uint64_t ahead_offset;
+    uint64_t ahead_end;
+
+    /* Data read ahead from buf_child, valid while its write_gen is buf_gen */
+    uint8_t *buf;
+    BdrvChild *buf_child;
+    uint64_t buf_start;
+    uint64_t buf_bytes;
+    unsigned int buf_gen;
+} Qcow2Readahead;
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -357,8 +402,30 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * One bit per cluster with a non-zero refcount, filled in one refcount
+     * block at a time as the allocator gets there (the blocks that have been
+     * read are set in used_clusters_loaded)
+     */
+    HBitmap *used_clusters;
+    unsigned long *used_clusters_loaded;
+    uint64_t used_clusters_refblocks;
+
+    /*
+     * Clusters that are allocated in the refcounts but not referenced yet,
+     * from which allocating writes take their data clusters
+     */
+    uint64_t cluster_pool_size; /* Size of a refill, 0 disables the pool */
+    uint64_t cluster_pool_offset;
+    uint64_t cluster_pool_clusters;
+
+    Qcow2Readahead readahead;
+
     CoMutex lock;
 
+    /* Progress of qcow2_co_check(), see qcow2_check_refcounts() */
+    Qcow2CheckStatus check_status;
+
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
     QCryptoBlock *crypto; /* Disk encryption format driver */
@@ -847,6 +914,7 @@ int qcow2_validate_table(BlockDriverState *bs, uint64_t offset,
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_refcount_reset_used_clusters(BlockDriverState *bs);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
                        uint64_t *refcount);
@@ -915,6 +983,7 @@ int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                           int compressed_size,
                                           uint64_t *host_offset);
 
+void qcow2_release_cluster_pool(BlockDriverState *bs);
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 void qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
@@ -1011,4 +1080,13 @@ int coroutine_fn
 qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
 
+/* qcow2-readahead.c functions */
+void coroutine_fn qcow2_readahead_start_read(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes);
+uint64_t qcow2_readahead_copy(BlockDriverState *bs, BdrvChild *child,
+                              uint64_t child_offset, uint64_t bytes,
+                              QEMUIOVector *qiov, size_t qiov_offset);
+void qcow2_readahead_kick(BlockDriverState *bs);
+void qcow2_readahead_drop(BlockDriverState *bs);
+
 #endif
@@ -20,6 +20,7 @@
 #include "qapi/qmp/qdict.h"
 #include "qemu/ratelimit.h"
 #include "sysemu/block-backend.h"
+#include "block/aio_task.h"
 #include "block/copy-on-read.h"
 
 enum {
@@ -31,6 +32,14 @@ enum {
     STREAM_CHUNK = 512 * 1024, /* in bytes */
 };
 
+/* A range whose copy failed and that waits for the error action */
+typedef struct StreamRange {
+    int64_t offset;
+    int64_t bytes;
+    int ret;
+    QSIMPLEQ_ENTRY(StreamRange) next;
+} StreamRange;
+
 typedef struct StreamBlockJob {
     BlockJob common;
     BlockDriverState *base_overlay; /* COW overlay (stream from this) */
@@ -40,8 +49,21 @@ typedef struct StreamBlockJob {
     BlockdevOnError on_error;
     char *backing_file_str;
     bool bs_read_only;
+    int max_workers;
+    int64_t max_chunk;
+
+    AioTaskPool *pool;
+    QSIMPLEQ_HEAD(, StreamRange) failed;
+    QSIMPLEQ_HEAD(, StreamRange) retry;
 } StreamBlockJob;
 
+typedef struct StreamTask {
+    AioTask task;
+    StreamBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+} StreamTask;
+
 static int coroutine_fn stream_populate(BlockBackend *blk,
                                         int64_t offset, uint64_t bytes)
 {
@@ -50,6 +72,85 @@ static int coroutine_fn stream_populate(BlockBackend *blk,
     return blk_co_preadv(blk, offset, bytes, NULL, BDRV_REQ_PREFETCH);
 }
 
+static int coroutine_fn stream_task_entry(AioTask *task)
+{
+    StreamTask *t = container_of(task, StreamTask, task);
+    StreamBlockJob *s = t->s;
+    StreamRange *r;
+    int ret;
+
+    ret = stream_populate(s->common.blk, t->offset, t->bytes);
+    if (ret < 0) {
+        r = g_new(StreamRange, 1);
+        *r = (StreamRange) {
+            .offset = t->offset,
+            .bytes = t->bytes,
+            .ret = ret,
+        };
+        QSIMPLEQ_INSERT_TAIL(&s->failed, r, next);
+        return ret;
+    }
+
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
+static void coroutine_fn stream_start_task(StreamBlockJob *s,
+                                           int64_t offset, int64_t bytes)
+{
+    StreamTask *t = g_new(StreamTask, 1);
+
+    *t = (StreamTask) {
+        .task.func = stream_task_entry,
+        .s = s,
+        .offset = offset,
+        .bytes = bytes,
+    };
+    aio_task_pool_start_task(s->pool, &t->task);
+}
+
+/*
+ * Find out how much from @offset has to be copied (returns 1) or not
+ * (returns 0).  The whole rest of the image is queried at once, so that
+ * long runs that are allocated in the top image, or in none of the
+ * intermediate images, are skipped with a single query.
+ */
+static int coroutine_fn stream_block_status(StreamBlockJob *s,
+                                            int64_t offset, int64_t len,
+                                            int64_t *pnum)
+{
+    BlockDriverState *unfiltered_bs = bdrv_skip_filters(s->target_bs);
+    int ret;
+
+    ret = bdrv_is_allocated(unfiltered_bs, offset, len - offset, pnum);
+    if (ret == 1) {
+        /* Allocated in the top, no need to copy.  */
+        ret = 0;
+    } else if (ret >= 0) {
+        /* Copy if allocated in the intermediate images.  Limit to the
+         * known-unallocated area [offset, offset+n*BDRV_SECTOR_SIZE).  */
+        ret = bdrv_is_allocated_above(bdrv_cow_bs(unfiltered_bs),
+                                      s->base_overlay, true,
+                                      offset, *pnum, pnum);
+        /* Finish early if end of backing file has been reached */
+        if (ret == 0 && *pnum == 0) {
+            *pnum = len - offset;
+        }
+    }
+    trace_stream_one_iteration(s, offset, *pnum, ret);
+    return ret;
+}
+
+/* Called when the job pauses, so that no request is left in flight */
+static void coroutine_fn stream_pause(Job *job)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
+
+    if (s->pool) {
+        aio_task_pool_wait_all(s->pool);
+    }
+}
+
 static int stream_prepare(Job *job)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
@@ -105,10 +206,12 @@ static void stream_clean(Job *job)
 static int coroutine_fn stream_run(Job *job, Error **errp)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
-    BlockBackend *blk = s->common.blk;
     BlockDriverState *unfiltered_bs = bdrv_skip_filters(s->target_bs);
+    StreamRange *r;
     int64_t len;
     int64_t offset = 0;
+    int64_t extent_end = 0; /* end of the range whose status is known */
+    bool copy = false;
     uint64_t delay_ns = 0;
     int error = 0;
     int64_t n = 0; /* bytes */
@@ -124,62 +227,108 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
     }
     job_progress_set_remaining(&s->common.job, len);
 
-    for ( ; offset < len; offset += n) {
-        bool copy;
+    s->pool = aio_task_pool_new(s->max_workers);
+
+    for (;;) {
         int ret;
 
-        /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+        /* Note that requests may be in flight here; stream_pause() waits
+         * for them so that bdrv_drain_all() returns.
          */
         job_sleep_ns(&s->common.job, delay_ns);
+        delay_ns = 0;
         if (job_is_cancelled(&s->common.job)) {
             break;
         }
 
-        copy = false;
-
-        ret = bdrv_is_allocated(unfiltered_bs, offset, STREAM_CHUNK, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-        } else if (ret >= 0) {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [offset, offset+n*BDRV_SECTOR_SIZE).  */
-            ret = bdrv_is_allocated_above(bdrv_cow_bs(unfiltered_bs),
-                                          s->base_overlay, true,
-                                          offset, n, &n);
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = len - offset;
-            }
-
-            copy = (ret > 0);
-        }
-        trace_stream_one_iteration(s, offset, n, ret);
-        if (copy) {
-            ret = stream_populate(blk, offset, n);
-        }
-        if (ret < 0) {
+        r = QSIMPLEQ_FIRST(&s->failed);
+        if (r) {
             BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error, true, -ret);
+                block_job_error_action(&s->common, s->on_error, true, -r->ret);
+
+            QSIMPLEQ_REMOVE_HEAD(&s->failed, next);
             if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
+                /* Copy it again once the job is resumed */
+                QSIMPLEQ_INSERT_TAIL(&s->retry, r, next);
                 continue;
             }
             if (error == 0) {
-                error = ret;
+                error = r->ret;
             }
+            job_progress_update(&s->common.job, r->bytes);
+            g_free(r);
             if (action == BLOCK_ERROR_ACTION_REPORT) {
                 break;
             }
+            continue;
+        }
+
+        r = QSIMPLEQ_FIRST(&s->retry);
+        if (r) {
+            QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+            stream_start_task(s, r->offset, r->bytes);
+            delay_ns = block_job_ratelimit_get_delay(&s->common, r->bytes);
+            g_free(r);
+            continue;
         }
 
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
+        if (offset >= len) {
+            if (aio_task_pool_empty(s->pool)) {
+                break;
+            }
+            aio_task_pool_wait_one(s->pool);
+            continue;
+        }
+
+        if (offset >= extent_end) {
+            ret = stream_block_status(s, offset, len, &n);
+            if (ret < 0) {
+                BlockErrorAction action =
+                    block_job_error_action(&s->common, s->on_error, true,
+                                           -ret);
+                if (action == BLOCK_ERROR_ACTION_STOP) {
+                    continue;
+                }
+                if (error == 0) {
+                    error = ret;
+                }
+                if (action == BLOCK_ERROR_ACTION_REPORT) {
+                    break;
+                }
+                /* Skip the range that could not be queried */
+                n = MIN(s->max_chunk, len - offset);
+                job_progress_update(&s->common.job, n);
+                offset += n;
+                continue;
+            }
+            extent_end = offset + n;
+            copy = (ret > 0);
+        }
+
+        n = extent_end - offset;
         if (copy) {
+            n = MIN(n, s->max_chunk);
+            stream_start_task(s, offset, n);
             delay_ns = block_job_ratelimit_get_delay(&s->common, n);
         } else {
-            delay_ns = 0;
+            /* Publish progress */
+            job_progress_update(&s->common.job, n);
         }
+        offset += n;
+    }
+
+    aio_task_pool_wait_all(s->pool);
+    aio_task_pool_free(s->pool);
+    s->pool = NULL;
+
+    /* Left over when the job was cancelled or failed */
+    while ((r = QSIMPLEQ_FIRST(&s->failed))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->failed, next);
+        g_free(r);
+    }
+    while ((r = QSIMPLEQ_FIRST(&s->retry))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+        g_free(r);
     }
 
     /* Do not remove the backing file if an error was there but ignored. */
@@ -194,6 +343,7 @@ static const BlockJobDriver stream_job_driver = {
         .run           = stream_run,
         .prepare       = stream_prepare,
         .clean         = stream_clean,
+        .pause         = stream_pause,
         .user_resume   = block_job_user_resume,
     },
 };
@@ -204,6 +354,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
                   int creation_flags, int64_t speed,
                   BlockdevOnError on_error,
                   const char *filter_node_name,
+                  StreamCommitPerf *perf,
                   Error **errp)
 {
     StreamBlockJob *s = NULL;
@@ -219,6 +370,18 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     assert(!(base && bottom));
     assert(!(backing_file_str && bottom));
 
+    if (perf->max_workers < 1) {
+        error_setg(errp, "max-workers must be greater than zero");
+        return;
+    }
+
+    if (perf->max_chunk < 0 || perf->max_chunk > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-chunk must be zero (which means the default) "
+                   "or positive and at most %" PRId64,
+                   (int64_t)BDRV_REQUEST_MAX_BYTES);
+        return;
+    }
+
     if (bottom) {
         /*
          * New simple interface. The code is written in terms of old interface
@@ -334,6 +497,10 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     s->cor_filter_bs = cor_filter_bs;
     s->target_bs = bs;
     s->bs_read_only = bs_read_only;
+    s->max_workers = perf->max_workers;
+    s->max_chunk = perf->max_chunk ?: STREAM_CHUNK;
+    QSIMPLEQ_INIT(&s->failed);
+    QSIMPLEQ_INIT(&s->retry);
 
     s->on_error = on_error;
     trace_stream_start(bs, base, s);
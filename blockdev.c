@@ -2484,6 +2484,7 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
                       bool has_filter_node_name, const char *filter_node_name,
                       bool has_auto_finalize, bool auto_finalize,
                       bool has_auto_dismiss, bool auto_dismiss,
+                      bool has_x_perf, StreamCommitPerf *x_perf,
                       Error **errp)
 {
     BlockDriverState *bs, *iter, *iter_end;
@@ -2492,6 +2493,7 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
     AioContext *aio_context;
     Error *local_err = NULL;
     int job_flags = JOB_DEFAULT;
+    StreamCommitPerf perf = { .max_workers = 8 };
 
     if (has_base && has_base_node) {
         error_setg(errp, "'base' and 'base-node' cannot be specified "
@@ -2515,6 +2517,15 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
         on_error = BLOCKDEV_ON_ERROR_REPORT;
     }
 
+    if (has_x_perf) {
+        if (x_perf->has_max_workers) {
+            perf.max_workers = x_perf->max_workers;
+        }
+        if (x_perf->has_max_chunk) {
+            perf.max_chunk = x_perf->max_chunk;
+        }
+    }
+
     bs = bdrv_lookup_bs(device, device, errp);
     if (!bs) {
         return;
@@ -2597,7 +2608,7 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
 
     stream_start(has_job_id ? job_id : NULL, bs, base_bs, backing_file,
                  bottom_bs, job_flags, has_speed ? speed : 0, on_error,
-                 filter_node_name, &local_err);
+                 filter_node_name, &perf, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         goto out;
@@ -2620,6 +2631,7 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
                       bool has_filter_node_name, const char *filter_node_name,
                       bool has_auto_finalize, bool auto_finalize,
                       bool has_auto_dismiss, bool auto_dismiss,
+                      bool has_x_perf, StreamCommitPerf *x_perf,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -2629,6 +2641,7 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
     Error *local_err = NULL;
     int job_flags = JOB_DEFAULT;
     uint64_t top_perm, top_shared;
+    StreamCommitPerf perf = { .max_workers = 8 };
 
     if (!has_speed) {
         speed = 0;
@@ -2645,6 +2658,14 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
     if (has_auto_dismiss && !auto_dismiss) {
         job_flags |= JOB_MANUAL_DISMISS;
     }
+    if (has_x_perf) {
+        if (x_perf->has_max_workers) {
+            perf.max_workers = x_perf->max_workers;
+        }
+        if (x_perf->has_max_chunk) {
+            perf.max_chunk = x_perf->max_chunk;
+        }
+    }
 
     /* Important Note:
      *  libvirt relies on the DeviceNotFound error class in order to probe for
@@ -2769,6 +2790,11 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
             }
             goto out;
         }
+        if (has_x_perf) {
+            error_setg(errp, "'x-perf' specified, but 'top' is the active "
+                             "layer or has a writer on it");
+            goto out;
+        }
         if (!has_job_id) {
             /*
              * Emulate here what block_job_create() does, because it
@@ -2787,7 +2813,7 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
         }
         commit_start(has_job_id ? job_id : NULL, bs, base_bs, top_bs, job_flags,
                      speed, on_error, has_backing_file ? backing_file : NULL,
-                     filter_node_name, &local_err);
+                     filter_node_name, &perf, &local_err);
     }
     if (local_err != NULL) {
         error_propagate(errp, local_err);
@@ -2978,6 +3004,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    bool has_copy_mode, MirrorCopyMode copy_mode,
                                    bool has_auto_finalize, bool auto_finalize,
                                    bool has_auto_dismiss, bool auto_dismiss,
+                                   bool has_x_perf, MirrorPerf *x_perf,
                                    Error **errp)
 {
     BlockDriverState *unfiltered_bs;
@@ -3085,7 +3112,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                  has_replaces ? replaces : NULL, job_flags,
                  speed, granularity, buf_size, sync, backing_mode, zero_target,
                  on_source_error, on_target_error, unmap, filter_node_name,
-                 copy_mode, errp);
+                 copy_mode, has_x_perf ? x_perf : NULL, errp);
 }
 
 void qmp_drive_mirror(DriveMirror *arg, Error **errp)
@@ -3239,6 +3266,7 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
                            arg->has_copy_mode, arg->copy_mode,
                            arg->has_auto_finalize, arg->auto_finalize,
                            arg->has_auto_dismiss, arg->auto_dismiss,
+                           arg->has_x_perf, arg->x_perf,
                            errp);
     bdrv_unref(target_bs);
 out:
@@ -3261,6 +3289,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                          bool has_copy_mode, MirrorCopyMode copy_mode,
                          bool has_auto_finalize, bool auto_finalize,
                          bool has_auto_dismiss, bool auto_dismiss,
+                         bool has_x_perf, MirrorPerf *x_perf,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3309,6 +3338,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                            has_copy_mode, copy_mode,
                            has_auto_finalize, auto_finalize,
                            has_auto_dismiss, auto_dismiss,
+                           has_x_perf, x_perf,
                            errp);
 out:
     aio_context_release(aio_context);
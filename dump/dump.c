@@ -42,6 +42,9 @@
 #ifdef CONFIG_SNAPPY
 #include <snappy-c.h>
 #endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #ifndef ELF_MACHINE_UNAME
 #define ELF_MACHINE_UNAME "Unknown"
 #endif
@@ -847,6 +850,11 @@ static void create_header32(DumpState *s, Error **errp)
     if (s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) {
         status |= DUMP_DH_COMPRESSED_SNAPPY;
     }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        status |= DUMP_DH_COMPRESSED_ZSTD;
+    }
 #endif
     dh->status = cpu_to_dump32(s, status);
 
@@ -959,6 +967,11 @@ static void create_header64(DumpState *s, Error **errp)
     if (s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) {
         status |= DUMP_DH_COMPRESSED_SNAPPY;
     }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        status |= DUMP_DH_COMPRESSED_ZSTD;
+    }
 #endif
     dh->status = cpu_to_dump32(s, status);
 
@@ -1286,6 +1299,11 @@ static size_t get_len_buf_out(size_t page_size, uint32_t flag_compress)
     case DUMP_DH_COMPRESSED_SNAPPY:
         return snappy_max_compressed_length(page_size);
 #endif
+
+#ifdef CONFIG_ZSTD
+    case DUMP_DH_COMPRESSED_ZSTD:
+        return ZSTD_compressBound(page_size);
+#endif
     }
     return 0;
 }
@@ -1298,20 +1316,327 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/* Number of pages compressed together by a dump worker */
+#define DUMP_BATCH_PAGES 256
+
+/* Per-thread compression state */
+typedef struct DumpCompressor {
+#ifdef CONFIG_LZO
+    lzo_bytep wrkmem;
+#endif
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+} DumpCompressor;
+
+typedef struct DumpBatch {
+    /* host address of each page */
+    uint8_t *pages[DUMP_BATCH_PAGES];
+    int nr_pages;
+    /* compressed pages, one every len_buf_out bytes */
+    uint8_t *buf_out;
+    /* size of the data of each page, 0 for a zero page */
+    size_t size_out[DUMP_BATCH_PAGES];
+    /* compression format of each page, 0 if it is saved in plaintext */
+    uint32_t flags[DUMP_BATCH_PAGES];
+    /* posted when the batch is compressed */
+    QemuSemaphore done;
+} DumpBatch;
+
+typedef struct DumpWorkerPool DumpWorkerPool;
+
+typedef struct DumpWorker {
+    DumpWorkerPool *pool;
+    DumpCompressor compressor;
+    QemuThread thread;
+} DumpWorker;
+
+/*
+ * The pages are compressed in batches by the workers, and the dump thread
+ * writes the batches in the order it submitted them.  Without threads,
+ * the batches are compressed by the dump thread when it submits them.
+ */
+struct DumpWorkerPool {
+    DumpState *s;
+    size_t len_buf_out;
+    int nr_threads;
+    /* nr_threads workers, or a single one that has no thread */
+    DumpWorker *workers;
+
+    QemuMutex lock;
+    QemuCond cond;
+    /* batches waiting for a worker, protected by lock */
+    GQueue queue;
+    bool quit;
+};
+
+static void dump_compressor_init(DumpCompressor *c, DumpState *s)
+{
+#ifdef CONFIG_LZO
+    if (s->flag_compress == DUMP_DH_COMPRESSED_LZO) {
+        c->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress == DUMP_DH_COMPRESSED_ZSTD) {
+        c->zstd = ZSTD_createCCtx();
+    }
+#endif
+}
+
+static void dump_compressor_cleanup(DumpCompressor *c)
+{
+#ifdef CONFIG_LZO
+    g_free(c->wrkmem);
+#endif
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(c->zstd);
+#endif
+}
+
+/*
+ * Compress one page into @buf_out, which is @len_buf_out bytes long.
+ *
+ * Returns the compression format used, and the compressed size in
+ * @size_out.  Returns 0 if the page must be saved in plaintext, because
+ * the compression failed or didn't make the page smaller.
+ */
+static uint32_t dump_compress_page(DumpState *s, DumpCompressor *c,
+                                   const uint8_t *buf, uint8_t *buf_out,
+                                   size_t len_buf_out, size_t *size_out)
+{
+    size_t page_size = s->dump_info.page_size;
+    size_t size = len_buf_out;
+
+    switch (s->flag_compress) {
+    case DUMP_DH_COMPRESSED_ZLIB:
+        if (compress2(buf_out, (uLongf *)&size, buf, page_size,
+                      Z_BEST_SPEED) != Z_OK) {
+            return 0;
+        }
+        break;
+
+#ifdef CONFIG_LZO
+    case DUMP_DH_COMPRESSED_LZO:
+        if (lzo1x_1_compress(buf, page_size, buf_out, (lzo_uint *)&size,
+                             c->wrkmem) != LZO_E_OK) {
+            return 0;
+        }
+        break;
+#endif
+
+#ifdef CONFIG_SNAPPY
+    case DUMP_DH_COMPRESSED_SNAPPY:
+        if (snappy_compress((const char *)buf, page_size, (char *)buf_out,
+                            &size) != SNAPPY_OK) {
+            return 0;
+        }
+        break;
+#endif
+
+#ifdef CONFIG_ZSTD
+    case DUMP_DH_COMPRESSED_ZSTD:
+        size = ZSTD_compressCCtx(c->zstd, buf_out, len_buf_out, buf, page_size,
+                                 1);
+        if (ZSTD_isError(size)) {
+            return 0;
+        }
+        break;
+#endif
+
+    default:
+        return 0;
+    }
+
+    if (size >= page_size) {
+        return 0;
+    }
+    *size_out = size;
+    return s->flag_compress;
+}
+
+static void dump_compress_batch(DumpWorkerPool *pool, DumpCompressor *c,
+                                DumpBatch *batch)
+{
+    DumpState *s = pool->s;
+    size_t page_size = s->dump_info.page_size;
+    int i;
+
+    for (i = 0; i < batch->nr_pages; i++) {
+        /* all the zero pages share the same page data */
+        if (is_zero_page(batch->pages[i], page_size)) {
+            batch->size_out[i] = 0;
+            continue;
+        }
+
+        batch->flags[i] = dump_compress_page(s, c, batch->pages[i],
+                                             batch->buf_out +
+                                             i * pool->len_buf_out,
+                                             pool->len_buf_out,
+                                             &batch->size_out[i]);
+        if (!batch->flags[i]) {
+            batch->size_out[i] = page_size;
+        }
+    }
+    qemu_sem_post(&batch->done);
+}
+
+static void *dump_worker_thread(void *opaque)
+{
+    DumpWorker *worker = opaque;
+    DumpWorkerPool *pool = worker->pool;
+    DumpBatch *batch;
+
+    qemu_mutex_lock(&pool->lock);
+    while (true) {
+        batch = g_queue_pop_head(&pool->queue);
+        if (batch) {
+            qemu_mutex_unlock(&pool->lock);
+            dump_compress_batch(pool, &worker->compressor, batch);
+            qemu_mutex_lock(&pool->lock);
+        } else if (pool->quit) {
+            break;
+        } else {
+            qemu_cond_wait(&pool->cond, &pool->lock);
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static DumpWorkerPool *dump_worker_pool_new(DumpState *s, size_t len_buf_out)
+{
+    DumpWorkerPool *pool = g_new0(DumpWorkerPool, 1);
+    int i;
+
+    pool->s = s;
+    pool->len_buf_out = len_buf_out;
+    pool->nr_threads = s->threads > 1 ? s->threads : 0;
+    pool->workers = g_new0(DumpWorker, MAX(pool->nr_threads, 1));
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->cond);
+    g_queue_init(&pool->queue);
+
+    for (i = 0; i < MAX(pool->nr_threads, 1); i++) {
+        DumpWorker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        dump_compressor_init(&worker->compressor, s);
+        if (pool->nr_threads) {
+            qemu_thread_create(&worker->thread, "dump-compress",
+                               dump_worker_thread, worker,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+
+    return pool;
+}
+
+static void dump_worker_pool_submit(DumpWorkerPool *pool, DumpBatch *batch)
+{
+    if (!pool->nr_threads) {
+        dump_compress_batch(pool, &pool->workers[0].compressor, batch);
+        return;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    g_queue_push_tail(&pool->queue, batch);
+    qemu_cond_signal(&pool->cond);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/* Wait for the submitted batches to be compressed and free the pool */
+static void dump_worker_pool_free(DumpWorkerPool *pool)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < MAX(pool->nr_threads, 1); i++) {
+        if (pool->nr_threads) {
+            qemu_thread_join(&pool->workers[i].thread);
+        }
+        dump_compressor_cleanup(&pool->workers[i].compressor);
+    }
+
+    qemu_cond_destroy(&pool->cond);
+    qemu_mutex_destroy(&pool->lock);
+    g_free(pool->workers);
+    g_free(pool);
+}
+
+/*
+ * write the page data and page desc of a compressed batch into the
+ * caches, zero pages use pd_zero.
+ */
+static int write_dump_batch(DumpState *s, DumpBatch *batch, size_t len_buf_out,
+                            DataCache *page_desc, DataCache *page_data,
+                            PageDescriptor *pd_zero, off_t *offset_data,
+                            Error **errp)
+{
+    PageDescriptor pd;
+    uint8_t *data;
+    int ret, i;
+
+    for (i = 0; i < batch->nr_pages; i++) {
+        if (!batch->size_out[i]) {
+            ret = write_cache(page_desc, pd_zero, sizeof(PageDescriptor),
+                              false);
+            if (ret < 0) {
+                error_setg(errp, "dump: failed to write page desc");
+                return ret;
+            }
+            s->written_size += s->dump_info.page_size;
+            continue;
+        }
+
+        if (batch->flags[i]) {
+            data = batch->buf_out + i * len_buf_out;
+        } else {
+            data = batch->pages[i];
+        }
+        ret = write_cache(page_data, data, batch->size_out[i], false);
+        if (ret < 0) {
+            error_setg(errp, "dump: failed to write page data");
+            return ret;
+        }
+
+        /* get and write page desc here */
+        pd.flags = cpu_to_dump32(s, batch->flags[i]);
+        pd.size = cpu_to_dump32(s, batch->size_out[i]);
+        pd.page_flags = cpu_to_dump64(s, 0);
+        pd.offset = cpu_to_dump64(s, *offset_data);
+        *offset_data += batch->size_out[i];
+
+        ret = write_cache(page_desc, &pd, sizeof(PageDescriptor), false);
+        if (ret < 0) {
+            error_setg(errp, "dump: failed to write page desc");
+            return ret;
+        }
+        s->written_size += s->dump_info.page_size;
+    }
+
+    return 0;
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    size_t len_buf_out;
     off_t offset_desc, offset_data;
-    PageDescriptor pd, pd_zero;
+    PageDescriptor pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    DumpWorkerPool *pool;
+    DumpBatch *batches;
+    int nr_batches, inflight = 0, i;
+    bool more = true;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1324,11 +1649,14 @@ static void write_dump_pages(DumpState *s, Error **errp)
     len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
     assert(len_buf_out != 0);
 
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    /* keep every worker busy while the dump thread writes a batch */
+    pool = dump_worker_pool_new(s, len_buf_out);
+    nr_batches = MAX(pool->nr_threads * 2, 1);
+    batches = g_new0(DumpBatch, nr_batches);
+    for (i = 0; i < nr_batches; i++) {
+        batches[i].buf_out = g_malloc(DUMP_BATCH_PAGES * len_buf_out);
+        qemu_sem_init(&batches[i].done, 0);
+    }
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1349,100 +1677,35 @@ static void write_dump_pages(DumpState *s, Error **errp)
     offset_data += s->dump_info.page_size;
 
     /*
-     * dump memory to vmcore page by page. zero page will all be resided in the
-     * first page of page section
+     * dump memory to vmcore batch by batch. zero page will all be resided in
+     * the first page of page section. The batches are reused in a ring, so
+     * a batch is written before it is filled again, in submission order.
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
+    for (i = 0; more || inflight; i = (i + 1) % nr_batches) {
+        DumpBatch *batch = &batches[i];
+
+        if (batch->nr_pages) {
+            qemu_sem_wait(&batch->done);
+            inflight--;
+            ret = write_dump_batch(s, batch, len_buf_out, &page_desc,
+                                   &page_data, &pd_zero, &offset_data, errp);
             if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
                 goto out;
             }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-            }
-
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+            batch->nr_pages = 0;
+        }
 
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
+        while (more && batch->nr_pages < DUMP_BATCH_PAGES) {
+            if (!get_next_page(&block_iter, &pfn_iter, &buf, s)) {
+                more = false;
+                break;
             }
+            batch->pages[batch->nr_pages++] = buf;
+        }
+        if (batch->nr_pages) {
+            inflight++;
+            dump_worker_pool_submit(pool, batch);
         }
-        s->written_size += s->dump_info.page_size;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1460,11 +1723,12 @@ out:
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
 
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
+    dump_worker_pool_free(pool);
+    for (i = 0; i < nr_batches; i++) {
+        qemu_sem_destroy(&batches[i].done);
+        g_free(batches[i].buf_out);
+    }
+    g_free(batches);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1641,7 +1905,8 @@ static void vmcoreinfo_update_phys_base(DumpState *s)
 }
 
 static void dump_init(DumpState *s, int fd, bool has_format,
-                      DumpGuestMemoryFormat format, bool paging, bool has_filter,
+                      DumpGuestMemoryFormat format, uint32_t threads,
+                      bool paging, bool has_filter,
                       int64_t begin, int64_t length, Error **errp)
 {
     VMCoreInfoState *vmci = vmcoreinfo_find();
@@ -1652,6 +1917,7 @@ static void dump_init(DumpState *s, int fd, bool has_format,
 
     s->has_format = has_format;
     s->format = format;
+    s->threads = threads;
     s->written_size = 0;
 
     /* kdump-compressed is conflict with paging and filter */
@@ -1805,6 +2071,10 @@ static void dump_init(DumpState *s, int fd, bool has_format,
             s->flag_compress = DUMP_DH_COMPRESSED_SNAPPY;
             break;
 
+        case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD:
+            s->flag_compress = DUMP_DH_COMPRESSED_ZSTD;
+            break;
+
         default:
             s->flag_compress = 0;
         }
@@ -1920,7 +2190,8 @@ void qmp_dump_guest_memory(bool paging, const char *file,
                            bool has_detach, bool detach,
                            bool has_begin, int64_t begin, bool has_length,
                            int64_t length, bool has_format,
-                           DumpGuestMemoryFormat format, Error **errp)
+                           DumpGuestMemoryFormat format, bool has_threads,
+                           int64_t threads, Error **errp)
 {
     const char *p;
     int fd = -1;
@@ -1961,6 +2232,13 @@ void qmp_dump_guest_memory(bool paging, const char *file,
     if (has_detach) {
         detach_p = detach;
     }
+    if (!has_threads) {
+        threads = 1;
+    } else if (threads < 1 || threads > DUMP_MAX_THREADS) {
+        error_setg(errp, "threads must be between 1 and %d",
+                   DUMP_MAX_THREADS);
+        return;
+    }
 
     /* check whether lzo/snappy is supported */
 #ifndef CONFIG_LZO
@@ -1977,6 +2255,13 @@ void qmp_dump_guest_memory(bool paging, const char *file,
     }
 #endif
 
+#ifndef CONFIG_ZSTD
+    if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD) {
+        error_setg(errp, "kdump-zstd is not available now");
+        return;
+    }
+#endif
+
 #ifndef TARGET_X86_64
     if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_WIN_DMP) {
         error_setg(errp, "Windows dump is only available for x86-64");
@@ -2009,7 +2294,7 @@ void qmp_dump_guest_memory(bool paging, const char *file,
     s = &dump_state_global;
     dump_state_prepare(s);
 
-    dump_init(s, fd, has_format, format, paging, has_begin,
+    dump_init(s, fd, has_format, format, threads, paging, has_begin,
               begin, length, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -2050,6 +2335,11 @@ DumpGuestMemoryCapability *qmp_query_dump_guest_memory_capability(Error **errp)
     QAPI_LIST_APPEND(tail, DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY);
 #endif
 
+    /* add new item if kdump-zstd is available */
+#ifdef CONFIG_ZSTD
+    QAPI_LIST_APPEND(tail, DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD);
+#endif
+
     /* Windows dump is available only if target is x86_64 */
 #ifdef TARGET_X86_64
     QAPI_LIST_APPEND(tail, DUMP_GUEST_MEMORY_FORMAT_WIN_DMP);
@@ -459,8 +459,18 @@ typedef enum {
     BDRV_FIX_ERRORS   = 2,
 } BdrvCheckMode;
 
+/*
+ * Progress of a consistency check: @phase names the pass over the image that
+ * is running, @done and @total are in units chosen by the block driver, and
+ * @bytes is the amount of metadata the phase has read so far.
+ */
+typedef void BdrvCheckStatusCB(BlockDriverState *bs, const char *phase,
+                               int64_t done, int64_t total, int64_t bytes,
+                               void *opaque);
 int generated_co_wrapper bdrv_check(BlockDriverState *bs, BdrvCheckResult *res,
-                                    BdrvCheckMode fix);
+                                    BdrvCheckMode fix,
+                                    BdrvCheckStatusCB *status_cb,
+                                    void *cb_opaque);
 
 /* The units of offset and total_work_size may be chosen arbitrarily by the
  * block driver; total_work_size may change during the course of the amendment
@@ -571,6 +581,8 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs,
                                           Error **errp);
 BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs);
+int bdrv_get_host_fd(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     int *fd, int64_t *host_offset);
 void bdrv_round_to_clusters(BlockDriverState *bs,
                             int64_t offset, int64_t bytes,
                             int64_t *cluster_offset,
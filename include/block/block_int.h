@@ -448,6 +448,14 @@ struct BlockDriver {
                                                  Error **errp);
     BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
+    /*
+     * Return in @fd a host file descriptor from which the @bytes at
+     * @offset can be read as they are, and in @host_offset their offset
+     * in that file.  Returns -ENOTSUP if the driver can't do that.
+     */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, int *fd, int64_t *host_offset);
+
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
                                           int64_t pos);
@@ -487,11 +495,14 @@ struct BlockDriver {
 
     /*
      * Returns 0 for completed check, -errno for internal errors.
-     * The check results are stored in result.
+     * The check results are stored in result.  status_cb may be NULL, and
+     * drivers need not call it.
      */
     int coroutine_fn (*bdrv_co_check)(BlockDriverState *bs,
                                       BdrvCheckResult *result,
-                                      BdrvCheckMode fix);
+                                      BdrvCheckMode fix,
+                                      BdrvCheckStatusCB *status_cb,
+                                      void *cb_opaque);
 
     void (*bdrv_debug_event)(BlockDriverState *bs, BlkdebugEvent event);
 
@@ -1159,6 +1170,7 @@ int is_windows_drive(const char *filename);
  * @filter_node_name: The node name that should be assigned to the filter
  *                    driver that the stream job inserts into the graph above
  *                    @bs. NULL means that a node name should be autogenerated.
+ * @perf: Performance options.  @max_chunk may be 0 for the default size.
  * @errp: Error object.
  *
  * Start a streaming operation on @bs.  Clusters that are unallocated
@@ -1174,6 +1186,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
                   int creation_flags, int64_t speed,
                   BlockdevOnError on_error,
                   const char *filter_node_name,
+                  StreamCommitPerf *perf,
                   Error **errp);
 
 /**
@@ -1191,6 +1204,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
  * @filter_node_name: The node name that should be assigned to the filter
  * driver that the commit job inserts into the graph above @top. NULL means
  * that a node name should be autogenerated.
+ * @perf: Performance options.  @max_chunk may be 0 for the default size.
  * @errp: Error object.
  *
  */
@@ -1198,7 +1212,8 @@ void commit_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, BlockDriverState *top,
                   int creation_flags, int64_t speed,
                   BlockdevOnError on_error, const char *backing_file_str,
-                  const char *filter_node_name, Error **errp);
+                  const char *filter_node_name, StreamCommitPerf *perf,
+                  Error **errp);
 /**
  * commit_active_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
@@ -1247,6 +1262,8 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
  * driver that the mirror job inserts into the graph above @bs. NULL means that
  * a node name should be autogenerated.
  * @copy_mode: When to trigger writes to the target.
+ * @perf: Bounds for the length and number of parallel copy requests, which
+ *        are then tuned while the job runs; %NULL for fixed defaults.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -1263,7 +1280,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp);
+                  MirrorCopyMode copy_mode, const MirrorPerf *perf,
+                  Error **errp);
 
 /*
  * backup_job_create:
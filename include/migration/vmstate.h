@@ -182,6 +182,14 @@ struct VMStateDescription {
     int minimum_version_id;
     int minimum_version_id_old;
     MigrationPriority priority;
+    /*
+     * The state does not depend on the order it is saved or loaded in
+     * relative to other devices with the same priority, and its callbacks
+     * can run outside of the iothread lock, concurrently with those of
+     * other devices.  Such devices are saved and loaded in parallel when
+     * the device-state-threads migration parameter is above 1.
+     */
+    bool parallel;
     LoadStateHandler *load_state_old;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
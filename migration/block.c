@@ -769,10 +769,10 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 
     blk_mig_reset_dirty_cursor();
 
-    /* control the rate of transfer */
+    /* control the rate of transfer: read ahead up to 100ms worth of data */
     blk_mig_lock();
     while (block_mig_state.read_done * BLK_MIG_BLOCK_SIZE <
-           qemu_file_get_rate_limit(f) &&
+           qemu_file_get_rate_limit(f) / 10 &&
            block_mig_state.submitted < MAX_PARALLEL_IO &&
            (block_mig_state.submitted + block_mig_state.read_done) <
            MAX_IO_BUFFERS) {
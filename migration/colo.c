@@ -14,6 +14,8 @@
 #include "sysemu/sysemu.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-visit-migration.h"
+#include "qapi/clone-visitor.h"
 #include "qemu-file-channel.h"
 #include "migration.h"
 #include "qemu-file.h"
@@ -45,6 +47,9 @@ static Notifier packets_compare_notifier;
 /* User need to know colo mode after COLO failover */
 static COLOMode last_colo_mode;
 
+/* Timings of the checkpoints, updated and read with the BQL held */
+static COLOCheckpointStats checkpoint_stats;
+
 #define COLO_BUFFER_BASE_SIZE (4 * 1024 * 1024)
 
 bool migration_in_colo_state(void)
@@ -275,6 +280,23 @@ void qmp_xen_colo_do_checkpoint(Error **errp)
 }
 #endif
 
+/*
+ * Account a checkpoint whose phases were timed in @stats; the VM was
+ * stopped at @stop_time.  Called with the BQL held, just before the VM
+ * is restarted.
+ */
+static void colo_checkpoint_stats_update(COLOCheckpointStats *stats,
+                                         int64_t stop_time)
+{
+    stats->count = checkpoint_stats.count + 1;
+    stats->downtime = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - stop_time;
+    stats->max_downtime = MAX(checkpoint_stats.max_downtime,
+                              stats->downtime);
+    checkpoint_stats = *stats;
+    trace_colo_checkpoint_stats(stats->count, stats->downtime, stats->ram,
+                                stats->device);
+}
+
 COLOStatus *qmp_query_colo_status(Error **errp)
 {
     COLOStatus *s = g_new0(COLOStatus, 1);
@@ -282,6 +304,12 @@ COLOStatus *qmp_query_colo_status(Error **errp)
     s->mode = get_colo_mode();
     s->last_mode = last_colo_mode;
 
+    if (checkpoint_stats.count) {
+        s->has_checkpoint_stats = true;
+        s->checkpoint_stats = QAPI_CLONE(COLOCheckpointStats,
+                                         &checkpoint_stats);
+    }
+
     switch (failover_get_state()) {
     case FAILOVER_STATUS_NONE:
         s->reason = COLO_EXIT_REASON_NONE;
@@ -402,7 +430,9 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
                                           QIOChannelBuffer *bioc,
                                           QEMUFile *fb)
 {
+    COLOCheckpointStats stats = { .has_secondary = true };
     Error *local_err = NULL;
+    int64_t stop_time, start;
     int ret = -1;
 
     colo_send_message(s->to_dst_file, COLO_MESSAGE_CHECKPOINT_REQUEST,
@@ -427,6 +457,7 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
     }
     vm_stop_force_state(RUN_STATE_COLO);
     qemu_mutex_unlock_iothread();
+    stop_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     trace_colo_vm_state_change("run", "stop");
     /*
      * Failover request bh could be called after vm_stop_force_state(),
@@ -459,7 +490,9 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
         goto out;
     }
     /* Note: device state is saved into buffer */
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = qemu_save_device_state(fb);
+    stats.device = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
 
     qemu_mutex_unlock_iothread();
     if (ret < 0) {
@@ -470,7 +503,9 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
      * TODO: We may need a timeout mechanism to prevent COLO process
      * to be blocked here.
      */
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     qemu_savevm_live_state(s->to_dst_file);
+    stats.ram = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
 
     qemu_fflush(fb);
 
@@ -490,6 +525,7 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
     if (ret < 0) {
         goto out;
     }
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     colo_receive_check_message(s->rp_state.from_dst_file,
                        COLO_MESSAGE_VMSTATE_RECEIVED, &local_err);
@@ -508,10 +544,12 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
     if (local_err) {
         goto out;
     }
+    stats.secondary = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
 
     ret = 0;
 
     qemu_mutex_lock_iothread();
+    colo_checkpoint_stats_update(&stats, stop_time);
     vm_start();
     qemu_mutex_unlock_iothread();
     trace_colo_vm_state_change("stop", "run");
@@ -567,6 +605,7 @@ static void colo_process_checkpoint(MigrationState *s)
     object_unref(OBJECT(bioc));
 
     qemu_mutex_lock_iothread();
+    memset(&checkpoint_stats, 0, sizeof(checkpoint_stats));
 #ifdef CONFIG_REPLICATION
     replication_start_all(REPLICATION_MODE_PRIMARY, &local_err);
     if (local_err) {
@@ -678,15 +717,18 @@ void migrate_start_colo_process(MigrationState *s)
 static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
                       QEMUFile *fb, QIOChannelBuffer *bioc, Error **errp)
 {
+    COLOCheckpointStats stats = { .has_flush = true };
     uint64_t total_size;
     uint64_t value;
     Error *local_err = NULL;
+    int64_t stop_time, start;
     int ret;
 
     qemu_mutex_lock_iothread();
     vm_stop_force_state(RUN_STATE_COLO);
     trace_colo_vm_state_change("run", "stop");
     qemu_mutex_unlock_iothread();
+    stop_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     /* FIXME: This is unnecessary for periodic checkpoint mode */
     colo_send_message(mis->to_src_file, COLO_MESSAGE_CHECKPOINT_REPLY,
@@ -705,7 +747,9 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
 
     qemu_mutex_lock_iothread();
     cpu_synchronize_all_states();
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = qemu_loadvm_state_main(mis->from_src_file, mis);
+    stats.ram = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
     qemu_mutex_unlock_iothread();
 
     if (ret < 0) {
@@ -747,8 +791,12 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
 
     qemu_mutex_lock_iothread();
     vmstate_loading = true;
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     colo_flush_ram_cache();
+    stats.flush = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = qemu_load_device_state(fb);
+    stats.device = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
     if (ret < 0) {
         error_setg(errp, "COLO: load device state failed");
         vmstate_loading = false;
@@ -787,6 +835,7 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
     }
 
     vmstate_loading = false;
+    colo_checkpoint_stats_update(&stats, stop_time);
     vm_start();
     trace_colo_vm_state_change("stop", "run");
     qemu_mutex_unlock_iothread();
@@ -863,6 +912,7 @@ void *colo_process_incoming_thread(void *opaque)
     object_unref(OBJECT(bioc));
 
     qemu_mutex_lock_iothread();
+    memset(&checkpoint_stats, 0, sizeof(checkpoint_stats));
 #ifdef CONFIG_REPLICATION
     replication_start_all(REPLICATION_MODE_SECONDARY, &local_err);
     if (local_err) {
@@ -66,10 +66,8 @@
 
 #define MAX_THROTTLE  (128 << 20)      /* Migration transfer speed throttling */
 
-/* Amount of time to allocate to each "chunk" of bandwidth-throttled
- * data. */
+/* Period of the throughput measurements, in ms */
 #define BUFFER_DELAY     100
-#define XFER_LIMIT_RATIO (1000 / BUFFER_DELAY)
 
 /* Time in milliseconds we are allowed to stop the source,
  * for sending the last part */
@@ -103,6 +101,12 @@
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+/* Threads synchronizing the migration dirty bitmap */
+#define DEFAULT_MIGRATE_DIRTY_SYNC_THREADS 1
+/* Threads saving and loading the device state in parallel */
+#define DEFAULT_MIGRATE_DEVICE_STATE_THREADS 1
+/* Threads flushing the COLO RAM cache in parallel */
+#define DEFAULT_MIGRATE_X_COLO_FLUSH_THREADS 1
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -157,7 +161,6 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME,
     MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE,
     MIGRATION_CAPABILITY_RETURN_PATH,
-    MIGRATION_CAPABILITY_MULTIFD,
     MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER,
     MIGRATION_CAPABILITY_AUTO_CONVERGE,
     MIGRATION_CAPABILITY_RELEASE_RAM,
@@ -208,6 +211,7 @@ void migration_object_init(void)
         g_array_new(FALSE, TRUE, sizeof(struct PostCopyFD));
     qemu_mutex_init(&current_incoming->rp_mutex);
     qemu_event_init(&current_incoming->main_thread_load_event, false);
+    qemu_event_init(&current_incoming->postcopy_listen_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
     qemu_mutex_init(&current_incoming->page_request_mutex);
@@ -264,6 +268,8 @@ void migration_incoming_state_destroy(void)
 {
     struct MigrationIncomingState *mis = migration_incoming_get_current();
 
+    postcopy_preempt_incoming_cleanup(mis);
+
     if (mis->to_src_file) {
         /* Tell source that we are done */
         migrate_send_rp_shut(mis, qemu_file_get_error(mis->from_src_file) != 0);
@@ -281,6 +287,7 @@ void migration_incoming_state_destroy(void)
     }
 
     qemu_event_reset(&mis->main_thread_load_event);
+    qemu_event_reset(&mis->postcopy_listen_event);
 
     if (mis->page_requested) {
         g_tree_destroy(mis->page_requested);
@@ -398,10 +405,13 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         if (!received && !g_tree_lookup(mis->page_requested, aligned)) {
             /*
              * The page has not been received, and it's not yet in the page
-             * request list.  Queue it.  Set the value of element to 1, so that
-             * things like g_tree_lookup() will return TRUE (1) when found.
+             * request list.  Queue it.  The value of the element is the
+             * time of the request, used to account the fault latency once
+             * the page is placed; it is never 0, so that things like
+             * g_tree_lookup() will return TRUE when found.
              */
-            g_tree_insert(mis->page_requested, aligned, (gpointer)1);
+            g_tree_insert(mis->page_requested, aligned,
+                          GUINT_TO_POINTER(postcopy_page_request_stamp()));
             mis->page_requested_count++;
             trace_postcopy_page_req_add(aligned, mis->page_requested_count);
         }
@@ -421,22 +431,34 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
 static bool migration_colo_enabled;
 bool migration_incoming_colo_enabled(void)
 {
-    return migration_colo_enabled;
+    return qatomic_load_acquire(&migration_colo_enabled);
 }
 
 void migration_incoming_disable_colo(void)
 {
     ram_block_discard_disable(false);
-    migration_colo_enabled = false;
+    qatomic_set(&migration_colo_enabled, false);
 }
 
 int migration_incoming_enable_colo(void)
 {
+    int ret;
+
     if (ram_block_discard_disable(true)) {
         error_report("COLO: cannot disable RAM discard");
         return -EBUSY;
     }
-    migration_colo_enabled = true;
+
+    /*
+     * The multifd receive threads start to fill the RAM cache as soon as
+     * they see COLO enabled, so it must be allocated first.
+     */
+    ret = colo_init_ram_cache();
+    if (ret) {
+        ram_block_discard_disable(false);
+        return ret;
+    }
+    qatomic_store_release(&migration_colo_enabled, true);
     return 0;
 }
 
@@ -479,6 +501,7 @@ static void process_incoming_migration_bh(void *opaque)
 {
     Error *local_err = NULL;
     MigrationIncomingState *mis = opaque;
+    int64_t start_time;
 
     /* If capability late_block_activate is set:
      * Only fire up the block code now if we're going to restart the
@@ -515,6 +538,7 @@ static void process_incoming_migration_bh(void *opaque)
 
     dirty_bitmap_mig_before_vm_start();
 
+    start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     if (!global_state_received() ||
         global_state_get_runstate() == RUN_STATE_RUNNING) {
         if (autostart) {
@@ -528,6 +552,9 @@ static void process_incoming_migration_bh(void *opaque)
     } else {
         runstate_set(global_state_get_runstate());
     }
+    mis->downtime_vm_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                             start_time;
+    trace_migration_incoming_vm_start(mis->downtime_vm_start);
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -720,9 +747,28 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
          */
         start_migration = !migrate_use_multifd();
     } else {
-        /* Multiple connections */
-        assert(migrate_use_multifd());
-        start_migration = multifd_recv_new_channel(ioc, &local_err);
+        /*
+         * Multiple connections: either a multifd channel or the postcopy
+         * preempt channel, tell them apart by their magic.
+         */
+        uint32_t magic;
+
+        if (qio_channel_read_all(ioc, (char *)&magic, sizeof(magic),
+                                 &local_err)) {
+            error_propagate(errp, local_err);
+            return;
+        }
+        magic = be32_to_cpu(magic);
+
+        if (magic == POSTCOPY_PREEMPT_MAGIC && migrate_postcopy_preempt()) {
+            /* Migration does not wait for it, urgent pages queue up */
+            postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+            start_migration = false;
+        } else {
+            assert(migrate_use_multifd());
+            start_migration = multifd_recv_new_channel(ioc, magic,
+                                                       &local_err);
+        }
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -747,6 +793,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt() && !mis->postcopy_qemufile_dst) {
+        return false;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -892,6 +942,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->multifd_zlib_level = s->parameters.multifd_zlib_level;
     params->has_multifd_zstd_level = true;
     params->multifd_zstd_level = s->parameters.multifd_zstd_level;
+    params->has_dirty_sync_threads = true;
+    params->dirty_sync_threads = s->parameters.dirty_sync_threads;
+    params->has_device_state_threads = true;
+    params->device_state_threads = s->parameters.device_state_threads;
+    params->has_x_colo_flush_threads = true;
+    params->x_colo_flush_threads = s->parameters.x_colo_flush_threads;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
     params->has_max_postcopy_bandwidth = true;
@@ -975,6 +1031,23 @@ bool migration_is_running(int state)
     }
 }
 
+static void populate_downtime_stats(MigrationInfo *info, MigrationState *s)
+{
+    MigrationDowntimeStats *stats = g_new0(MigrationDowntimeStats, 1);
+
+    stats->has_vm_stop = true;
+    stats->vm_stop = s->downtime_vm_stop;
+    stats->has_bitmap_sync = true;
+    /* The final phase does the last sync of the dirty bitmap */
+    stats->bitmap_sync = ram_counters.dirty_sync_time;
+    qemu_savevm_fill_downtime_stats(stats, true);
+
+    /* We may have been the destination of a previous migration */
+    qapi_free_MigrationDowntimeStats(info->downtime_stats);
+    info->has_downtime_stats = true;
+    info->downtime_stats = stats;
+}
+
 static void populate_time_info(MigrationInfo *info, MigrationState *s)
 {
     info->has_status = true;
@@ -985,6 +1058,7 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
         info->total_time = s->total_time;
         info->has_downtime = true;
         info->downtime = s->downtime;
+        populate_downtime_stats(info, s);
     } else {
         info->has_total_time = true;
         info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
@@ -1012,8 +1086,10 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->dirty_sync_time = ram_counters.dirty_sync_time;
+    info->ram->dirty_sync_time_total = ram_counters.dirty_sync_time_total;
 
-    if (migrate_use_xbzrle()) {
+    if (migrate_use_xbzrle() || migrate_use_multifd_xbzrle()) {
         info->has_xbzrle_cache = true;
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
@@ -1048,6 +1124,30 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     }
 }
 
+static void populate_channel_info(MigrationInfo *info, MigrationState *s)
+{
+    MigrationChannelInfoList **tail = &info->channels;
+    MigrationChannelInfo *channel;
+
+    info->has_channels = true;
+
+    channel = g_new0(MigrationChannelInfo, 1);
+    channel->name = g_strdup("main");
+    channel->transferred = s->main_channel.bytes;
+    channel->mbps = s->main_channel.mbps;
+    QAPI_LIST_APPEND(tail, channel);
+
+    if (s->preempt_channel.bytes) {
+        channel = g_new0(MigrationChannelInfo, 1);
+        channel->name = g_strdup("postcopy-preempt");
+        channel->transferred = s->preempt_channel.bytes;
+        channel->mbps = s->preempt_channel.mbps;
+        QAPI_LIST_APPEND(tail, channel);
+    }
+
+    multifd_send_fill_channel_info(&tail);
+}
+
 static void populate_disk_info(MigrationInfo *info)
 {
     if (blk_mig_active()) {
@@ -1114,6 +1214,7 @@ static void fill_source_migration_info(MigrationInfo *info)
         /* TODO add some postcopy stats */
         populate_time_info(info, s);
         populate_ram_info(info, s);
+        populate_channel_info(info, s);
         populate_disk_info(info);
         populate_vfio_info(info);
         break;
@@ -1124,6 +1225,7 @@ static void fill_source_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_COMPLETED:
         populate_time_info(info, s);
         populate_ram_info(info, s);
+        populate_channel_info(info, s);
         populate_vfio_info(info);
         break;
     case MIGRATION_STATUS_FAILED:
@@ -1229,6 +1331,19 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Postcopy preempt is not compatible with "
+                       "compress");
+            return false;
+        }
+    }
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1282,16 +1397,25 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_CANCELLING:
     case MIGRATION_STATUS_CANCELLED:
     case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_COLO:
+        info->has_status = true;
+        break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_POSTCOPY_PAUSED:
     case MIGRATION_STATUS_POSTCOPY_RECOVER:
-    case MIGRATION_STATUS_FAILED:
-    case MIGRATION_STATUS_COLO:
         info->has_status = true;
+        fill_destination_postcopy_fault_latency(info);
         break;
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
+        fill_destination_postcopy_fault_latency(info);
+        info->has_downtime_stats = true;
+        info->downtime_stats = g_new0(MigrationDowntimeStats, 1);
+        info->downtime_stats->has_vm_start = true;
+        info->downtime_stats->vm_start = mis->downtime_vm_start;
+        qemu_savevm_fill_downtime_stats(info->downtime_stats, false);
         break;
     }
     info->status = mis->state;
@@ -1423,6 +1547,30 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_dirty_sync_threads &&
+        (params->dirty_sync_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "dirty_sync_threads",
+                   "a value between 1 and 255");
+        return false;
+    }
+
+    if (params->has_device_state_threads &&
+        (params->device_state_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "device_state_threads",
+                   "a value between 1 and 255");
+        return false;
+    }
+
+    if (params->has_x_colo_flush_threads &&
+        (params->x_colo_flush_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_colo_flush_threads",
+                   "a value between 1 and 255");
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1550,6 +1698,15 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_multifd_compression) {
         dest->multifd_compression = params->multifd_compression;
     }
+    if (params->has_dirty_sync_threads) {
+        dest->dirty_sync_threads = params->dirty_sync_threads;
+    }
+    if (params->has_device_state_threads) {
+        dest->device_state_threads = params->device_state_threads;
+    }
+    if (params->has_x_colo_flush_threads) {
+        dest->x_colo_flush_threads = params->x_colo_flush_threads;
+    }
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
@@ -1637,8 +1794,8 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_max_bandwidth) {
         s->parameters.max_bandwidth = params->max_bandwidth;
         if (s->to_dst_file && !migration_in_postcopy()) {
-            qemu_file_set_rate_limit(s->to_dst_file,
-                                s->parameters.max_bandwidth / XFER_LIMIT_RATIO);
+            mig_rate_limit_set_speed(&s->rate_limit,
+                                     s->parameters.max_bandwidth);
         }
     }
 
@@ -1662,6 +1819,15 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_multifd_compression) {
         s->parameters.multifd_compression = params->multifd_compression;
     }
+    if (params->has_dirty_sync_threads) {
+        s->parameters.dirty_sync_threads = params->dirty_sync_threads;
+    }
+    if (params->has_device_state_threads) {
+        s->parameters.device_state_threads = params->device_state_threads;
+    }
+    if (params->has_x_colo_flush_threads) {
+        s->parameters.x_colo_flush_threads = params->x_colo_flush_threads;
+    }
     if (params->has_xbzrle_cache_size) {
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
@@ -1669,8 +1835,8 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_max_postcopy_bandwidth) {
         s->parameters.max_postcopy_bandwidth = params->max_postcopy_bandwidth;
         if (s->to_dst_file && migration_in_postcopy()) {
-            qemu_file_set_rate_limit(s->to_dst_file,
-                    s->parameters.max_postcopy_bandwidth / XFER_LIMIT_RATIO);
+            mig_rate_limit_set_speed(&s->rate_limit,
+                                     s->parameters.max_postcopy_bandwidth);
         }
     }
     if (params->has_max_cpu_throttle) {
@@ -1817,6 +1983,7 @@ static void migrate_fd_cleanup(MigrationState *s)
         }
         qemu_mutex_lock_iothread();
 
+        postcopy_preempt_done(s);
         multifd_save_cleanup();
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
@@ -2035,6 +2202,8 @@ void migrate_init(MigrationState *s)
     s->rp_state.error = false;
     s->mbps = 0.0;
     s->pages_per_second = 0.0;
+    memset(&s->main_channel, 0, sizeof(s->main_channel));
+    memset(&s->preempt_channel, 0, sizeof(s->preempt_channel));
     s->downtime = 0;
     s->expected_downtime = 0;
     s->setup_time = 0;
@@ -2510,6 +2679,33 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+int migrate_dirty_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.dirty_sync_threads;
+}
+
+int migrate_device_state_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.device_state_threads;
+}
+
+int migrate_colo_flush_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_colo_flush_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -2519,6 +2715,12 @@ int migrate_use_xbzrle(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE];
 }
 
+bool migrate_use_multifd_xbzrle(void)
+{
+    return migrate_use_multifd() &&
+           migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE;
+}
+
 uint64_t migrate_xbzrle_cache_size(void)
 {
     MigrationState *s;
@@ -2564,6 +2766,24 @@ bool migrate_use_block_incremental(void)
     return s->parameters.block_incremental;
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_parallel_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PARALLEL_DEVICE_STATE];
+}
+
 bool migrate_background_snapshot(void)
 {
     MigrationState *s;
@@ -2891,6 +3111,7 @@ static int postcopy_start(MigrationState *ms)
     QEMUFile *fb;
     int64_t time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
+    int64_t stop_time;
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
     if (!migrate_pause_before_switchover()) {
@@ -2904,7 +3125,9 @@ static int postcopy_start(MigrationState *ms)
 
     qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
     global_state_store();
+    stop_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    ms->downtime_vm_stop = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - stop_time;
     if (ret < 0) {
         goto fail;
     }
@@ -2946,11 +3169,7 @@ static int postcopy_start(MigrationState *ms)
      * wrap their state up here
      */
     /* 0 max-postcopy-bandwidth means unlimited */
-    if (!bandwidth) {
-        qemu_file_set_rate_limit(ms->to_dst_file, INT64_MAX);
-    } else {
-        qemu_file_set_rate_limit(ms->to_dst_file, bandwidth / XFER_LIMIT_RATIO);
-    }
+    mig_rate_limit_set_speed(&ms->rate_limit, bandwidth);
     if (migrate_postcopy_ram()) {
         /* Ping just for debugging, helps line traces up */
         qemu_savevm_send_ping(ms->to_dst_file, 2);
@@ -3120,15 +3339,21 @@ static void migration_completion(MigrationState *s)
 
         if (!ret) {
             bool inactivate = !migrate_colo_enabled();
+            int64_t stop_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
             ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+            s->downtime_vm_stop = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                  stop_time;
             if (ret >= 0) {
                 ret = migration_maybe_pause(s, &current_active_state,
                                             MIGRATION_STATUS_DEVICE);
             }
             if (ret >= 0) {
-                qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+                mig_rate_limit_set_speed(&s->rate_limit, 0);
                 ret = qemu_savevm_state_complete_precopy(s->to_dst_file, false,
                                                          inactivate);
+                trace_migration_completion_downtime(
+                    s->downtime_vm_stop, ram_counters.dirty_sync_time);
             }
             if (inactivate && ret >= 0) {
                 s->block_inactive = true;
@@ -3143,6 +3368,8 @@ static void migration_completion(MigrationState *s)
         trace_migration_completion_postcopy_end();
 
         qemu_savevm_state_complete_postcopy(s->to_dst_file);
+        /* The destination waits for the preempt channel to be closed */
+        postcopy_preempt_done(s);
         trace_migration_completion_postcopy_end_after_complete();
     } else if (s->state == MIGRATION_STATUS_CANCELLING) {
         goto fail;
@@ -3324,6 +3551,12 @@ static MigThrError postcopy_pause(MigrationState *s)
         qemu_file_shutdown(file);
         qemu_fclose(file);
 
+        /*
+         * The preempt channel is not re-established on recovery, requested
+         * pages go through the main channel from now on.
+         */
+        postcopy_preempt_done(s);
+
         migrate_set_state(&s->state, s->state,
                           MIGRATION_STATUS_POSTCOPY_PAUSED);
 
@@ -3439,6 +3672,22 @@ static void migration_calculate_complete(MigrationState *s)
     }
 }
 
+/*
+ * Record that @bytes were written to a channel since it was created, and
+ * compute its throughput over the last @time_spent ms.
+ */
+void migration_channel_stats_update(MigrationChannelStats *stats,
+                                    uint64_t bytes, uint64_t time_spent)
+{
+    /* A new channel replaced the one we knew, e.g. after a recovery */
+    uint64_t delta = bytes >= stats->bytes ? bytes - stats->bytes : bytes;
+
+    if (time_spent) {
+        stats->mbps = ((double) delta * 8.0) / time_spent / 1000.0;
+    }
+    stats->bytes = bytes;
+}
+
 static void update_iteration_initial_status(MigrationState *s)
 {
     /*
@@ -3455,6 +3704,7 @@ static void migration_update_counters(MigrationState *s,
 {
     uint64_t transferred, transferred_pages, time_spent;
     uint64_t current_bytes; /* bytes transferred since the beginning */
+    QEMUFile *preempt_file;
     double bandwidth;
 
     if (current_time < s->iteration_start_time + BUFFER_DELAY) {
@@ -3475,6 +3725,16 @@ static void migration_update_counters(MigrationState *s,
     s->pages_per_second = (double) transferred_pages /
                              (((double) time_spent / 1000.0));
 
+    migration_channel_stats_update(&s->main_channel,
+                                   qemu_ftell(s->to_dst_file), time_spent);
+    preempt_file = qatomic_read(&s->postcopy_qemufile_src);
+    if (preempt_file) {
+        migration_channel_stats_update(&s->preempt_channel,
+                                       qemu_ftell_fast(preempt_file),
+                                       time_spent);
+    }
+    multifd_send_update_stats(time_spent);
+
     /*
      * if we haven't sent anything, we don't want to
      * recalculate. 10000 is a small enough number for our purposes
@@ -3483,8 +3743,6 @@ static void migration_update_counters(MigrationState *s,
         s->expected_downtime = ram_counters.remaining / bandwidth;
     }
 
-    qemu_file_reset_rate_limit(s->to_dst_file);
-
     update_iteration_initial_status(s);
 
     trace_migrate_transferred(transferred, time_spent,
@@ -3648,10 +3906,13 @@ bool migration_rate_limit(void)
             return false;
         }
         /*
-         * Wait for a delay to do rate limiting OR
-         * something urgent to post the semaphore.
+         * Wait for the bandwidth limit to allow writing again OR
+         * something urgent to post the semaphore.  Don't sleep past
+         * the end of the iteration, the counters have to be updated.
          */
-        int ms = s->iteration_start_time + BUFFER_DELAY - now;
+        int64_t delay = mig_rate_limit_delay(&s->rate_limit);
+        int ms = MIN(DIV_ROUND_UP(delay, SCALE_MS),
+                     MAX(s->iteration_start_time + BUFFER_DELAY - now, 1));
         trace_migration_rate_limit_pre(ms);
         if (qemu_sem_timedwait(&s->rate_limit_sem, ms) == 0) {
             /*
@@ -3808,7 +4069,7 @@ static void *bg_migration_thread(void *opaque)
     rcu_register_thread();
     object_ref(OBJECT(s));
 
-    qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+    mig_rate_limit_set_speed(&s->rate_limit, 0);
 
     setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
     /*
@@ -3947,7 +4208,7 @@ fail:
 void migrate_fd_connect(MigrationState *s, Error *error_in)
 {
     Error *local_err = NULL;
-    int64_t rate_limit;
+    uint64_t rate_limit;
     bool resume = s->state == MIGRATION_STATUS_POSTCOPY_PAUSED;
 
     s->expected_downtime = s->parameters.downtime_limit;
@@ -3965,17 +4226,17 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
 
     if (resume) {
         /* This is a resumed migration */
-        rate_limit = s->parameters.max_postcopy_bandwidth /
-            XFER_LIMIT_RATIO;
+        rate_limit = s->parameters.max_postcopy_bandwidth;
     } else {
         /* This is a fresh new migration */
-        rate_limit = s->parameters.max_bandwidth / XFER_LIMIT_RATIO;
+        rate_limit = s->parameters.max_bandwidth;
 
         /* Notify before starting migration thread */
         notifier_list_notify(&migration_state_notifiers, s);
     }
 
-    qemu_file_set_rate_limit(s->to_dst_file, rate_limit);
+    mig_rate_limit_set_speed(&s->rate_limit, rate_limit);
+    qemu_file_set_rate_limit(s->to_dst_file, &s->rate_limit);
     qemu_file_set_blocking(s->to_dst_file, true);
 
     /*
@@ -4008,6 +4269,10 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         return;
     }
 
+    if (migrate_postcopy_preempt()) {
+        postcopy_preempt_setup(s);
+    }
+
     if (migrate_background_snapshot()) {
         qemu_thread_create(&s->thread, "bg_snapshot",
                 bg_migration_thread, s, QEMU_THREAD_JOINABLE);
@@ -4095,6 +4360,15 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-zstd-level", MigrationState,
                       parameters.multifd_zstd_level,
                       DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL),
+    DEFINE_PROP_UINT8("dirty-sync-threads", MigrationState,
+                      parameters.dirty_sync_threads,
+                      DEFAULT_MIGRATE_DIRTY_SYNC_THREADS),
+    DEFINE_PROP_UINT8("device-state-threads", MigrationState,
+                      parameters.device_state_threads,
+                      DEFAULT_MIGRATE_DEVICE_STATE_THREADS),
+    DEFINE_PROP_UINT8("x-colo-flush-threads", MigrationState,
+                      parameters.x_colo_flush_threads,
+                      DEFAULT_MIGRATE_X_COLO_FLUSH_THREADS),
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
@@ -4155,6 +4429,7 @@ static void migration_instance_finalize(Object *obj)
     g_free(params->tls_creds);
     qemu_sem_destroy(&ms->wait_unplug_sem);
     qemu_sem_destroy(&ms->rate_limit_sem);
+    mig_rate_limit_destroy(&ms->rate_limit);
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
@@ -4192,6 +4467,9 @@ static void migration_instance_init(Object *obj)
     params->has_multifd_compression = true;
     params->has_multifd_zlib_level = true;
     params->has_multifd_zstd_level = true;
+    params->has_dirty_sync_threads = true;
+    params->has_device_state_threads = true;
+    params->has_x_colo_flush_threads = true;
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
@@ -4204,6 +4482,7 @@ static void migration_instance_init(Object *obj)
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
+    mig_rate_limit_init(&ms->rate_limit);
     qemu_sem_init(&ms->wait_unplug_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
 }
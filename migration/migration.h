@@ -23,6 +23,7 @@
 #include "io/channel-buffer.h"
 #include "net/announce.h"
 #include "qom/object.h"
+#include "rate-limit.h"
 
 struct PostcopyBlocktimeContext;
 
@@ -45,6 +46,19 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/* Channels that can carry RAM pages during postcopy */
+typedef enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+} RamChannel;
+
+/*
+ * Number of buckets of the postcopy fault latency histogram; bucket N
+ * counts latencies in [2^N, 2^(N+1)) us, so the last one starts at ~8s.
+ */
+#define POSTCOPY_FAULT_LATENCY_BUCKETS    24
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -77,7 +91,8 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Temporary pages where host pages are built, one per RamChannel */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
@@ -98,11 +113,25 @@ struct MigrationIncomingState {
      * */
     struct PostcopyBlocktimeContext *blocktime_ctx;
 
+    /* Time spent starting the VM once migration completed (us) */
+    int64_t downtime_vm_start;
+
     /* notify PAUSED postcopy incoming migrations to try to continue */
     bool postcopy_recover_triggered;
     QemuSemaphore postcopy_pause_sem_dst;
     QemuSemaphore postcopy_pause_sem_fault;
 
+    /*
+     * Set once postcopy pages can be placed, or when the incoming
+     * migration is torn down; waiters must check the postcopy state.
+     */
+    QemuEvent postcopy_listen_event;
+
+    /* Postcopy preempt channel, only carrying the requested pages */
+    QEMUFile *postcopy_qemufile_dst;
+    bool have_preempt_thread;
+    QemuThread postcopy_preempt_thread;
+
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
 
@@ -122,6 +151,15 @@ struct MigrationIncomingState {
      * contains valid information.
      */
     QemuMutex page_request_mutex;
+
+    /*
+     * Latency of the requested pages, from the request until the page is
+     * placed (us).  Protected by page_request_mutex.
+     */
+    uint64_t fault_latency_count;
+    uint64_t fault_latency_total;
+    uint64_t fault_latency_max;
+    uint64_t fault_latency_buckets[POSTCOPY_FAULT_LATENCY_BUCKETS];
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -130,9 +168,21 @@ void migration_incoming_state_destroy(void);
  * Functions to work with blocktime context
  */
 void fill_destination_postcopy_migration_info(MigrationInfo *info);
+void fill_destination_postcopy_fault_latency(MigrationInfo *info);
 
 #define TYPE_MIGRATION "migration"
 
+/* Throughput of one of the channels of the outgoing migration */
+typedef struct MigrationChannelStats {
+    /* bytes written to the channel */
+    uint64_t bytes;
+    /* throughput over the last iteration, in megabits per second */
+    double mbps;
+} MigrationChannelStats;
+
+void migration_channel_stats_update(MigrationChannelStats *stats,
+                                    uint64_t bytes, uint64_t time_spent);
+
 typedef struct MigrationClass MigrationClass;
 DECLARE_OBJ_CHECKERS(MigrationState, MigrationClass,
                      MIGRATION_OBJ, TYPE_MIGRATION)
@@ -151,6 +201,14 @@ struct MigrationState {
     QEMUBH *vm_start_bh;
     QEMUBH *cleanup_bh;
     QEMUFile *to_dst_file;
+    /*
+     * Postcopy preempt channel.  It is set up asynchronously and then
+     * only used by the migration thread, which uses the main channel
+     * until it shows up.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    /* Set once the preempt channel isn't needed anymore */
+    bool postcopy_preempt_done;
     QIOChannelBuffer *bioc;
     /*
      * Protects to_dst_file pointer.  We need to make sure we won't
@@ -163,6 +221,11 @@ struct MigrationState {
      * Used to allow urgent requests to override rate limiting.
      */
     QemuSemaphore rate_limit_sem;
+    /* Bandwidth limit shared by the main, multifd and preempt channels */
+    MigRateLimit rate_limit;
+    /* Throughput of the main and postcopy preempt channels */
+    MigrationChannelStats main_channel;
+    MigrationChannelStats preempt_channel;
 
     /* pages already send at the beginning of current iteration */
     uint64_t iteration_initial_pages;
@@ -202,6 +265,8 @@ struct MigrationState {
     /* Timestamp when VM is down (ms) to migrate the last stuff */
     int64_t downtime_start;
     int64_t downtime;
+    /* Time spent stopping the VM for the last stuff (us) */
+    int64_t downtime_vm_stop;
     int64_t expected_downtime;
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
@@ -325,8 +390,12 @@ int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
 int migrate_multifd_zlib_level(void);
 int migrate_multifd_zstd_level(void);
+int migrate_dirty_sync_threads(void);
+int migrate_device_state_threads(void);
+int migrate_colo_flush_threads(void);
 
 int migrate_use_xbzrle(void);
+bool migrate_use_multifd_xbzrle(void);
 uint64_t migrate_xbzrle_cache_size(void);
 bool migrate_colo_enabled(void);
 
@@ -345,6 +414,8 @@ int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
 bool migrate_background_snapshot(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_parallel_device_state(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
@@ -0,0 +1,469 @@
+/*
+ * Multifd XBZRLE compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/rcu.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "exec/target_page.h"
+#include "exec/ramblock.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "ram.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Each send channel owns one shard of the XBZRLE page cache.  The shard
+ * for a page is picked from its address in MULTIFD_PACKET_SIZE chunks,
+ * so the batches queued by the migration thread, which are runs of
+ * consecutive pages handed to channels round robin, mostly land in the
+ * shard of the channel that encodes them.  Channels can still encode
+ * pages of other shards, so every shard has its own lock.
+ *
+ * The data of a packet is a sequence of records, one per page:
+ *
+ *   u8 type
+ *   MULTIFD_XBZRLE_RAW:       page_size bytes of page data
+ *   MULTIFD_XBZRLE_ENCODED:   be32 length, followed by length bytes of
+ *                             xbzrle_encode_buffer() output
+ *   MULTIFD_XBZRLE_UNCHANGED: nothing, the page is the same as last time
+ */
+
+#define MULTIFD_XBZRLE_RAW       0
+#define MULTIFD_XBZRLE_ENCODED   1
+#define MULTIFD_XBZRLE_UNCHANGED 2
+
+/* Largest record: type byte, length and a full page */
+#define MULTIFD_XBZRLE_RECORD_MAX(page_size) (1 + 4 + (page_size))
+
+typedef struct {
+    PageCache *cache;
+    QemuMutex lock;
+} XBZRLEShard;
+
+static struct {
+    XBZRLEShard *shards;
+    int num_shards;
+    /* number of channels still using the shards */
+    int users;
+    /* protects xbzrle_counters against the other channels */
+    QemuMutex counters_lock;
+    /* cached for zero pages, which are sent on the main channel */
+    uint8_t *zero_page;
+} multifd_xbzrle;
+
+struct xbzrle_data {
+    /* packet buffer */
+    uint8_t *zbuff;
+    /* size of packet buffer */
+    uint32_t zbuff_len;
+    /* stable copy of the page being encoded */
+    uint8_t *current_buf;
+};
+
+static XBZRLEShard *xbzrle_get_shard(ram_addr_t addr)
+{
+    return &multifd_xbzrle.shards[(addr / MULTIFD_PACKET_SIZE) %
+                                  multifd_xbzrle.num_shards];
+}
+
+/**
+ * multifd_xbzrle_cache_zero_page: update the cache for a zero page
+ *
+ * Zero pages are sent on the main channel; make sure that the shard
+ * holding @addr does not keep stale contents for it.
+ *
+ * @addr: ram address of the page
+ * @current_age: current bitmap generation
+ */
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr, uint64_t current_age)
+{
+    XBZRLEShard *shard;
+
+    if (!multifd_xbzrle.shards) {
+        return;
+    }
+
+    shard = xbzrle_get_shard(addr);
+    qemu_mutex_lock(&shard->lock);
+    /*
+     * We don't care if this fails to allocate a new cache page
+     * as long as it updated an old one
+     */
+    cache_insert(shard->cache, addr, multifd_xbzrle.zero_page, current_age);
+    qemu_mutex_unlock(&shard->lock);
+}
+
+/* Multifd xbzrle compression */
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * Create the cache shard owned by this channel and the packet buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    size_t page_size = qemu_target_page_size();
+    uint64_t shard_size;
+    XBZRLEShard *shard;
+    struct xbzrle_data *z;
+
+    if (!multifd_xbzrle.shards) {
+        multifd_xbzrle.num_shards = migrate_multifd_channels();
+        multifd_xbzrle.shards = g_new0(XBZRLEShard,
+                                       multifd_xbzrle.num_shards);
+        multifd_xbzrle.zero_page = g_malloc0(page_size);
+        qemu_mutex_init(&multifd_xbzrle.counters_lock);
+    }
+
+    /* Split xbzrle-cache-size evenly, each shard a power of two pages */
+    shard_size = migrate_xbzrle_cache_size() / multifd_xbzrle.num_shards;
+    shard_size = MAX(pow2floor(shard_size / page_size), 1) * page_size;
+
+    shard = &multifd_xbzrle.shards[p->id];
+    shard->cache = cache_init(shard_size, page_size, errp);
+    if (!shard->cache) {
+        return -1;
+    }
+    qemu_mutex_init(&shard->lock);
+    multifd_xbzrle.users++;
+
+    z = g_new0(struct xbzrle_data, 1);
+    z->zbuff_len = page_count * MULTIFD_XBZRLE_RECORD_MAX(page_size);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    z->current_buf = g_try_malloc(page_size);
+    p->data = z;
+    if (!z->zbuff || !z->current_buf) {
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * Free the cache shard once the last channel is gone.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+    XBZRLEShard *shard;
+    int i;
+
+    if (z) {
+        g_free(z->zbuff);
+        g_free(z->current_buf);
+        g_free(z);
+        p->data = NULL;
+    }
+
+    if (!multifd_xbzrle.shards) {
+        return;
+    }
+    shard = &multifd_xbzrle.shards[p->id];
+    if (!shard->cache) {
+        return;
+    }
+    cache_fini(shard->cache);
+    shard->cache = NULL;
+    qemu_mutex_destroy(&shard->lock);
+
+    if (--multifd_xbzrle.users == 0) {
+        for (i = 0; i < multifd_xbzrle.num_shards; i++) {
+            assert(!multifd_xbzrle.shards[i].cache);
+        }
+        g_free(multifd_xbzrle.shards);
+        multifd_xbzrle.shards = NULL;
+        multifd_xbzrle.num_shards = 0;
+        g_free(multifd_xbzrle.zero_page);
+        multifd_xbzrle.zero_page = NULL;
+        qemu_mutex_destroy(&multifd_xbzrle.counters_lock);
+    }
+}
+
+/**
+ * xbzrle_send_prepare: prepare date to be able to send
+ *
+ * Delta encode every page of the packet against the copy in its cache
+ * shard, falling back to the raw page on a cache miss or when the
+ * encoding would not be smaller.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+    size_t page_size = qemu_target_page_size();
+    uint64_t age = p->pages->xbzrle_age;
+    RAMBlock *block = p->pages->block;
+    uint64_t pages = 0, bytes = 0, cache_miss = 0, overflow = 0;
+    uint8_t *out = z->zbuff;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        ram_addr_t addr = block->offset + p->pages->offset[i];
+        uint8_t *page = p->pages->iov[i].iov_base;
+        XBZRLEShard *shard;
+        uint8_t *cached;
+        int encoded_len;
+
+        /* Zero pages are not cached either, see xbzrle_cache_age() */
+        if (!age) {
+            *out++ = MULTIFD_XBZRLE_RAW;
+            memcpy(out, page, page_size);
+            out += page_size;
+            continue;
+        }
+
+        shard = xbzrle_get_shard(addr);
+        qemu_mutex_lock(&shard->lock);
+
+        if (!cache_is_cached(shard->cache, addr, age)) {
+            cache_miss++;
+            /*
+             * Send the page from the cache copy if it made it in, the
+             * guest may change it while we are working on it.
+             */
+            if (cache_insert(shard->cache, addr, page, age) == 0) {
+                page = get_cached_data(shard->cache, addr);
+            }
+            *out++ = MULTIFD_XBZRLE_RAW;
+            memcpy(out, page, page_size);
+            out += page_size;
+            qemu_mutex_unlock(&shard->lock);
+            continue;
+        }
+
+        pages++;
+        cached = get_cached_data(shard->cache, addr);
+        memcpy(z->current_buf, page, page_size);
+        encoded_len = xbzrle_encode_buffer(cached, z->current_buf, page_size,
+                                           out + 5, page_size);
+        if (encoded_len == 0) {
+            *out++ = MULTIFD_XBZRLE_UNCHANGED;
+        } else if (encoded_len < 0) {
+            overflow++;
+            bytes += page_size;
+            memcpy(cached, z->current_buf, page_size);
+            *out++ = MULTIFD_XBZRLE_RAW;
+            memcpy(out, z->current_buf, page_size);
+            out += page_size;
+        } else {
+            bytes += encoded_len + 5;
+            memcpy(cached, z->current_buf, page_size);
+            *out = MULTIFD_XBZRLE_ENCODED;
+            stl_be_p(out + 1, encoded_len);
+            out += 5 + encoded_len;
+        }
+        qemu_mutex_unlock(&shard->lock);
+    }
+
+    if (pages || cache_miss) {
+        qemu_mutex_lock(&multifd_xbzrle.counters_lock);
+        xbzrle_counters.pages += pages;
+        xbzrle_counters.bytes += bytes;
+        xbzrle_counters.cache_miss += cache_miss;
+        xbzrle_counters.overflow += overflow;
+        qemu_mutex_unlock(&multifd_xbzrle.counters_lock);
+    }
+
+    p->next_packet_size = out - z->zbuff;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+    return 0;
+}
+
+/**
+ * xbzrle_send_write: do the actual write of the data
+ *
+ * Do the actual write of the encoded buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_write(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+
+    return qio_channel_write_all(p->c, (void *)z->zbuff, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Create the packet buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct xbzrle_data *z = g_new0(struct xbzrle_data, 1);
+
+    p->data = z;
+    z->zbuff_len = page_count *
+        MULTIFD_XBZRLE_RECORD_MAX(qemu_target_page_size());
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        p->data = NULL;
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: cleanup receive side
+ *
+ * Free the packet buffer.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *z = p->data;
+
+    if (!z) {
+        return;
+    }
+    g_free(z->zbuff);
+    g_free(z);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the packet and apply each record to its page.  Encoded pages
+ * are decoded on top of the current page contents, which the source
+ * guarantees to be the version that it has cached.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                             Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    size_t page_size = qemu_target_page_size();
+    uint8_t *in = z->zbuff;
+    uint8_t *end = z->zbuff + in_size;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %d: packet size received %u maximum %u",
+                   p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        uint32_t len;
+
+        if (in >= end) {
+            goto truncated;
+        }
+        switch (*in++) {
+        case MULTIFD_XBZRLE_UNCHANGED:
+            break;
+        case MULTIFD_XBZRLE_RAW:
+            if (end - in < page_size) {
+                goto truncated;
+            }
+            memcpy(iov->iov_base, in, page_size);
+            in += page_size;
+            break;
+        case MULTIFD_XBZRLE_ENCODED:
+            if (end - in < 4) {
+                goto truncated;
+            }
+            len = ldl_be_p(in);
+            in += 4;
+            if (len > end - in || len > page_size) {
+                goto truncated;
+            }
+            if (xbzrle_decode_buffer(in, len, iov->iov_base, page_size) < 0) {
+                error_setg(errp, "multifd %d: failed to decode XBZRLE page %u",
+                           p->id, i);
+                return -1;
+            }
+            in += len;
+            break;
+        default:
+            error_setg(errp, "multifd %d: unknown XBZRLE record type %u",
+                       p->id, in[-1]);
+            return -1;
+        }
+    }
+    if (in != end) {
+        error_setg(errp, "multifd %d: packet size received %u size used %td",
+                   p->id, in_size, in - z->zbuff);
+        return -1;
+    }
+    return 0;
+
+truncated:
+    error_setg(errp, "multifd %d: truncated XBZRLE packet", p->id);
+    return -1;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .send_write = xbzrle_send_write,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv_pages = xbzrle_recv_pages
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
@@ -12,6 +12,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -19,6 +20,8 @@
 #include "qapi/error.h"
 #include "ram.h"
 #include "migration.h"
+#include "migration/colo.h"
+#include "postcopy-ram.h"
 #include "socket.h"
 #include "tls.h"
 #include "qemu-file.h"
@@ -194,25 +197,30 @@ static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
     return 0;
 }
 
-static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
+/*
+ * The magic has already been read by the caller, to tell multifd channels
+ * apart from the postcopy preempt channel.
+ */
+static int multifd_recv_initial_packet(QIOChannel *c, uint32_t magic,
+                                       Error **errp)
 {
     MultiFDInit_t msg;
     int ret;
 
-    ret = qio_channel_read_all(c, (char *)&msg, sizeof(msg), errp);
-    if (ret != 0) {
+    if (magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "expected %x", magic, MULTIFD_MAGIC);
         return -1;
     }
 
-    msg.magic = be32_to_cpu(msg.magic);
-    msg.version = be32_to_cpu(msg.version);
-
-    if (msg.magic != MULTIFD_MAGIC) {
-        error_setg(errp, "multifd: received packet magic %x "
-                   "expected %x", msg.magic, MULTIFD_MAGIC);
+    ret = qio_channel_read_all(c, (char *)&msg.version,
+                               sizeof(msg) - sizeof(msg.magic), errp);
+    if (ret != 0) {
         return -1;
     }
 
+    msg.version = be32_to_cpu(msg.version);
+
     if (msg.version != MULTIFD_VERSION) {
         error_setg(errp, "multifd: received packet version %d "
                    "expected %d", msg.version, MULTIFD_VERSION);
@@ -260,9 +268,28 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     pages->iov = NULL;
     g_free(pages->offset);
     pages->offset = NULL;
+    qemu_vfree(pages->copy);
+    pages->copy = NULL;
     g_free(pages);
 }
 
+/*
+ * With background snapshot, the write protection of a page is removed
+ * once it is queued, so the guest may change it before the channel
+ * sends it: copy the pages when they are queued instead.
+ */
+static MultiFDPages_t *multifd_send_pages_init(size_t size)
+{
+    MultiFDPages_t *pages = multifd_pages_init(size);
+
+    if (migrate_background_snapshot()) {
+        pages->copy = qemu_memalign(qemu_real_host_page_size,
+                                    size * qemu_target_page_size());
+    }
+
+    return pages;
+}
+
 static void multifd_send_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
@@ -355,6 +382,24 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+        /* Only whole host pages can be placed, one at a time */
+        if (!p->postcopy_buf || p->pages->used > pages_max ||
+            block->page_size != qemu_target_page_size() ||
+            migrate_use_multifd_xbzrle()) {
+            error_setg(errp, "multifd: unexpected postcopy packet for "
+                       "ram block %s", block->idstr);
+            return -1;
+        }
+    }
+    p->pages->block = block;
+
+    if (migration_incoming_colo_enabled() && !block->colo_cache) {
+        error_setg(errp, "multifd: no COLO cache for ram block %s",
+                   block->idstr);
+        return -1;
+    }
+
     for (i = 0; i < p->pages->used; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
@@ -364,7 +409,20 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
+        p->pages->offset[i] = offset;
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            p->pages->iov[i].iov_base = p->postcopy_buf +
+                                        i * qemu_target_page_size();
+        } else if (migration_incoming_in_colo_state()) {
+            /*
+             * Checkpoint pages go to the RAM cache, and the bitmap tells
+             * colo_flush_ram_cache() which ones to copy to guest memory.
+             */
+            set_bit_atomic(offset >> qemu_target_page_bits(), block->bmap);
+            p->pages->iov[i].iov_base = block->colo_cache + offset;
+        } else {
+            p->pages->iov[i].iov_base = block->host + offset;
+        }
         p->pages->iov[i].iov_len = qemu_target_page_size();
     }
 
@@ -446,11 +504,14 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->block);
 
     p->packet_num = multifd_send_state->packet_num++;
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    }
+    pages->xbzrle_age = ram_xbzrle_cache_age();
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->used) * qemu_target_page_size()
                 + p->packet_len;
-    qemu_file_update_transfer(f, transferred);
     ram_counters.multifd_bytes += transferred;
     ram_counters.transferred += transferred;
     qemu_mutex_unlock(&p->mutex);
@@ -462,15 +523,22 @@ static int multifd_send_pages(QEMUFile *f)
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
 {
     MultiFDPages_t *pages = multifd_send_state->pages;
+    size_t page_size = qemu_target_page_size();
 
     if (!pages->block) {
         pages->block = block;
     }
 
     if (pages->block == block) {
+        void *page = block->host + offset;
+
+        if (pages->copy) {
+            page = memcpy(pages->copy + pages->used * page_size, page,
+                          page_size);
+        }
         pages->offset[pages->used] = offset;
-        pages->iov[pages->used].iov_base = block->host + offset;
-        pages->iov[pages->used].iov_len = qemu_target_page_size();
+        pages->iov[pages->used].iov_base = page;
+        pages->iov[pages->used].iov_len = page_size;
         pages->used++;
 
         if (pages->used < pages->allocated) {
@@ -489,6 +557,22 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return 1;
 }
 
+/*
+ * Send the pages queued so far without waiting for the packet to be full.
+ * In postcopy, the destination may be waiting for one of them.
+ *
+ * Returns 1 if a packet was sent, 0 if there was nothing to send, or -1
+ * on error.
+ */
+int multifd_queue_flush(QEMUFile *f)
+{
+    if (!multifd_send_state->pages->used) {
+        return 0;
+    }
+    trace_multifd_queue_flush(multifd_send_state->pages->used);
+    return multifd_send_pages(f);
+}
+
 static void multifd_send_terminate_threads(Error *err)
 {
     int i;
@@ -523,6 +607,7 @@ static void multifd_send_terminate_threads(Error *err)
         qemu_mutex_lock(&p->mutex);
         p->quit = true;
         qemu_sem_post(&p->sem);
+        qemu_sem_post(&p->sem_quit);
         qemu_mutex_unlock(&p->mutex);
     }
 }
@@ -551,6 +636,7 @@ void multifd_save_cleanup(void)
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
         qemu_sem_destroy(&p->sem_sync);
+        qemu_sem_destroy(&p->sem_quit);
         g_free(p->name);
         p->name = NULL;
         g_free(p->tls_hostname);
@@ -604,7 +690,6 @@ void multifd_send_sync_main(QEMUFile *f)
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
         p->pending_job++;
-        qemu_file_update_transfer(f, p->packet_len);
         ram_counters.multifd_bytes += p->packet_len;
         ram_counters.transferred += p->packet_len;
         qemu_mutex_unlock(&p->mutex);
@@ -619,9 +704,57 @@ void multifd_send_sync_main(QEMUFile *f)
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/*
+ * Compute the throughput of the channels over the last @time_spent ms;
+ * called by the migration thread.
+ */
+void multifd_send_update_stats(uint64_t time_spent)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        uint64_t bytes;
+
+        qemu_mutex_lock(&p->mutex);
+        bytes = p->bytes_sent;
+        qemu_mutex_unlock(&p->mutex);
+        migration_channel_stats_update(&p->stats, bytes, time_spent);
+    }
+}
+
+/* Append the statistics of the channels for query-migrate */
+void multifd_send_fill_channel_info(MigrationChannelInfoList ***tail)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        MigrationChannelInfo *channel = g_new0(MigrationChannelInfo, 1);
+
+        channel->name = g_strdup(p->name);
+        channel->mbps = p->stats.mbps;
+        qemu_mutex_lock(&p->mutex);
+        channel->transferred = p->bytes_sent;
+        channel->has_pending = true;
+        channel->pending = p->pending_job;
+        qemu_mutex_unlock(&p->mutex);
+        QAPI_LIST_APPEND(*tail, channel);
+    }
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
+    MigRateLimit *rate_limit = &migrate_get_current()->rate_limit;
     Error *local_err = NULL;
     int ret = 0;
     uint32_t flags = 0;
@@ -647,6 +780,7 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint32_t used = p->pages->used;
             uint64_t packet_num = p->packet_num;
+            uint64_t size;
             flags = p->flags;
 
             if (used) {
@@ -668,6 +802,17 @@ static void *multifd_send_thread(void *opaque)
             trace_multifd_send(p->id, packet_num, used, flags,
                                p->next_packet_size);
 
+            /* The bandwidth limit is shared with the other channels */
+            size = p->packet_len + (used ? p->next_packet_size : 0);
+            if (!mig_rate_limit_wait(rate_limit, size, &p->sem_quit)) {
+                qemu_mutex_lock(&p->mutex);
+                assert(p->quit);
+                qemu_mutex_unlock(&p->mutex);
+                /* Release whoever waits for this job, like on errors */
+                ret = -1;
+                break;
+            }
+
             ret = qio_channel_write_all(p->c, (void *)p->packet,
                                         p->packet_len, &local_err);
             if (ret != 0) {
@@ -683,6 +828,7 @@ static void *multifd_send_thread(void *opaque)
 
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
+            p->bytes_sent += size;
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
@@ -874,11 +1020,16 @@ int multifd_save_setup(Error **errp)
     if (!migrate_use_multifd()) {
         return 0;
     }
+    /* The channels are connected to the socket address of the migration */
+    if (!socket_send_channel_available()) {
+        error_setg(errp, "multifd needs a socket migration destination");
+        return -1;
+    }
     s = migrate_get_current();
     thread_count = migrate_multifd_channels();
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
-    multifd_send_state->pages = multifd_pages_init(page_count);
+    multifd_send_state->pages = multifd_send_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
@@ -889,10 +1040,11 @@ int multifd_save_setup(Error **errp)
         qemu_mutex_init(&p->mutex);
         qemu_sem_init(&p->sem, 0);
         qemu_sem_init(&p->sem_sync, 0);
+        qemu_sem_init(&p->sem_quit, 0);
         p->quit = false;
         p->pending_job = 0;
         p->id = i;
-        p->pages = multifd_pages_init(page_count);
+        p->pages = multifd_send_pages_init(page_count);
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(uint64_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
@@ -971,6 +1123,8 @@ int multifd_load_cleanup(Error **errp)
         return 0;
     }
     multifd_recv_terminate_threads(NULL);
+    /* Threads may be waiting to place postcopy pages */
+    qemu_event_set(&migration_incoming_get_current()->postcopy_listen_event);
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
@@ -1005,6 +1159,8 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        qemu_vfree(p->postcopy_buf);
+        p->postcopy_buf = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
@@ -1043,6 +1199,54 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/*
+ * Before COLO starts, the secondary keeps a copy of every page it
+ * receives in its RAM cache, like ram_load_precopy() does.
+ */
+static void multifd_recv_colo_backup(MultiFDRecvParams *p, uint32_t used)
+{
+    RAMBlock *block = p->pages->block;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        ram_addr_t offset = p->pages->offset[i];
+
+        memcpy(block->colo_cache + offset, block->host + offset,
+               qemu_target_page_size());
+    }
+}
+
+/*
+ * Place the pages of a postcopy packet; each of them is a whole host page.
+ */
+static int multifd_recv_place_pages(MultiFDRecvParams *p, uint32_t used,
+                                    Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block = p->pages->block;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < used; i++) {
+        void *host = block->host + p->pages->offset[i];
+        void *from = p->pages->iov[i].iov_base;
+
+        if (buffer_is_zero(from, page_size)) {
+            ret = postcopy_place_page_zero(mis, host, block);
+        } else {
+            ret = postcopy_place_page(mis, host, from, block);
+        }
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd %d: failed to place page "
+                             "at offset 0x" RAM_ADDR_FMT " of %s", p->id,
+                             p->pages->offset[i], block->idstr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1093,6 +1297,25 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (used && !(flags & MULTIFD_FLAG_POSTCOPY) &&
+            migration_incoming_colo_enabled() &&
+            !migration_incoming_in_colo_state()) {
+            multifd_recv_colo_backup(p, used);
+        }
+
+        if (used && (flags & MULTIFD_FLAG_POSTCOPY)) {
+            /* The source may switch to postcopy before we got to LISTEN */
+            qemu_event_wait(&migration_incoming_get_current()->
+                            postcopy_listen_event);
+            if (p->quit) {
+                break;
+            }
+            ret = multifd_recv_place_pages(p, used, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -1141,6 +1364,11 @@ int multifd_load_setup(Error **errp)
                       + sizeof(uint64_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
+        if (migrate_postcopy_ram()) {
+            p->postcopy_buf = qemu_memalign(qemu_target_page_size(),
+                                            page_count *
+                                            qemu_target_page_size());
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -1174,13 +1402,13 @@ bool multifd_recv_all_channels_created(void)
  * - Return false and do not set @errp when correctly receiving the current one;
  * - Return false and set @errp when failing to receive the current channel.
  */
-bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
+bool multifd_recv_new_channel(QIOChannel *ioc, uint32_t magic, Error **errp)
 {
     MultiFDRecvParams *p;
     Error *local_err = NULL;
     int id;
 
-    id = multifd_recv_initial_packet(ioc, &local_err);
+    id = multifd_recv_initial_packet(ioc, magic, &local_err);
     if (id < 0) {
         multifd_recv_terminate_threads(local_err);
         error_propagate_prepend(errp, local_err,
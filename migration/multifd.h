@@ -18,10 +18,13 @@ void multifd_save_cleanup(void);
 int multifd_load_setup(Error **errp);
 int multifd_load_cleanup(Error **errp);
 bool multifd_recv_all_channels_created(void);
-bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
+bool multifd_recv_new_channel(QIOChannel *ioc, uint32_t magic, Error **errp);
 void multifd_recv_sync_main(void);
 void multifd_send_sync_main(QEMUFile *f);
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
+int multifd_queue_flush(QEMUFile *f);
+void multifd_send_update_stats(uint64_t time_spent);
+void multifd_send_fill_channel_info(MigrationChannelInfoList ***tail);
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -32,6 +35,11 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_XBZRLE (3 << 1)
+#define MULTIFD_FLAG_LZ4 (4 << 1)
+
+/* The pages must be placed atomically, the destination is in postcopy */
+#define MULTIFD_FLAG_POSTCOPY (1 << 4)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -62,7 +70,14 @@ typedef struct {
     ram_addr_t *offset;
     /* pointer to each page */
     struct iovec *iov;
+    /*
+     * copy of the pages, when they can't be sent from guest memory
+     * because they are released as soon as they are queued
+     */
+    uint8_t *copy;
     RAMBlock *block;
+    /* XBZRLE cache generation for the pages, 0 while the caches are unused */
+    uint64_t xbzrle_age;
 } MultiFDPages_t;
 
 typedef struct {
@@ -104,8 +119,14 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* bytes written to the channel, protected by the mutex */
+    uint64_t bytes_sent;
+    /* throughput of the channel, updated by the migration thread */
+    MigrationChannelStats stats;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* posted with quit set, interrupts waiting for the bandwidth limit */
+    QemuSemaphore sem_quit;
     /* used for compression methods */
     void *data;
 }  MultiFDSendParams;
@@ -145,6 +166,8 @@ typedef struct {
     uint64_t num_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* pages of a postcopy packet are received here, then placed */
+    uint8_t *postcopy_buf;
     /* used for de-compression methods */
     void *data;
 } MultiFDRecvParams;
@@ -168,5 +191,7 @@ typedef struct {
 
 void multifd_register_ops(int method, MultiFDMethods *ops);
 
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr, uint64_t current_age);
+
 #endif
 
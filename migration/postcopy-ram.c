@@ -26,10 +26,14 @@
 #include "qapi/error.h"
 #include "qemu/notify.h"
 #include "qemu/rcu.h"
+#include "qemu/host-utils.h"
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "hw/boards.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
+#include "tls.h"
 
 /* Arbitrary limit on size of each discard command,
  * keeps them around ~200 bytes
@@ -177,6 +181,59 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     info->postcopy_vcpu_blocktime = get_vcpu_blocktime_list(bc);
 }
 
+/*
+ * Populate MigrationInfo with the latency of the requested pages; only
+ * meaningful once postcopy has started.
+ *
+ * @info: pointer to MigrationInfo to populate
+ */
+void fill_destination_postcopy_fault_latency(MigrationInfo *info)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyFaultLatency *latency;
+    int i;
+
+    if (postcopy_state_get() < POSTCOPY_INCOMING_LISTENING) {
+        return;
+    }
+
+    latency = g_new0(PostcopyFaultLatency, 1);
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        latency->count = mis->fault_latency_count;
+        latency->total = mis->fault_latency_total;
+        latency->max = mis->fault_latency_max;
+        for (i = POSTCOPY_FAULT_LATENCY_BUCKETS - 1; i >= 0; i--) {
+            QAPI_LIST_PREPEND(latency->buckets,
+                              mis->fault_latency_buckets[i]);
+        }
+    }
+    info->has_postcopy_fault_latency = true;
+    info->postcopy_fault_latency = latency;
+}
+
+/*
+ * Account the latency of a requested page that was just placed.
+ * Called with page_request_mutex held.
+ *
+ * @stamp: time stamp of the request, see postcopy_page_request_stamp()
+ */
+static void postcopy_fault_latency_account(MigrationIncomingState *mis,
+                                           uint32_t stamp)
+{
+    /* Time stamps are 32 bits, so this is fine across a wrap around */
+    uint32_t latency = postcopy_page_request_stamp() - stamp;
+    int bucket = 0;
+
+    if (latency >= 2) {
+        bucket = MIN(31 - clz32(latency), POSTCOPY_FAULT_LATENCY_BUCKETS - 1);
+    }
+    mis->fault_latency_buckets[bucket]++;
+    mis->fault_latency_count++;
+    mis->fault_latency_total += latency;
+    mis->fault_latency_max = MAX(mis->fault_latency_max, latency);
+    trace_postcopy_fault_latency(latency);
+}
+
 static uint32_t get_postcopy_total_blocktime(void)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
@@ -521,8 +578,13 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /* Pages may still be placed by the preempt thread until it's gone */
+    postcopy_preempt_incoming_cleanup(mis);
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -557,9 +619,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -1055,6 +1119,16 @@ retry:
 
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
+    int i;
+
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        mis->fault_latency_count = 0;
+        mis->fault_latency_total = 0;
+        mis->fault_latency_max = 0;
+        memset(mis->fault_latency_buckets, 0,
+               sizeof(mis->fault_latency_buckets));
+    }
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1093,14 +1167,20 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                                  PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                                  MAP_ANONYMOUS, -1, 0);
-    if (mis->postcopy_tmp_page == MAP_FAILED) {
-        mis->postcopy_tmp_page = NULL;
-        error_report("%s: Failed to map postcopy_tmp_page %s",
-                     __func__, strerror(errno));
-        return -1;
+    /* The preempt channel needs its own page, as it's loaded concurrently */
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (i == RAM_CHANNEL_POSTCOPY && !migrate_postcopy_preempt()) {
+            continue;
+        }
+        mis->postcopy_tmp_pages[i] = mmap(NULL, mis->largest_page_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mis->postcopy_tmp_pages[i] == MAP_FAILED) {
+            mis->postcopy_tmp_pages[i] = NULL;
+            error_report("%s: Failed to map postcopy_tmp_page %s",
+                         __func__, strerror(errno));
+            return -1;
+        }
     }
 
     /*
@@ -1128,6 +1208,7 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
     int userfault_fd = mis->userfault_fd;
+    gpointer stamp;
     int ret;
 
     if (from_addr) {
@@ -1152,7 +1233,9 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
          * If this page resolves a page fault for a previous recorded faulted
          * address, take a special note to maintain the requested page list.
          */
-        if (g_tree_lookup(mis->page_requested, host_addr)) {
+        stamp = g_tree_lookup(mis->page_requested, host_addr);
+        if (stamp) {
+            postcopy_fault_latency_account(mis, GPOINTER_TO_UINT(stamp));
             g_tree_remove(mis->page_requested, host_addr);
             mis->page_requested_count--;
             trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
@@ -1241,6 +1324,10 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
 {
 }
 
+void fill_destination_postcopy_fault_latency(MigrationInfo *info)
+{
+}
+
 bool postcopy_ram_supported_by_host(MigrationIncomingState *mis)
 {
     error_report("%s: No OS support", __func__);
@@ -1434,3 +1521,185 @@ void postcopy_unregister_shared_ufd(struct PostCopyFD *pcfd)
         }
     }
 }
+
+uint32_t postcopy_page_request_stamp(void)
+{
+    uint32_t stamp = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    return stamp ? stamp : 1;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Postcopy preempt channel */
+
+static void postcopy_preempt_send_channel_done(MigrationState *s,
+                                               QIOChannel *ioc, Error *err)
+{
+    QEMUFile *file;
+
+    if (err) {
+        warn_report("postcopy preempt channel: %s; requested pages will "
+                    "be sent on the main channel", error_get_pretty(err));
+        error_free(err);
+        object_unref(OBJECT(ioc));
+        return;
+    }
+
+    qio_channel_set_delay(ioc, false);
+    file = qemu_fopen_channel_output(ioc);
+    object_unref(OBJECT(ioc));
+    /* Requested pages are never held back, but they use up bandwidth */
+    qemu_file_set_rate_limit(file, &s->rate_limit);
+    qemu_put_be32(file, POSTCOPY_PREEMPT_MAGIC);
+    qemu_fflush(file);
+
+    trace_postcopy_preempt_send_channel_done();
+    qatomic_xchg(&s->postcopy_qemufile_src, file);
+    /* Too late, the destination must not wait for this channel to close */
+    if (qatomic_read(&s->postcopy_preempt_done)) {
+        postcopy_preempt_shutdown_file(s);
+    }
+}
+
+static void postcopy_preempt_tls_handshake(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *err = NULL;
+
+    qio_task_propagate_error(task, &err);
+    postcopy_preempt_send_channel_done(s, ioc, err);
+}
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    QIOChannelTLS *tioc;
+    Error *err = NULL;
+
+    if (qio_task_propagate_error(task, &err)) {
+        goto out;
+    }
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        tioc = migration_tls_client_create(s, ioc, s->hostname, &err);
+        if (!tioc) {
+            goto out;
+        }
+        object_unref(OBJECT(ioc));
+        qio_channel_set_name(QIO_CHANNEL(tioc), "migration-preempt-tls");
+        qio_channel_tls_handshake(tioc, postcopy_preempt_tls_handshake,
+                                  s, NULL, NULL);
+        return;
+    }
+
+out:
+    postcopy_preempt_send_channel_done(s, ioc, err);
+}
+
+/*
+ * Connect the preempt channel.  This happens in the background, and
+ * requested pages use the main channel until it is ready.
+ */
+void postcopy_preempt_setup(MigrationState *s)
+{
+    trace_postcopy_preempt_setup();
+    qatomic_set(&s->postcopy_preempt_done, false);
+    if (!socket_send_channel_available()) {
+        warn_report("postcopy preempt needs a socket migration; requested "
+                    "pages will be sent on the main channel");
+        return;
+    }
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+}
+
+/*
+ * Close the preempt channel.  Must be called from the migration thread,
+ * or once it is gone.
+ */
+void postcopy_preempt_shutdown_file(MigrationState *s)
+{
+    QEMUFile *file = qatomic_xchg(&s->postcopy_qemufile_src, NULL);
+
+    if (file) {
+        trace_postcopy_preempt_shutdown_file();
+        qemu_fclose(file);
+    }
+}
+
+void postcopy_preempt_done(MigrationState *s)
+{
+    qatomic_set(&s->postcopy_preempt_done, true);
+    smp_mb();
+    postcopy_preempt_shutdown_file(s);
+}
+
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    PostcopyState ps;
+    int ret = 0;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    /* Pages can't be placed before the main channel got to LISTEN */
+    qemu_event_wait(&mis->postcopy_listen_event);
+    ps = postcopy_state_get();
+
+    while (!ret && (ps == POSTCOPY_INCOMING_LISTENING ||
+                    ps == POSTCOPY_INCOMING_RUNNING)) {
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = ram_load_postcopy(mis->postcopy_qemufile_dst,
+                                    RAM_CHANNEL_POSTCOPY);
+        }
+        ps = postcopy_state_get();
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit(ret);
+    return NULL;
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    if (mis->have_preempt_thread) {
+        warn_report("postcopy preempt channel already set up, ignoring "
+                    "a new one");
+        qemu_fclose(file);
+        return;
+    }
+
+    trace_postcopy_preempt_new_channel();
+    /* The preempt thread reads the channel synchronously */
+    qemu_file_set_blocking(file, true);
+    mis->postcopy_qemufile_dst = file;
+    mis->have_preempt_thread = true;
+    qemu_thread_create(&mis->postcopy_preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+}
+
+void postcopy_preempt_incoming_cleanup(MigrationIncomingState *mis)
+{
+    if (!mis->have_preempt_thread) {
+        return;
+    }
+
+    /*
+     * When postcopy finished fine, the source closes the channel once the
+     * last requested page was sent, so let the thread load up to that
+     * point.  Otherwise there is nothing worth waiting for.
+     */
+    if (postcopy_state_get() != POSTCOPY_INCOMING_RUNNING ||
+        (mis->from_src_file && qemu_file_get_error(mis->from_src_file))) {
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+    qemu_event_set(&mis->postcopy_listen_event);
+    qemu_thread_join(&mis->postcopy_preempt_thread);
+    mis->have_preempt_thread = false;
+
+    qemu_fclose(mis->postcopy_qemufile_dst);
+    mis->postcopy_qemufile_dst = NULL;
+    trace_postcopy_preempt_incoming_cleanup();
+}
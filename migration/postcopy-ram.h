@@ -179,4 +179,31 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/*
+ * Time stamp (us) of a page request, as stored in page_requested; it is
+ * never zero, so that looking up a requested page always returns true.
+ */
+uint32_t postcopy_page_request_stamp(void);
+
+/*
+ * The postcopy preempt channel carries the pages requested by the
+ * destination.  It starts with this magic, so that the destination can
+ * tell it apart from the multifd channels.
+ */
+#define POSTCOPY_PREEMPT_MAGIC 0x5052454dU
+
+/* Source side: connect the preempt channel, and close it when done */
+void postcopy_preempt_setup(MigrationState *s);
+void postcopy_preempt_shutdown_file(MigrationState *s);
+/* No more requested pages will be sent, close the channel for good */
+void postcopy_preempt_done(MigrationState *s);
+
+/* Destination side: start loading pages from a new preempt channel */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+/*
+ * Stop the preempt thread; when postcopy is running and no error was
+ * seen, it first loads what the source sent until it closed the channel.
+ */
+void postcopy_preempt_incoming_cleanup(MigrationIncomingState *mis);
+
 #endif
@@ -38,8 +38,9 @@ struct QEMUFile {
     const QEMUFileHooks *hooks;
     void *opaque;
 
+    /* bytes written since they were last accounted to xfer_limit */
     int64_t bytes_xfer;
-    int64_t xfer_limit;
+    MigRateLimit *xfer_limit;
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
@@ -214,6 +215,14 @@ static void qemu_iovec_release_ram(QEMUFile *f)
  * This will flush all pending data. If data was only partially flushed, it
  * will set an error state.
  */
+static void qemu_file_account_rate_limit(QEMUFile *f)
+{
+    if (f->xfer_limit && f->bytes_xfer) {
+        mig_rate_limit_account(f->xfer_limit, f->bytes_xfer);
+    }
+    f->bytes_xfer = 0;
+}
+
 void qemu_fflush(QEMUFile *f)
 {
     ssize_t ret = 0;
@@ -227,6 +236,7 @@ void qemu_fflush(QEMUFile *f)
     if (f->shutdown) {
         return;
     }
+    qemu_file_account_rate_limit(f);
     if (f->iovcnt > 0) {
         expect = iov_size(f->iov, f->iovcnt);
         ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos,
@@ -657,6 +667,15 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Position of the next byte that will be returned to the reader,
+ * for files opened for reading.
+ */
+int64_t qemu_ftell_read(QEMUFile *f)
+{
+    return f->pos - f->buf_size + f->buf_index;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
@@ -665,30 +684,35 @@ int qemu_file_rate_limit(QEMUFile *f)
     if (qemu_file_get_error(f)) {
         return 1;
     }
-    if (f->xfer_limit > 0 && f->bytes_xfer > f->xfer_limit) {
-        return 1;
+    if (!f->xfer_limit) {
+        return 0;
     }
-    return 0;
+    qemu_file_account_rate_limit(f);
+    return mig_rate_limit_delay(f->xfer_limit) > 0;
 }
 
+/*
+ * Returns the number of bytes per second the file may write, or INT64_MAX
+ * if it is not limited.
+ */
 int64_t qemu_file_get_rate_limit(QEMUFile *f)
 {
-    return f->xfer_limit;
-}
-
-void qemu_file_set_rate_limit(QEMUFile *f, int64_t limit)
-{
-    f->xfer_limit = limit;
-}
+    uint64_t speed = 0;
 
-void qemu_file_reset_rate_limit(QEMUFile *f)
-{
-    f->bytes_xfer = 0;
+    if (f->xfer_limit) {
+        speed = mig_rate_limit_get_speed(f->xfer_limit);
+    }
+    return speed ? MIN(speed, INT64_MAX) : INT64_MAX;
 }
 
-void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+/*
+ * Account the data written to @f to the bandwidth limit @rl, that may be
+ * shared with other channels; NULL removes the limit.
+ */
+void qemu_file_set_rate_limit(QEMUFile *f, MigRateLimit *rl)
 {
-    f->bytes_xfer += len;
+    qemu_file_account_rate_limit(f);
+    f->xfer_limit = rl;
 }
 
 void qemu_put_be16(QEMUFile *f, unsigned int v)
@@ -81,6 +81,9 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/* Maximum number of UFFD write faults read at once */
+#define RAM_UFFD_FAULT_BATCH 64
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -309,6 +312,12 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /*
+     * While a requested page goes through the postcopy preempt channel,
+     * the main QEMUFile and the last block sent on the other channel
+     */
+    QEMUFile *main_f;
+    RAMBlock *postcopy_last_sent_block;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -354,6 +363,10 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /* UFFD write faults read but not serviced yet, for background snapshot */
+    uint64_t uffd_fault_addr[RAM_UFFD_FAULT_BATCH];
+    int uffd_fault_count;
+    int uffd_fault_next;
 };
 typedef struct RAMState RAMState;
 
@@ -410,6 +423,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* The page was requested by the destination */
+    bool         postcopy_requested;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -652,6 +667,27 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
     }
 }
 
+/**
+ * xbzrle_cache_age: generation of the XBZRLE caches for the pages sent now
+ *
+ * Returns 0 during the first pass over memory, where nothing would hit
+ * and the caches are left alone.  The zero page and the multifd paths
+ * both decide with this, so that a page is never delta encoded against a
+ * cached copy that missed a zero page.
+ *
+ * @rs: current RAM state
+ */
+static uint64_t xbzrle_cache_age(RAMState *rs)
+{
+    return rs->ram_bulk_stage ? 0 : ram_counters.dirty_sync_count;
+}
+
+/* Called from the migration thread when it hands pages to multifd */
+uint64_t ram_xbzrle_cache_age(void)
+{
+    return xbzrle_cache_age(ram_state);
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -666,14 +702,24 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
  */
 static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 {
-    if (rs->ram_bulk_stage || !migrate_use_xbzrle()) {
+    uint64_t age = xbzrle_cache_age(rs);
+
+    if (!age) {
+        return;
+    }
+
+    if (migrate_use_multifd_xbzrle() && !migration_in_postcopy()) {
+        multifd_xbzrle_cache_zero_page(current_addr, age);
+        return;
+    }
+
+    if (!migrate_use_xbzrle()) {
         return;
     }
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page, age);
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -866,6 +912,246 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * A pool of threads that process a list of RAMBlock ranges in parallel.
+ * The thread calling ram_worker_pool_run() takes part in the work too,
+ * so a pool for N-way parallelism only has N - 1 threads.
+ */
+typedef uint64_t (*RAMChunkFunc)(RAMBlock *rb, ram_addr_t start,
+                                 ram_addr_t length);
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} RAMChunk;
+
+typedef struct {
+    QemuThread *threads;
+    int thread_count;
+    QemuMutex lock;
+    /* signalled when there is new work or the threads have to quit */
+    QemuCond work_cond;
+    /* signalled when the last busy thread is done */
+    QemuCond done_cond;
+    /* incremented every time new work is posted */
+    uint64_t generation;
+    /* number of threads that haven't finished the current work */
+    int busy;
+    bool quit;
+    RAMChunkFunc func;
+    RAMChunk *chunks;
+    unsigned int nr_chunks;
+    /* index of the next chunk to process, updated atomically */
+    unsigned int next_chunk;
+    /* sum of the values returned by func */
+    uint64_t result;
+} RAMWorkerPool;
+
+static uint64_t ram_worker_pool_process(RAMWorkerPool *pool)
+{
+    uint64_t result = 0;
+    unsigned int i;
+
+    while ((i = qatomic_fetch_inc(&pool->next_chunk)) < pool->nr_chunks) {
+        RAMChunk *chunk = &pool->chunks[i];
+
+        result += pool->func(chunk->block, chunk->start, chunk->length);
+    }
+    return result;
+}
+
+static void *ram_worker_pool_thread(void *opaque)
+{
+    RAMWorkerPool *pool = opaque;
+    uint64_t generation = 0;
+    uint64_t result;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->quit && pool->generation == generation) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        generation = pool->generation;
+        qemu_mutex_unlock(&pool->lock);
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            result = ram_worker_pool_process(pool);
+        }
+
+        qemu_mutex_lock(&pool->lock);
+        pool->result += result;
+        if (--pool->busy == 0) {
+            qemu_cond_signal(&pool->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/**
+ * ram_worker_pool_create: create a pool of worker threads
+ *
+ * Returns the pool, or NULL if @threads is not bigger than 1 and the
+ * work is better done by the caller alone
+ *
+ * @threads: how many threads, including the caller, process the work
+ * @name: name of the threads
+ */
+static RAMWorkerPool *ram_worker_pool_create(int threads, const char *name)
+{
+    RAMWorkerPool *pool;
+    int i;
+
+    if (threads <= 1) {
+        return NULL;
+    }
+
+    pool = g_new0(RAMWorkerPool, 1);
+    pool->thread_count = threads - 1;
+    pool->threads = g_new0(QemuThread, pool->thread_count);
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+    for (i = 0; i < pool->thread_count; i++) {
+        qemu_thread_create(pool->threads + i, name, ram_worker_pool_thread,
+                           pool, QEMU_THREAD_JOINABLE);
+    }
+    return pool;
+}
+
+static void ram_worker_pool_destroy(RAMWorkerPool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->thread_count; i++) {
+        qemu_thread_join(pool->threads + i);
+    }
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+    g_free(pool->threads);
+    g_free(pool);
+}
+
+/**
+ * ram_worker_pool_run: call @func on every chunk and wait for completion
+ *
+ * Returns the sum of the values returned by @func
+ *
+ * Called with RCU critical section
+ *
+ * @pool: pool of threads helping the caller, or NULL
+ * @func: function processing one chunk
+ * @chunks: array of chunks
+ * @nr_chunks: number of elements in @chunks
+ */
+static uint64_t ram_worker_pool_run(RAMWorkerPool *pool, RAMChunkFunc func,
+                                    RAMChunk *chunks, unsigned int nr_chunks)
+{
+    uint64_t result = 0;
+    unsigned int i;
+
+    if (!pool || nr_chunks <= 1) {
+        for (i = 0; i < nr_chunks; i++) {
+            result += func(chunks[i].block, chunks[i].start, chunks[i].length);
+        }
+        return result;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->chunks = chunks;
+    pool->nr_chunks = nr_chunks;
+    pool->next_chunk = 0;
+    pool->result = 0;
+    pool->busy = pool->thread_count;
+    pool->generation++;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    result = ram_worker_pool_process(pool);
+
+    qemu_mutex_lock(&pool->lock);
+    while (pool->busy) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    result += pool->result;
+    pool->chunks = NULL;
+    qemu_mutex_unlock(&pool->lock);
+
+    return result;
+}
+
+/* Size of the pieces that the dirty bitmap sync is split into */
+#define DIRTY_SYNC_CHUNK_SIZE (1ULL << 30)
+/* Size of the pieces that the COLO RAM cache flush is split into */
+#define COLO_FLUSH_CHUNK_SIZE (64ULL << 20)
+
+static RAMWorkerPool *dirty_sync_pool;
+static RAMWorkerPool *colo_flush_pool;
+
+static uint64_t ram_chunk_sync_dirty_bitmap(RAMBlock *rb, ram_addr_t start,
+                                            ram_addr_t length)
+{
+    return cpu_physical_memory_sync_dirty_bitmap(rb, start, length);
+}
+
+/*
+ * Called with RCU critical section
+ *
+ * Split every RAMBlock in chunks that are synchronized in parallel.  The
+ * chunks are aligned to the clear_bmap granularity, so that no two of them
+ * touch the same word of the migration bitmap or of the clear bitmap.
+ * Blocks without a clear bitmap are cleared in one go by the memory core
+ * and are synchronized as a whole.
+ */
+static void ram_sync_dirty_bitmap_all(RAMState *rs)
+{
+    g_autoptr(GArray) chunks = g_array_new(false, false, sizeof(RAMChunk));
+    uint64_t new_dirty_pages;
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t chunk_size = block->used_length;
+        RAMChunk chunk = { .block = block };
+
+        if (dirty_sync_pool && block->clear_bmap) {
+            chunk_size = MAX(DIRTY_SYNC_CHUNK_SIZE,
+                             1ULL << (block->clear_bmap_shift +
+                                      TARGET_PAGE_BITS));
+        }
+        for (chunk.start = 0; chunk.start < block->used_length;
+             chunk.start += chunk_size) {
+            chunk.length = MIN(chunk_size, block->used_length - chunk.start);
+            g_array_append_val(chunks, chunk);
+        }
+    }
+
+    new_dirty_pages = ram_worker_pool_run(dirty_sync_pool,
+                                          ram_chunk_sync_dirty_bitmap,
+                                          (RAMChunk *)chunks->data,
+                                          chunks->len);
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -906,7 +1192,7 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
         return;
     }
 
-    if (migrate_use_xbzrle()) {
+    if (migrate_use_xbzrle() || migrate_use_multifd_xbzrle()) {
         double encoded_size, unencoded_size;
 
         xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
@@ -976,7 +1262,7 @@ static void migration_trigger_throttle(RAMState *rs)
 
 static void migration_bitmap_sync(RAMState *rs)
 {
-    RAMBlock *block;
+    int64_t start_time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int64_t end_time;
 
     ram_counters.dirty_sync_count++;
@@ -990,15 +1276,18 @@ static void migration_bitmap_sync(RAMState *rs)
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
-        }
+        ram_sync_dirty_bitmap_all(rs);
         ram_counters.remaining = ram_bytes_remaining();
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
     memory_global_after_dirty_log_sync();
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+
+    ram_counters.dirty_sync_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   start_time_us;
+    ram_counters.dirty_sync_time_total += ram_counters.dirty_sync_time;
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period,
+                                    ram_counters.dirty_sync_time);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1453,26 +1742,61 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
  */
 static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
 {
-    struct uffd_msg uffd_msg;
     void *page_address;
     RAMBlock *block;
-    int res;
 
     if (!migrate_background_snapshot()) {
         return NULL;
     }
 
-    res = uffd_read_events(rs->uffdio_fd, &uffd_msg, 1);
-    if (res <= 0) {
-        return NULL;
+    /*
+     * Read all the pending faults at once, so that every vcpu blocked
+     * on a write protected page is served before the background scan
+     * goes on.
+     */
+    if (rs->uffd_fault_next == rs->uffd_fault_count) {
+        struct uffd_msg uffd_msg[RAM_UFFD_FAULT_BATCH];
+        int res, i;
+
+        rs->uffd_fault_next = rs->uffd_fault_count = 0;
+        res = uffd_read_events(rs->uffdio_fd, uffd_msg, RAM_UFFD_FAULT_BATCH);
+        if (res <= 0) {
+            return NULL;
+        }
+        for (i = 0; i < res; i++) {
+            rs->uffd_fault_addr[i] = uffd_msg[i].arg.pagefault.address;
+        }
+        rs->uffd_fault_count = res;
     }
 
-    page_address = (void *)(uintptr_t) uffd_msg.arg.pagefault.address;
+    page_address = (void *)(uintptr_t)
+        rs->uffd_fault_addr[rs->uffd_fault_next++];
     block = qemu_ram_block_from_host(page_address, false, offset);
     assert(block && (block->flags & RAM_UF_WRITEPROTECT) != 0);
+    trace_poll_fault_page(block->idstr, (uint64_t)*offset,
+                          rs->uffd_fault_count - rs->uffd_fault_next);
     return block;
 }
 
+/*
+ * write_fault_pending: check for vcpus blocked on a write protected page
+ *
+ * Those are served even when the bandwidth limit has been reached.
+ *
+ * Returns true if there are UFFD write faults to service
+ *
+ * @rs: current RAM state
+ */
+static bool write_fault_pending(RAMState *rs)
+{
+    if (!migrate_background_snapshot()) {
+        return false;
+    }
+
+    return rs->uffd_fault_next < rs->uffd_fault_count ||
+           uffd_poll_events(rs->uffdio_fd, 0);
+}
+
 /**
  * ram_save_release_protection: release UFFD write protection after
  *   a range of pages has been saved
@@ -1721,6 +2045,13 @@ static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
     return NULL;
 }
 
+static bool write_fault_pending(RAMState *rs)
+{
+    (void) rs;
+
+    return false;
+}
+
 static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
         unsigned long start_page)
 {
@@ -1786,6 +2117,13 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
             if (!dirty) {
                 trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
                                                 page);
+                /*
+                 * It may be sitting in a partially filled multifd packet,
+                 * the destination is waiting for it.
+                 */
+                if (migrate_use_multifd() && migration_in_postcopy()) {
+                    multifd_queue_flush(rs->f);
+                }
             } else {
                 trace_get_queued_page(block->idstr, (uint64_t)offset, page);
             }
@@ -1793,6 +2131,8 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     } while (block && !dirty);
 
+    pss->postcopy_requested = !!block;
+
     if (!block) {
         /*
          * Poll write faults too if background snapshot is enabled; that's
@@ -2009,10 +2349,16 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
      * Do not use multifd for:
      * 1. Compression as the first page in the new block should be posted out
      *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
+     * 2. In postcopy, pages requested by the destination, which must not
+     *    wait behind a packet, and blocks whose host page is bigger than
+     *    the target page, as one whole host page should be placed.  XBZRLE
+     *    can't be used either, there is no previous copy to apply it to.
      */
     if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+        && (!migration_in_postcopy() ||
+            (!pss->postcopy_requested &&
+             qemu_ram_pagesize(block) == TARGET_PAGE_SIZE &&
+             !migrate_use_multifd_xbzrle()))) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -2077,6 +2423,74 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     return (res < 0 ? res : pages);
 }
 
+/**
+ * postcopy_preempt_choose_channel: send a requested page on the preempt
+ * channel
+ *
+ * Pages requested by the destination skip the queue of background pages
+ * on the main channel when the postcopy preempt channel is connected.
+ *
+ * Returns true if the channel was switched
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ */
+static bool postcopy_preempt_choose_channel(RAMState *rs,
+                                            PageSearchStatus *pss)
+{
+    MigrationState *s = migrate_get_current();
+    RAMBlock *block;
+    QEMUFile *f;
+
+    if (!pss->postcopy_requested || !migration_in_postcopy()) {
+        return false;
+    }
+
+    f = qatomic_load_acquire(&s->postcopy_qemufile_src);
+    if (!f) {
+        return false;
+    }
+
+    /* Each channel has its own notion of the last block sent */
+    block = rs->last_sent_block;
+    rs->last_sent_block = rs->postcopy_last_sent_block;
+    rs->postcopy_last_sent_block = block;
+    rs->main_f = rs->f;
+    rs->f = f;
+    trace_postcopy_preempt_switch_channel(pss->block->idstr,
+                                          (uint64_t)pss->page);
+    return true;
+}
+
+/**
+ * postcopy_preempt_reset_channel: go back to the main channel
+ *
+ * Terminates the requested host page with an EOS, so that the destination
+ * places it right away.
+ *
+ * @rs: current RAM state
+ */
+static void postcopy_preempt_reset_channel(RAMState *rs)
+{
+    RAMBlock *block;
+    int ret;
+
+    qemu_put_be64(rs->f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(rs->f);
+    ram_counters.transferred += 8;
+    ret = qemu_file_get_error(rs->f);
+
+    rs->f = rs->main_f;
+    rs->main_f = NULL;
+    block = rs->last_sent_block;
+    rs->last_sent_block = rs->postcopy_last_sent_block;
+    rs->postcopy_last_sent_block = block;
+
+    if (ret) {
+        qemu_file_set_error(rs->f, ret);
+    }
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2106,6 +2520,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     pss.block = rs->last_seen_block;
     pss.page = rs->last_page;
     pss.complete_round = false;
+    pss.postcopy_requested = false;
 
     if (!pss.block) {
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
@@ -2121,8 +2536,14 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         }
 
         if (found) {
+            bool preempt = postcopy_preempt_choose_channel(rs, &pss);
+
             pages = ram_save_host_page(rs, &pss, last_stage);
+            if (preempt) {
+                postcopy_preempt_reset_channel(rs);
+            }
         }
+        pss.postcopy_requested = false;
     } while (!pages && again);
 
     rs->last_seen_block = pss.block;
@@ -2228,6 +2649,8 @@ static void ram_save_cleanup(void *opaque)
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    ram_worker_pool_destroy(dirty_sync_pool);
+    dirty_sync_pool = NULL;
     ram_state_cleanup(rsp);
 }
 
@@ -2235,6 +2658,7 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->postcopy_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
@@ -2496,6 +2920,7 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms)
     /* Easiest way to make sure we don't resume in the middle of a host-page */
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->postcopy_last_sent_block = NULL;
     rs->last_page = 0;
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -2724,6 +3149,7 @@ static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
 
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->postcopy_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     /*
@@ -2809,9 +3235,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         return -1;
     }
 
+    if (!dirty_sync_pool) {
+        dirty_sync_pool = ram_worker_pool_create(migrate_dirty_sync_threads(),
+                                                 "dirty-sync");
+    }
+
     /* migration has already setup the bitmap, reuse it. */
     if (!migration_in_colo_state()) {
         if (ram_init_all(rsp) != 0) {
+            ram_worker_pool_destroy(dirty_sync_pool);
+            dirty_sync_pool = NULL;
             compress_threads_save_cleanup();
             return -1;
         }
@@ -2882,7 +3315,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         i = 0;
         while ((ret = qemu_file_rate_limit(f)) == 0 ||
-                !QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
+                !QSIMPLEQ_EMPTY(&rs->src_page_requests) ||
+                write_fault_pending(rs)) {
             int pages;
 
             if (qemu_file_get_error(f)) {
@@ -3077,37 +3511,39 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel we're using, each one continues its own block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block;
+    static RAMBlock *block[RAM_CHANNEL_MAX];
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!block[channel]) {
             error_report("Ack, bad migration stream!");
             return NULL;
         }
-        return block;
+        return block[channel];
     }
 
     len = qemu_get_byte(f);
     qemu_get_buffer(f, (uint8_t *)id, len);
     id[len] = 0;
 
-    block = qemu_ram_block_by_name(id);
-    if (!block) {
+    block[channel] = qemu_ram_block_by_name(id);
+    if (!block[channel]) {
         error_report("Can't find block %s", id);
         return NULL;
     }
 
-    if (ramblock_is_ignored(block)) {
+    if (ramblock_is_ignored(block[channel])) {
         error_report("block %s should not be migrated !", id);
         return NULL;
     }
 
-    return block;
+    return block[channel];
 }
 
 static inline void *host_from_ram_block_offset(RAMBlock *block,
@@ -3403,6 +3839,8 @@ int colo_init_ram_cache(void)
     }
 
     colo_init_ram_state();
+    colo_flush_pool = ram_worker_pool_create(migrate_colo_flush_threads(),
+                                             "colo-flush");
     return 0;
 }
 
@@ -3433,6 +3871,9 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
+    ram_worker_pool_destroy(colo_flush_pool);
+    colo_flush_pool = NULL;
+
     memory_global_dirty_log_stop();
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
@@ -3510,19 +3951,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for the pages requested by the destination.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the channel to use for loading
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = mis->postcopy_tmp_pages[channel];
     void *this_host = NULL;
     bool all_zero = true;
     int target_pages = 0;
@@ -3553,7 +3996,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3645,7 +4088,9 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: 0x%x"
@@ -3698,16 +4143,42 @@ static bool postcopy_is_running(void)
     return ps >= POSTCOPY_INCOMING_LISTENING && ps < POSTCOPY_INCOMING_END;
 }
 
+/*
+ * Copy the dirty pages of a chunk from the RAM cache to SVM's memory,
+ * one memcpy for every run of contiguous dirty pages.  Chunks are
+ * multiples of BITS_PER_LONG pages, so that no two threads touch the
+ * same word of the bitmap.
+ */
+static uint64_t colo_flush_ram_cache_chunk(RAMBlock *block, ram_addr_t start,
+                                           ram_addr_t length)
+{
+    unsigned long end = (start + length) >> TARGET_PAGE_BITS;
+    unsigned long page, next;
+    uint64_t pages = 0;
+
+    page = find_next_bit(block->bmap, end, start >> TARGET_PAGE_BITS);
+    while (page < end) {
+        ram_addr_t offset = ((ram_addr_t)page) << TARGET_PAGE_BITS;
+
+        next = find_next_zero_bit(block->bmap, end, page);
+        bitmap_clear(block->bmap, page, next - page);
+        memcpy(block->host + offset, block->colo_cache + offset,
+               ((ram_addr_t)(next - page)) << TARGET_PAGE_BITS);
+        pages += next - page;
+        page = find_next_bit(block->bmap, end, next);
+    }
+    return pages;
+}
+
 /*
  * Flush content of RAM cache into SVM's memory.
  * Only flush the pages that be dirtied by PVM or SVM or both.
  */
 void colo_flush_ram_cache(void)
 {
+    g_autoptr(GArray) chunks = g_array_new(false, false, sizeof(RAMChunk));
     RAMBlock *block = NULL;
-    void *dst_host;
-    void *src_host;
-    unsigned long offset = 0;
+    uint64_t pages;
 
     memory_global_dirty_log_sync();
     WITH_RCU_READ_LOCK_GUARD() {
@@ -3718,26 +4189,26 @@ void colo_flush_ram_cache(void)
 
     trace_colo_flush_ram_cache_begin(ram_state->migration_dirty_pages);
     WITH_RCU_READ_LOCK_GUARD() {
-        block = QLIST_FIRST_RCU(&ram_list.blocks);
-
-        while (block) {
-            offset = migration_bitmap_find_dirty(ram_state, block, offset);
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            RAMChunk chunk = { .block = block };
 
-            if (((ram_addr_t)offset) << TARGET_PAGE_BITS
-                >= block->used_length) {
-                offset = 0;
-                block = QLIST_NEXT_RCU(block, next);
-            } else {
-                migration_bitmap_clear_dirty(ram_state, block, offset);
-                dst_host = block->host
-                         + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
-                src_host = block->colo_cache
-                         + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
-                memcpy(dst_host, src_host, TARGET_PAGE_SIZE);
+            for (chunk.start = 0; chunk.start < block->used_length;
+                 chunk.start += COLO_FLUSH_CHUNK_SIZE) {
+                chunk.length = MIN(COLO_FLUSH_CHUNK_SIZE,
+                                   block->used_length - chunk.start);
+                g_array_append_val(chunks, chunk);
             }
         }
+        pages = ram_worker_pool_run(colo_flush_pool,
+                                    colo_flush_ram_cache_chunk,
+                                    (RAMChunk *)chunks->data, chunks->len);
     }
-    trace_colo_flush_ram_cache_end();
+    /*
+     * Pages received by multifd are not accounted in migration_dirty_pages,
+     * but either way the whole bitmap is clean now.
+     */
+    ram_state->migration_dirty_pages = 0;
+    trace_colo_flush_ram_cache_end(pages);
 }
 
 /**
@@ -3790,7 +4261,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3967,7 +4439,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
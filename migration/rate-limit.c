@@ -0,0 +1,109 @@
+/*
+ * Migration bandwidth limit
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
+#include "qemu/timer.h"
+#include "rate-limit.h"
+
+void mig_rate_limit_init(MigRateLimit *rl)
+{
+    memset(rl, 0, sizeof(*rl));
+    qemu_mutex_init(&rl->lock);
+}
+
+void mig_rate_limit_destroy(MigRateLimit *rl)
+{
+    qemu_mutex_destroy(&rl->lock);
+}
+
+/* Called with rl->lock held */
+static void mig_rate_limit_refill(MigRateLimit *rl, int64_t now)
+{
+    int64_t elapsed = now - rl->refill_time;
+    uint64_t secs, tokens;
+
+    if (elapsed <= 0) {
+        return;
+    }
+    secs = elapsed / NANOSECONDS_PER_SECOND;
+    tokens = muldiv64(rl->speed, elapsed % NANOSECONDS_PER_SECOND,
+                      NANOSECONDS_PER_SECOND);
+    if (secs > (UINT64_MAX - tokens) / rl->speed) {
+        tokens = UINT64_MAX;
+    } else {
+        tokens += secs * rl->speed;
+    }
+    if (!tokens) {
+        /* Keep the time, the next call will get a whole byte */
+        return;
+    }
+    if (tokens >= (uint64_t)(rl->burst - rl->tokens)) {
+        rl->tokens = rl->burst;
+    } else {
+        rl->tokens += tokens;
+    }
+    rl->refill_time = now;
+}
+
+void mig_rate_limit_set_speed(MigRateLimit *rl, uint64_t speed)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    QEMU_LOCK_GUARD(&rl->lock);
+    if (rl->speed) {
+        mig_rate_limit_refill(rl, now);
+    }
+    rl->speed = speed;
+    rl->burst = muldiv64(speed, MIG_RATE_LIMIT_BURST_NS,
+                         NANOSECONDS_PER_SECOND);
+    rl->tokens = speed ? MIN(rl->tokens, rl->burst) : 0;
+    rl->refill_time = now;
+}
+
+uint64_t mig_rate_limit_get_speed(MigRateLimit *rl)
+{
+    QEMU_LOCK_GUARD(&rl->lock);
+    return rl->speed;
+}
+
+void mig_rate_limit_account(MigRateLimit *rl, uint64_t bytes)
+{
+    QEMU_LOCK_GUARD(&rl->lock);
+    if (rl->speed) {
+        rl->tokens -= bytes;
+    }
+}
+
+int64_t mig_rate_limit_delay(MigRateLimit *rl)
+{
+    QEMU_LOCK_GUARD(&rl->lock);
+    if (!rl->speed) {
+        return 0;
+    }
+    mig_rate_limit_refill(rl, qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+    if (rl->tokens >= 0) {
+        return 0;
+    }
+    return (double)-rl->tokens * NANOSECONDS_PER_SECOND / rl->speed;
+}
+
+bool mig_rate_limit_wait(MigRateLimit *rl, uint64_t bytes,
+                         QemuSemaphore *stop)
+{
+    int64_t delay;
+
+    mig_rate_limit_account(rl, bytes);
+    delay = mig_rate_limit_delay(rl);
+    if (delay && qemu_sem_timedwait(stop, DIV_ROUND_UP(delay, SCALE_MS)) == 0) {
+        /* The timedwait consumed the post, put it back for the next wait */
+        qemu_sem_post(stop);
+        return false;
+    }
+    return true;
+}
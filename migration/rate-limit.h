@@ -0,0 +1,80 @@
+/*
+ * Migration bandwidth limit
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_RATE_LIMIT_H
+#define QEMU_MIGRATION_RATE_LIMIT_H
+
+#include "qemu/thread.h"
+
+/*
+ * Token bucket shared by all the channels of a migration.  Tokens are
+ * bytes; they are refilled continuously at the configured speed, and
+ * writers may go into debt, in which case everybody waits until it is
+ * paid back.  The bucket holds at most MIG_RATE_LIMIT_BURST_NS worth of
+ * tokens, so that an idle period is not followed by a burst.
+ */
+typedef struct MigRateLimit {
+    QemuMutex lock;
+    /* bytes per second, 0 for no limit */
+    uint64_t speed;
+    /* maximum number of tokens */
+    int64_t burst;
+    /* available bytes, negative when in debt */
+    int64_t tokens;
+    /* last time the bucket was refilled, in ns */
+    int64_t refill_time;
+} MigRateLimit;
+
+#define MIG_RATE_LIMIT_BURST_NS (5 * SCALE_MS)
+
+void mig_rate_limit_init(MigRateLimit *rl);
+void mig_rate_limit_destroy(MigRateLimit *rl);
+
+/**
+ * mig_rate_limit_set_speed: change the speed of the bucket
+ *
+ * @rl: the rate limit
+ * @speed: bytes per second, 0 to disable the limit
+ */
+void mig_rate_limit_set_speed(MigRateLimit *rl, uint64_t speed);
+uint64_t mig_rate_limit_get_speed(MigRateLimit *rl);
+
+/**
+ * mig_rate_limit_account: take tokens out of the bucket
+ *
+ * @rl: the rate limit
+ * @bytes: number of bytes written, or about to be written
+ */
+void mig_rate_limit_account(MigRateLimit *rl, uint64_t bytes);
+
+/**
+ * mig_rate_limit_delay: time until writing is allowed again
+ *
+ * Returns 0 if the bucket is not in debt, otherwise the time in ns
+ * until the debt is paid back
+ *
+ * @rl: the rate limit
+ */
+int64_t mig_rate_limit_delay(MigRateLimit *rl);
+
+/**
+ * mig_rate_limit_wait: account a write and wait until it is allowed
+ *
+ * For the threads that own a channel and can block on it.  The wait is
+ * cut short when @stop is posted; @stop is left posted in that case, so
+ * that any later wait returns immediately.
+ *
+ * Returns false if the wait was interrupted by @stop
+ *
+ * @rl: the rate limit
+ * @bytes: number of bytes about to be written
+ * @stop: semaphore posted when the caller must stop writing
+ */
+bool mig_rate_limit_wait(MigRateLimit *rl, uint64_t bytes,
+                         QemuSemaphore *stop);
+
+#endif
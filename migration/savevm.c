@@ -40,6 +40,7 @@
 #include "qemu-file.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
+#include "multifd.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-migration.h"
 #include "qapi/qmp/json-writer.h"
@@ -87,10 +88,13 @@ enum qemu_vm_cmd {
     MIG_CMD_ENABLE_COLO,       /* Enable COLO */
     MIG_CMD_POSTCOPY_RESUME,   /* resume postcopy on dest */
     MIG_CMD_RECV_BITMAP,       /* Request for recved bitmap on dst */
+    MIG_CMD_DEVICE_STATE,      /* Device sections to load in parallel */
     MIG_CMD_MAX
 };
 
 #define MAX_VM_CMD_PACKAGED_SIZE UINT32_MAX
+/* Largest section in a MIG_CMD_DEVICE_STATE command */
+#define MAX_VM_DEVICE_STATE_SECTION_SIZE (16 * 1024 * 1024)
 static struct mig_cmd_args {
     ssize_t     len; /* -1 = variable */
     const char *name;
@@ -106,6 +110,7 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
     [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_DEVICE_STATE]     = { .len =  4, .name = "DEVICE_STATE" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -248,6 +253,10 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* Cost of the final state in the last stop-and-copy phase */
+    bool downtime_valid;
+    int64_t downtime_time;
+    int64_t downtime_bytes;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -260,6 +269,9 @@ typedef struct SaveState {
     uint32_t caps_count;
     MigrationCapability *capabilities;
     QemuUUID uuid;
+    /* Time spent completing the devices, in microseconds */
+    int64_t complete_iterable_time;
+    int64_t complete_non_iterable_time;
 } SaveState;
 
 static SaveState savevm_state = {
@@ -910,6 +922,69 @@ static int vmstate_load(QEMUFile *f, SaveStateEntry *se)
     return vmstate_load_state(f, se->vmsd, se->opaque, se->load_version_id);
 }
 
+static void savevm_downtime_reset(void)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->downtime_valid = false;
+        se->downtime_time = 0;
+        se->downtime_bytes = 0;
+    }
+    savevm_state.complete_iterable_time = 0;
+    savevm_state.complete_non_iterable_time = 0;
+}
+
+/*
+ * Record the cost of the final state of @se, that took from @start_time
+ * (in microseconds) to now and @bytes bytes of the stream.
+ */
+static void savevm_downtime_account(SaveStateEntry *se, int64_t start_time,
+                                    int64_t bytes)
+{
+    se->downtime_valid = true;
+    se->downtime_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time;
+    se->downtime_bytes = bytes;
+}
+
+/**
+ * qemu_savevm_fill_downtime_stats: report the cost of the final phase
+ *
+ * Fill @stats with the time and size of every device saved or loaded
+ * in the last stop-and-copy phase, and on the source with the time
+ * spent completing the iterable and non-iterable devices.
+ *
+ * @stats: where to store the statistics
+ * @source: whether we are the source of the migration
+ */
+void qemu_savevm_fill_downtime_stats(MigrationDowntimeStats *stats,
+                                     bool source)
+{
+    MigrationDowntimeDeviceList **tail = &stats->devices;
+    SaveStateEntry *se;
+
+    if (source) {
+        stats->has_iterable = true;
+        stats->iterable = savevm_state.complete_iterable_time;
+        stats->has_non_iterable = true;
+        stats->non_iterable = savevm_state.complete_non_iterable_time;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        MigrationDowntimeDevice *dev;
+
+        if (!se->downtime_valid) {
+            continue;
+        }
+        dev = g_new0(MigrationDowntimeDevice, 1);
+        dev->idstr = g_strdup(se->idstr);
+        dev->instance_id = se->instance_id;
+        dev->time = se->downtime_time;
+        dev->bytes = se->downtime_bytes;
+        QAPI_LIST_APPEND(tail, dev);
+    }
+}
+
 static void vmstate_save_old_style(QEMUFile *f, SaveStateEntry *se,
                                    JSONWriter *vmdesc)
 {
@@ -1361,10 +1436,13 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
 static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     SaveStateEntry *se;
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        int64_t se_start_time, se_start_pos;
+
         if (!se->ops ||
             (in_postcopy && se->ops->has_postcopy &&
              se->ops->has_postcopy(se->opaque)) ||
@@ -1379,6 +1457,8 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        se_start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        se_start_pos = qemu_ftell_fast(f);
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
@@ -1388,25 +1468,202 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
             qemu_file_set_error(f, ret);
             return -1;
         }
+        savevm_downtime_account(se, se_start_time,
+                                qemu_ftell_fast(f) - se_start_pos);
+        trace_savevm_downtime_device(se->idstr, se->instance_id,
+                                     se->downtime_time, se->downtime_bytes);
     }
 
+    savevm_state.complete_iterable_time =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time;
     return 0;
 }
 
+/*
+ * The state of devices whose VMStateDescription is marked as parallel is
+ * saved by a pool of threads, each section into its own buffer, and sent
+ * in a MIG_CMD_DEVICE_STATE command once all the devices with the same
+ * priority are done.  The destination loads all the sections of the
+ * command in parallel before going on with the rest of the stream, so
+ * the ordering between priorities is kept.
+ *
+ * MIG_CMD_DEVICE_STATE:
+ *   be32 number of sections, then for each section
+ *   be32 size
+ *   size bytes of a QEMU_VM_SECTION_FULL section, footer included
+ */
+typedef struct DeviceStateJob {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+} DeviceStateJob;
+
+typedef struct DeviceStateJobs {
+    DeviceStateJob *jobs;
+    int nr_jobs;
+    /* next job to run, updated atomically */
+    int next_job;
+    void (*run)(DeviceStateJob *job, void *opaque);
+    void *opaque;
+} DeviceStateJobs;
+
+static void device_state_jobs_process(DeviceStateJobs *jobs)
+{
+    int i;
+
+    while ((i = qatomic_fetch_inc(&jobs->next_job)) < jobs->nr_jobs) {
+        jobs->run(&jobs->jobs[i], jobs->opaque);
+    }
+}
+
+static void *device_state_thread(void *opaque)
+{
+    rcu_register_thread();
+    device_state_jobs_process(opaque);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Run all the jobs, with the caller and up to @threads - 1 more threads */
+static void device_state_jobs_run(DeviceStateJobs *jobs, int threads)
+{
+    int nr_threads = MIN(threads, jobs->nr_jobs) - 1;
+    g_autofree QemuThread *thread = NULL;
+    int i;
+
+    jobs->next_job = 0;
+    if (nr_threads > 0) {
+        thread = g_new(QemuThread, nr_threads);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(&thread[i], "device-state", device_state_thread,
+                           jobs, QEMU_THREAD_JOINABLE);
+    }
+    device_state_jobs_process(jobs);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(&thread[i]);
+    }
+}
+
+static void device_state_save_job(DeviceStateJob *job, void *opaque)
+{
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    SaveStateEntry *se = job->se;
+
+    job->bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(job->bioc), "migration-device-state");
+    job->f = qemu_fopen_channel_output(QIO_CHANNEL(job->bioc));
+    object_unref(OBJECT(job->bioc));
+
+    trace_savevm_section_start(se->idstr, se->section_id);
+    save_section_header(job->f, se, QEMU_VM_SECTION_FULL);
+    job->ret = vmstate_save(job->f, se, NULL);
+    trace_savevm_section_end(se->idstr, se->section_id, job->ret);
+    save_section_footer(job->f, se);
+    qemu_fflush(job->f);
+    if (!job->ret) {
+        job->ret = qemu_file_get_error(job->f);
+    }
+    savevm_downtime_account(se, start_time, job->bioc->usage);
+}
+
+/*
+ * Save the devices queued in @jobs in parallel, and send them as a
+ * MIG_CMD_DEVICE_STATE command.
+ */
+static int qemu_savevm_device_state_parallel(QEMUFile *f,
+                                             DeviceStateJobs *jobs,
+                                             JSONWriter *vmdesc,
+                                             int threads)
+{
+    uint32_t tmp = cpu_to_be32(jobs->nr_jobs);
+    int ret = 0;
+    int i;
+
+    trace_qemu_savevm_device_state_parallel(jobs->nr_jobs, threads);
+    device_state_jobs_run(jobs, threads);
+
+    for (i = 0; i < jobs->nr_jobs; i++) {
+        if (jobs->jobs[i].ret) {
+            ret = jobs->jobs[i].ret;
+            break;
+        }
+    }
+
+    if (!ret) {
+        qemu_savevm_command_send(f, MIG_CMD_DEVICE_STATE, 4, (uint8_t *)&tmp);
+    }
+    for (i = 0; i < jobs->nr_jobs; i++) {
+        DeviceStateJob *job = &jobs->jobs[i];
+        SaveStateEntry *se = job->se;
+
+        if (!ret) {
+            qemu_put_be32(f, job->bioc->usage);
+            qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+            trace_savevm_downtime_device(se->idstr, se->instance_id,
+                                         se->downtime_time,
+                                         se->downtime_bytes);
+
+            /* The fields are not described for devices saved in parallel */
+            json_writer_start_object(vmdesc, NULL);
+            json_writer_str(vmdesc, "name", se->idstr);
+            json_writer_int64(vmdesc, "instance_id", se->instance_id);
+            json_writer_end_object(vmdesc);
+        }
+        qemu_fclose(job->f);
+        job->f = NULL;
+        job->bioc = NULL;
+    }
+    jobs->nr_jobs = 0;
+
+    if (ret) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
 {
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    int threads = migrate_parallel_device_state() ?
+                  migrate_device_state_threads() : 1;
+    g_autofree DeviceStateJob *parallel_jobs = NULL;
+    DeviceStateJobs jobs = { .run = device_state_save_job };
     g_autoptr(JSONWriter) vmdesc = NULL;
     int vmdesc_len;
     SaveStateEntry *se;
     int ret;
 
+    if (threads > 1) {
+        QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+            if (se->vmsd && se->vmsd->parallel) {
+                jobs.nr_jobs++;
+            }
+        }
+        parallel_jobs = g_new0(DeviceStateJob, jobs.nr_jobs);
+        jobs.jobs = parallel_jobs;
+        jobs.nr_jobs = 0;
+    }
+
     vmdesc = json_writer_new(false);
     json_writer_start_object(vmdesc, NULL);
     json_writer_int64(vmdesc, "page_size", qemu_target_page_size());
     json_writer_start_array(vmdesc, "devices");
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        int64_t se_start_time, se_start_pos;
+
+        /* Send the devices of the previous priority before going on */
+        if (jobs.nr_jobs &&
+            save_state_priority(se) != save_state_priority(jobs.jobs[0].se)) {
+            ret = qemu_savevm_device_state_parallel(f, &jobs, vmdesc,
+                                                    threads);
+            if (ret) {
+                return ret;
+            }
+        }
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
@@ -1416,12 +1673,19 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
             continue;
         }
 
+        if (threads > 1 && se->vmsd && se->vmsd->parallel) {
+            jobs.jobs[jobs.nr_jobs++].se = se;
+            continue;
+        }
+
         trace_savevm_section_start(se->idstr, se->section_id);
 
         json_writer_start_object(vmdesc, NULL);
         json_writer_str(vmdesc, "name", se->idstr);
         json_writer_int64(vmdesc, "instance_id", se->instance_id);
 
+        se_start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        se_start_pos = qemu_ftell_fast(f);
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
@@ -1430,10 +1694,21 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
+        savevm_downtime_account(se, se_start_time,
+                                qemu_ftell_fast(f) - se_start_pos);
+        trace_savevm_downtime_device(se->idstr, se->instance_id,
+                                     se->downtime_time, se->downtime_bytes);
 
         json_writer_end_object(vmdesc);
     }
 
+    if (jobs.nr_jobs) {
+        ret = qemu_savevm_device_state_parallel(f, &jobs, vmdesc, threads);
+        if (ret) {
+            return ret;
+        }
+    }
+
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
          * bdrv_invalidate_cache_all() on the other end won't fail. */
@@ -1460,6 +1735,8 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         qemu_put_buffer(f, (uint8_t *)json_writer_get(vmdesc), vmdesc_len);
     }
 
+    savevm_state.complete_non_iterable_time =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time;
     return 0;
 }
 
@@ -1476,6 +1753,7 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
 
     trace_savevm_state_complete_precopy();
 
+    savevm_downtime_reset();
     cpu_synchronize_all_states();
 
     if (!in_postcopy || iterable_only) {
@@ -1497,6 +1775,9 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
 
 flush:
     qemu_fflush(f);
+    trace_savevm_state_complete_precopy_downtime(
+        savevm_state.complete_iterable_time,
+        savevm_state.complete_non_iterable_time);
     return 0;
 }
 
@@ -1907,6 +2188,8 @@ static void *postcopy_ram_listen_thread(void *opaque)
          */
         qemu_event_wait(&mis->main_thread_load_event);
     }
+    /* multifd threads may be placing pages, stop them before the cleanup */
+    multifd_load_cleanup(NULL);
     postcopy_ram_incoming_cleanup(mis);
 
     if (load_res < 0) {
@@ -1971,6 +2254,8 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
             postcopy_ram_incoming_cleanup(mis);
             return -1;
         }
+        /* multifd and preempt channel threads can place pages from now on */
+        qemu_event_set(&mis->postcopy_listen_event);
     }
 
     if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_LISTEN, &local_err)) {
@@ -1994,6 +2279,7 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
 {
     Error *local_err = NULL;
     MigrationIncomingState *mis = opaque;
+    int64_t start_time;
 
     /* TODO we should move all of this lot into postcopy_ram.c or a shared code
      * in migration.c
@@ -2017,6 +2303,7 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
 
     dirty_bitmap_mig_before_vm_start();
 
+    start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     if (autostart) {
         /* Hold onto your hats, starting the CPU */
         vm_start();
@@ -2024,6 +2311,9 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
         /* leave it paused and let management decide when to start the CPU */
         runstate_set(RUN_STATE_PAUSED);
     }
+    mis->downtime_vm_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                             start_time;
+    trace_migration_incoming_vm_start(mis->downtime_vm_start);
 
     qemu_bh_delete(mis->bh);
 }
@@ -2192,6 +2482,136 @@ static int loadvm_handle_cmd_packaged(MigrationIncomingState *mis)
     return ret;
 }
 
+static void device_state_load_job(DeviceStateJob *job, void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    size_t size = job->bioc->usage;
+
+    job->f = qemu_fopen_channel_input(QIO_CHANNEL(job->bioc));
+    /* The section type was checked by loadvm_handle_device_state */
+    qemu_get_byte(job->f);
+    job->ret = qemu_loadvm_section_start_full(job->f, mis,
+                                              QEMU_VM_SECTION_FULL);
+    if (!job->ret && qemu_ftell_read(job->f) != size) {
+        error_report("%s: section of %s has %" PRId64 " bytes left",
+                     __func__, job->se->idstr,
+                     (int64_t)size - qemu_ftell_read(job->f));
+        job->ret = -EINVAL;
+    }
+    qemu_fclose(job->f);
+    job->f = NULL;
+}
+
+/*
+ * Check that the section in @bioc is a full section of a device that can
+ * be loaded in parallel, and return its SaveStateEntry
+ */
+static SaveStateEntry *device_state_section_se(QIOChannelBuffer *bioc)
+{
+    const uint8_t *p = (const uint8_t *)bioc->data;
+    size_t size = bioc->usage;
+    uint32_t instance_id;
+    SaveStateEntry *se;
+    char idstr[256];
+    size_t len;
+
+    /* type, section id, idstr length */
+    if (size < 6 || p[0] != QEMU_VM_SECTION_FULL) {
+        return NULL;
+    }
+    len = p[5];
+    /* idstr, instance id */
+    if (size < 6 + len + 4) {
+        return NULL;
+    }
+    memcpy(idstr, p + 6, len);
+    idstr[len] = 0;
+    instance_id = ldl_be_p(p + 6 + len);
+
+    se = find_se(idstr, instance_id);
+    if (!se || !se->vmsd || !se->vmsd->parallel) {
+        error_report("%s: '%s' %" PRIu32 " can't be loaded in parallel",
+                     __func__, idstr, instance_id);
+        return NULL;
+    }
+    return se;
+}
+
+/*
+ * Load the device sections in a MIG_CMD_DEVICE_STATE command in parallel
+ */
+static int loadvm_handle_device_state(MigrationIncomingState *mis,
+                                      QEMUFile *f)
+{
+    DeviceStateJobs jobs = { .run = device_state_load_job, .opaque = mis };
+    g_autofree DeviceStateJob *parallel_jobs = NULL;
+    uint32_t count, max_count = 0;
+    SaveStateEntry *se;
+    int ret = 0;
+    int i;
+
+    if (!migrate_parallel_device_state()) {
+        error_report("%s: parallel-device-state capability not enabled",
+                     __func__);
+        return -EINVAL;
+    }
+
+    count = qemu_get_be32(f);
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        max_count++;
+    }
+    if (count > max_count) {
+        error_report("%s: too many sections %" PRIu32, __func__, count);
+        return -EINVAL;
+    }
+
+    parallel_jobs = g_new0(DeviceStateJob, count);
+    jobs.jobs = parallel_jobs;
+    for (i = 0; i < count; i++) {
+        DeviceStateJob *job = &jobs.jobs[i];
+        uint32_t size = qemu_get_be32(f);
+
+        if (size > MAX_VM_DEVICE_STATE_SECTION_SIZE) {
+            error_report("%s: section %d too big: %" PRIu32 " bytes",
+                         __func__, i, size);
+            ret = -EINVAL;
+            break;
+        }
+
+        jobs.nr_jobs++;
+        job->bioc = qio_channel_buffer_new(size);
+        qio_channel_set_name(QIO_CHANNEL(job->bioc), "migration-device-state");
+        if (qemu_get_buffer(f, (uint8_t *)job->bioc->data, size) != size) {
+            error_report("%s: failed to receive section %d", __func__, i);
+            ret = qemu_file_get_error(f) ?: -EINVAL;
+            break;
+        }
+        job->bioc->usage = size;
+        job->se = device_state_section_se(job->bioc);
+        if (!job->se) {
+            ret = -EINVAL;
+            break;
+        }
+    }
+
+    if (!ret) {
+        trace_loadvm_handle_device_state(count,
+                                         migrate_device_state_threads());
+        device_state_jobs_run(&jobs, migrate_device_state_threads());
+        for (i = 0; i < jobs.nr_jobs; i++) {
+            if (jobs.jobs[i].ret) {
+                ret = jobs.jobs[i].ret;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < jobs.nr_jobs; i++) {
+        object_unref(OBJECT(jobs.jobs[i].bioc));
+    }
+    return ret;
+}
+
 /*
  * Handle request that source requests for recved_bitmap on
  * destination. Payload format:
@@ -2237,15 +2657,7 @@ static int loadvm_handle_recv_bitmap(MigrationIncomingState *mis,
 
 static int loadvm_process_enable_colo(MigrationIncomingState *mis)
 {
-    int ret = migration_incoming_enable_colo();
-
-    if (!ret) {
-        ret = colo_init_ram_cache();
-        if (ret) {
-            migration_incoming_disable_colo();
-        }
-    }
-    return ret;
+    return migration_incoming_enable_colo();
 }
 
 /*
@@ -2310,6 +2722,9 @@ static int loadvm_process_command(QEMUFile *f)
     case MIG_CMD_PACKAGED:
         return loadvm_handle_cmd_packaged(mis);
 
+    case MIG_CMD_DEVICE_STATE:
+        return loadvm_handle_device_state(mis, f);
+
     case MIG_CMD_POSTCOPY_ADVISE:
         return loadvm_postcopy_handle_advise(mis, len);
 
@@ -2379,13 +2794,19 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
 }
 
 static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
+                               uint8_t type)
 {
     uint32_t instance_id, version_id, section_id;
+    int64_t start_time, start_pos;
     SaveStateEntry *se;
     char idstr[256];
     int ret;
 
+    start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    /* The section type has already been read */
+    start_pos = qemu_ftell_read(f) - 1;
+
     /* Read section start */
     section_id = qemu_get_be32(f);
     if (!qemu_get_counted_string(f, idstr)) {
@@ -2440,12 +2861,22 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    if (type == QEMU_VM_SECTION_FULL) {
+        savevm_downtime_account(se, start_time,
+                                qemu_ftell_read(f) - start_pos);
+        trace_loadvm_downtime_device(se->idstr, se->instance_id,
+                                     se->downtime_time, se->downtime_bytes);
+    }
     return 0;
 }
 
 static int
-qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis,
+                             uint8_t type)
 {
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    /* The section type has already been read */
+    int64_t start_pos = qemu_ftell_read(f) - 1;
     uint32_t section_id;
     SaveStateEntry *se;
     int ret;
@@ -2480,6 +2911,12 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    if (type == QEMU_VM_SECTION_END) {
+        savevm_downtime_account(se, start_time,
+                                qemu_ftell_read(f) - start_pos);
+        trace_loadvm_downtime_device(se->idstr, se->instance_id,
+                                     se->downtime_time, se->downtime_bytes);
+    }
     return 0;
 }
 
@@ -2616,14 +3053,14 @@ retry:
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
-            ret = qemu_loadvm_section_start_full(f, mis);
+            ret = qemu_loadvm_section_start_full(f, mis, section_type);
             if (ret < 0) {
                 goto out;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
-            ret = qemu_loadvm_section_part_end(f, mis);
+            ret = qemu_loadvm_section_part_end(f, mis, section_type);
             if (ret < 0) {
                 goto out;
             }
@@ -2693,6 +3130,7 @@ int qemu_loadvm_state(QEMUFile *f)
         return -EINVAL;
     }
 
+    savevm_downtime_reset();
     cpu_synchronize_all_pre_loadvm();
 
     ret = qemu_loadvm_state_main(f, mis);
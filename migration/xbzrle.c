@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +127,314 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+/*
+ * The vectorized encoders compare a whole block of old and new bytes at
+ * once and turn the result into a bitmask with one bit per byte (set if
+ * the byte is unchanged).  Run boundaries are then found with ctz on the
+ * mask instead of walking the bytes one at a time.  The run state machine
+ * below is shared by all of them and produces exactly the same stream,
+ * including the overflow behaviour, as xbzrle_encode_buffer_int().
+ */
+typedef struct XBZRLEEncodeState {
+    uint8_t *new_buf;
+    uint8_t *dst;
+    int slen;
+    int dlen;
+    int d;
+    /* start of the current run */
+    int run_start;
+    /* true while inside a zero run */
+    bool zrun;
+} XBZRLEEncodeState;
+
+static inline void xbzrle_encode_init(XBZRLEEncodeState *s, uint8_t *new_buf,
+                                      int slen, uint8_t *dst, int dlen)
+{
+    s->new_buf = new_buf;
+    s->dst = dst;
+    s->slen = slen;
+    s->dlen = dlen;
+    s->d = 0;
+    s->run_start = 0;
+    s->zrun = true;
+}
+
+/* Close the current run at offset @end; returns -1 on overflow */
+static inline int xbzrle_encode_end_run(XBZRLEEncodeState *s, int end)
+{
+    uint32_t len = end - s->run_start;
+
+    if (s->zrun) {
+        s->d += uleb128_encode_small(s->dst + s->d, len);
+        /* overflow */
+        if (s->d + 2 > s->dlen) {
+            return -1;
+        }
+    } else {
+        s->d += uleb128_encode_small(s->dst + s->d, len);
+        /* overflow */
+        if (s->d + len > s->dlen) {
+            return -1;
+        }
+        memcpy(s->dst + s->d, s->new_buf + s->run_start, len);
+        s->d += len;
+        /* a new zero run starts here, so the next pair must fit */
+        if (end < s->slen && s->d + 2 > s->dlen) {
+            return -1;
+        }
+    }
+    s->run_start = end;
+    s->zrun = !s->zrun;
+    return 0;
+}
+
+/*
+ * Consume a block of @n bytes (n <= 64) starting at offset @i.  Bit k of
+ * @eq is set iff byte i + k is unchanged.
+ */
+static inline int xbzrle_encode_mask(XBZRLEEncodeState *s, int i,
+                                     uint64_t eq, int n)
+{
+    uint64_t valid = n == 64 ? -1ULL : (1ULL << n) - 1;
+
+    for (;;) {
+        /* bits where the current run ends */
+        uint64_t m = (s->zrun ? ~eq : eq) & valid;
+        int k;
+
+        if (!m) {
+            return 0;
+        }
+        k = ctz64(m);
+        if (xbzrle_encode_end_run(s, i + k) < 0) {
+            return -1;
+        }
+        /* byte k starts the new run, drop everything below it */
+        valid &= -1ULL << k;
+    }
+}
+
+static inline int xbzrle_encode_finish(XBZRLEEncodeState *s)
+{
+    if (s->zrun) {
+        /* buffer unchanged */
+        if (s->run_start == 0) {
+            return 0;
+        }
+        /* skip last zero run */
+        return s->d;
+    }
+    if (xbzrle_encode_end_run(s, s->slen) < 0) {
+        return -1;
+    }
+    return s->d;
+}
+
+/* Scalar mask for the tail of a buffer that is shorter than a vector */
+static inline uint64_t xbzrle_eq_mask_bytes(uint8_t *old_buf,
+                                            uint8_t *new_buf, int n)
+{
+    uint64_t eq = 0;
+    int k;
+
+    for (k = 0; k < n; k++) {
+        eq |= (uint64_t)(old_buf[k] == new_buf[k]) << k;
+    }
+    return eq;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    XBZRLEEncodeState s;
+    int i;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    if (slen && dlen < 2) {
+        return -1;
+    }
+    xbzrle_encode_init(&s, new_buf, slen, dst, dlen);
+
+    /* Two 32-byte compares per iteration give a 64-bit mask */
+    for (i = 0; i + 64 <= slen; i += 64) {
+        __m256i o0 = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i n0 = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        __m256i o1 = _mm256_loadu_si256((__m256i *)(old_buf + i + 32));
+        __m256i n1 = _mm256_loadu_si256((__m256i *)(new_buf + i + 32));
+        uint64_t eq;
+
+        eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(o0, n0));
+        eq |= (uint64_t)(uint32_t)
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(o1, n1)) << 32;
+
+        /* fast path: the whole block continues the current run */
+        if (eq == (s.zrun ? -1ULL : 0)) {
+            continue;
+        }
+        if (xbzrle_encode_mask(&s, i, eq, 64) < 0) {
+            return -1;
+        }
+    }
+    if (i < slen) {
+        uint64_t eq = xbzrle_eq_mask_bytes(old_buf + i, new_buf + i, slen - i);
+        if (xbzrle_encode_mask(&s, i, eq, slen - i) < 0) {
+            return -1;
+        }
+    }
+
+    return xbzrle_encode_finish(&s);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    XBZRLEEncodeState s;
+    int i;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    if (slen && dlen < 2) {
+        return -1;
+    }
+    xbzrle_encode_init(&s, new_buf, slen, dst, dlen);
+
+    for (i = 0; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(o, n);
+
+        /* fast path: the whole block continues the current run */
+        if (eq == (s.zrun ? -1ULL : 0)) {
+            continue;
+        }
+        if (xbzrle_encode_mask(&s, i, eq, 64) < 0) {
+            return -1;
+        }
+    }
+    if (i < slen) {
+        uint64_t eq = xbzrle_eq_mask_bytes(old_buf + i, new_buf + i, slen - i);
+        if (xbzrle_encode_mask(&s, i, eq, slen - i) < 0) {
+            return -1;
+        }
+    }
+
+    return xbzrle_encode_finish(&s);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+#include "qemu/cpuid.h"
+
+/*
+ * Note that for xbzrle_encode_test_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+static unsigned cpuid_cache, cpuid_cache_host;
+static int (*encode_accel)(uint8_t *, uint8_t *, int,
+                           uint8_t *, int) = xbzrle_encode_buffer_int;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    encode_accel = fn;
+}
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* See util/bufferiszero.c for the meaning of 0xe6 */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cpuid_cache_host = cache;
+    init_accel(cache);
+}
+
+bool xbzrle_encode_test_next_accel(void)
+{
+    /*
+     * If no bits set, we just tested xbzrle_encode_buffer_int, and there
+     * are no more acceleration options to test.  Go back to the best one
+     * so that the next round of tests starts from the top again.
+     */
+    if (cpuid_cache == 0) {
+        cpuid_cache = cpuid_cache_host;
+        init_accel(cpuid_cache);
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+#else
+bool xbzrle_encode_test_next_accel(void)
+{
+    return false;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_int(old_buf, new_buf, slen, dst, dlen);
+}
+#endif
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -139,7 +448,13 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
             return -1;
         }
 
-        ret = uleb128_decode_small(src + i, &count);
+        /* single-byte lengths are by far the most common, decode inline */
+        if (likely(!(src[i] & 0x80))) {
+            count = src[i];
+            ret = 1;
+        } else {
+            ret = uleb128_decode_small(src + i, &count);
+        }
         if (ret < 0 || (i && !count)) {
             return -1;
         }
@@ -156,7 +471,12 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
             return -1;
         }
 
-        ret = uleb128_decode_small(src + i, &count);
+        if (likely(!(src[i] & 0x80))) {
+            count = src[i];
+            ret = 1;
+        } else {
+            ret = uleb128_decode_small(src + i, &count);
+        }
         if (ret < 0 || !count) {
             return -1;
         }
@@ -17,5 +17,17 @@
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
+/* Portable encoder, used as a reference for the vectorized ones */
+int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen);
+
+/*
+ * Switch xbzrle_encode_buffer() to the next less preferred accelerated
+ * implementation.  Returns false, and switches back to the best one for
+ * the host, once all of them have been used.  Only meant for tests and
+ * benchmarks.
+ */
+bool xbzrle_encode_test_next_accel(void);
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 #endif
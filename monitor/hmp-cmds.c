@@ -278,6 +278,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us "
+                       "(total %" PRIu64 " us)\n",
+                       info->ram->dirty_sync_time,
+                       info->ram->dirty_sync_time_total);
         monitor_printf(mon, "page size: %" PRIu64 " kbytes\n",
                        info->ram->page_size >> 10);
         monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
@@ -295,6 +299,22 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         }
     }
 
+    if (info->has_channels) {
+        MigrationChannelInfoList *channel;
+
+        for (channel = info->channels; channel; channel = channel->next) {
+            MigrationChannelInfo *c = channel->value;
+
+            monitor_printf(mon, "channel %s: transferred %" PRIu64
+                           " kbytes, throughput %0.2f mbps",
+                           c->name, c->transferred >> 10, c->mbps);
+            if (c->has_pending) {
+                monitor_printf(mon, ", pending %" PRId64, c->pending);
+            }
+            monitor_printf(mon, "\n");
+        }
+    }
+
     if (info->has_disk) {
         monitor_printf(mon, "transferred disk: %" PRIu64 " kbytes\n",
                        info->disk->transferred >> 10);
@@ -334,6 +354,36 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->compression->compression_rate);
     }
 
+    if (info->has_downtime_stats) {
+        MigrationDowntimeStats *stats = info->downtime_stats;
+        MigrationDowntimeDeviceList *dev;
+
+        monitor_printf(mon, "downtime breakdown:");
+        if (stats->has_vm_stop) {
+            monitor_printf(mon, " vm-stop %" PRIu64 " us", stats->vm_stop);
+        }
+        if (stats->has_bitmap_sync) {
+            monitor_printf(mon, " bitmap-sync %" PRIu64 " us",
+                           stats->bitmap_sync);
+        }
+        if (stats->has_iterable) {
+            monitor_printf(mon, " iterable %" PRIu64 " us", stats->iterable);
+        }
+        if (stats->has_non_iterable) {
+            monitor_printf(mon, " non-iterable %" PRIu64 " us",
+                           stats->non_iterable);
+        }
+        if (stats->has_vm_start) {
+            monitor_printf(mon, " vm-start %" PRIu64 " us", stats->vm_start);
+        }
+        monitor_printf(mon, "\n");
+        for (dev = stats->devices; dev; dev = dev->next) {
+            monitor_printf(mon, "  %s/%u: %" PRIu64 " us, %" PRIu64 " bytes\n",
+                           dev->value->idstr, dev->value->instance_id,
+                           dev->value->time, dev->value->bytes);
+        }
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -355,6 +405,22 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+    if (info->has_postcopy_fault_latency) {
+        PostcopyFaultLatency *lat = info->postcopy_fault_latency;
+        Visitor *v;
+        char *str;
+
+        monitor_printf(mon, "postcopy fault latency: count %" PRIu64
+                       ", avg %" PRIu64 " us, max %" PRIu64 " us\n",
+                       lat->count, lat->count ? lat->total / lat->count : 0,
+                       lat->max);
+        v = string_output_visitor_new(false, &str);
+        visit_type_uint64List(v, NULL, &lat->buckets, &error_abort);
+        visit_complete(v, &str);
+        monitor_printf(mon, "postcopy fault latency buckets: %s\n", str);
+        g_free(str);
+        visit_free(v);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -478,6 +544,15 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_COMPRESSION),
             MultiFDCompression_str(params->multifd_compression));
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRTY_SYNC_THREADS),
+            params->dirty_sync_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DEVICE_STATE_THREADS),
+            params->device_state_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_COLO_FLUSH_THREADS),
+            params->x_colo_flush_threads);
         monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
@@ -1360,6 +1435,18 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_zstd_level = true;
         visit_type_uint8(v, param, &p->multifd_zstd_level, &err);
         break;
+    case MIGRATION_PARAMETER_DIRTY_SYNC_THREADS:
+        p->has_dirty_sync_threads = true;
+        visit_type_uint8(v, param, &p->dirty_sync_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_DEVICE_STATE_THREADS:
+        p->has_device_state_threads = true;
+        visit_type_uint8(v, param, &p->device_state_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_X_COLO_FLUSH_THREADS:
+        p->has_x_colo_flush_threads = true;
+        visit_type_uint8(v, param, &p->x_colo_flush_threads, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         if (!visit_type_size(v, param, &cache_size, &err)) {
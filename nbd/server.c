@@ -19,7 +19,13 @@
 
 #include "qemu/osdep.h"
 
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#include "block/accounting.h"
 #include "block/export.h"
+#include "block/thread-pool.h"
 #include "qapi/error.h"
 #include "qemu/queue.h"
 #include "trace.h"
@@ -1922,6 +1928,191 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1 + !!iov[1].iov_len, errp);
 }
 
+#ifdef CONFIG_SENDFILE
+typedef struct NBDSendfileData {
+    int sock_fd;
+    int file_fd;
+    off_t offset;
+    size_t bytes;
+} NBDSendfileData;
+
+/*
+ * Runs in a worker thread.  The socket is non-blocking: this returns
+ * -EAGAIN when it is full rather than waiting for the client.
+ */
+static int nbd_sendfile_worker(void *opaque)
+{
+    static const char zeroes[4096];
+    NBDSendfileData *data = opaque;
+
+    while (data->bytes) {
+        ssize_t len = sendfile(data->sock_fd, data->file_fd, &data->offset,
+                               data->bytes);
+
+        if (len == 0) {
+            /* The end of the last sector of the file reads as zeroes */
+            len = send(data->sock_fd, zeroes,
+                       MIN(data->bytes, sizeof(zeroes)), 0);
+            if (len > 0) {
+                data->offset += len;
+            }
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        data->bytes -= len;
+    }
+    return 0;
+}
+
+/*
+ * Send @size bytes of data at @offset through a bounce buffer, after the
+ * header of the reply was sent already
+ */
+static int coroutine_fn nbd_co_send_data_buffered(NBDClient *client,
+                                                  uint64_t offset,
+                                                  size_t size, Error **errp)
+{
+    BlockBackend *blk = client->exp->common.blk;
+    void *buf;
+    int ret;
+
+    buf = blk_try_blockalign(blk, size);
+    if (!buf) {
+        error_setg(errp, "Out of memory");
+        return -EIO;
+    }
+
+    ret = blk_pread(blk, offset, buf, size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "reading from file failed");
+        ret = -EIO;
+    } else {
+        ret = qio_channel_write_all(client->ioc, buf, size, errp) < 0 ?
+              -EIO : 0;
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+#endif
+
+/*
+ * Send the reply to a read of @size bytes at @offset, with the data sent
+ * from the host file straight to the socket instead of being read into a
+ * buffer first.  This needs a plain socket (no TLS) and an export whose
+ * data can be read from a host file as it is (see bdrv_get_host_fd()).
+ *
+ * Returns -ENOTSUP without sending anything if that is not possible, and
+ * the caller must then fall back to a buffered read.  As the data is sent
+ * after the header, failing to read it can't be reported to the client
+ * any more: any other error is returned as -EIO and drops the connection.
+ *
+ * The export is only kept busy while data is read from the file: waiting
+ * for a client that doesn't read must not hold up drained sections.  The
+ * file is looked up again after each wait, and the rest of the data is
+ * sent through a buffer if it can't be used any more.
+ */
+static int coroutine_fn nbd_co_send_read_direct(NBDClient *client,
+                                                uint64_t handle,
+                                                uint64_t offset,
+                                                size_t size,
+                                                bool final,
+                                                Error **errp)
+{
+#ifdef CONFIG_SENDFILE
+    BlockBackend *blk = client->exp->common.blk;
+    NBDStructuredReadData chunk;
+    NBDSimpleReply reply;
+    struct iovec iov;
+    NBDSendfileData data;
+    ThreadPool *pool;
+    BlockAcctCookie cookie;
+    int64_t host_offset;
+    int fd, ret;
+
+    if (client->ioc != QIO_CHANNEL(client->sioc) ||
+        blk_get_public(blk)->throttle_group_member.throttle_state)
+    {
+        return -ENOTSUP;
+    }
+
+    blk_inc_in_flight(blk);
+    ret = bdrv_get_host_fd(blk_bs(blk), offset, size, &fd, &host_offset);
+    blk_dec_in_flight(blk);
+    if (ret < 0) {
+        return -ENOTSUP;
+    }
+
+    trace_nbd_co_send_read_direct(handle, offset, size);
+    if (client->structured_reply) {
+        set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                     NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                     sizeof(chunk) - sizeof(chunk.h) + size);
+        stq_be_p(&chunk.offset, offset);
+        iov = (struct iovec) { .iov_base = &chunk, .iov_len = sizeof(chunk) };
+    } else {
+        set_be_simple_reply(&reply, 0, handle);
+        iov = (struct iovec) { .iov_base = &reply, .iov_len = sizeof(reply) };
+    }
+
+    data = (NBDSendfileData) {
+        .sock_fd = client->sioc->fd,
+        .bytes = size,
+    };
+
+    block_acct_start(blk_get_stats(blk), &cookie, size, BLOCK_ACCT_READ);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    qio_channel_set_cork(client->ioc, true);
+    ret = qio_channel_writev_all(client->ioc, &iov, 1, errp) < 0 ? -EIO : 0;
+    pool = aio_get_thread_pool(client->exp->common.ctx);
+    while (ret == 0 && data.bytes) {
+        uint64_t done = size - data.bytes;
+
+        blk_inc_in_flight(blk);
+        if (bdrv_get_host_fd(blk_bs(blk), offset + done, data.bytes,
+                             &fd, &host_offset) < 0) {
+            /* Drained or changed while we were waiting for the client */
+            blk_dec_in_flight(blk);
+            ret = nbd_co_send_data_buffered(client, offset + done,
+                                            data.bytes, errp);
+            break;
+        }
+        data.file_fd = fd;
+        data.offset = host_offset;
+        ret = thread_pool_submit_co(pool, nbd_sendfile_worker, &data);
+        blk_dec_in_flight(blk);
+
+        if (ret == -EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            ret = 0;
+        } else if (ret < 0) {
+            error_setg_errno(errp, -ret, "sending data from file failed");
+            ret = -EIO;
+        }
+    }
+    qio_channel_set_cork(client->ioc, false);
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    if (ret < 0) {
+        block_acct_failed(blk_get_stats(blk), &cookie);
+    } else {
+        block_acct_done(blk_get_stats(blk), &cookie);
+    }
+    return ret;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 /* Do a sparse read and send the structured reply to the client.
  * Returns -errno if sending fails. bdrv_block_status_above() failure is
  * reported to the client, at which point this function succeeds.
@@ -1971,15 +2162,20 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->common.blk, offset + progress,
-                            data + progress, pnum);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            ret = nbd_co_send_read_direct(client, handle, offset + progress,
+                                          pnum, final, errp);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->common.blk, offset + progress,
+                                data + progress, pnum);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_structured_read(client, handle,
+                                                  offset + progress,
+                                                  data + progress, pnum,
+                                                  final, errp);
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
         }
 
         if (ret < 0) {
@@ -2377,6 +2573,14 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (request->len) {
+        ret = nbd_co_send_read_direct(client, request->handle, request->from,
+                                      request->len, true, errp);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
     ret = blk_pread(exp->common.blk, request->from, data, request->len);
     if (ret < 0) {
         return nbd_send_generic_reply(client, request->handle, ret,
@@ -34,6 +34,8 @@
 
 #include "block/aio-wait.h"
 #include "qemu/coroutine.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 
 #define TYPE_COLO_COMPARE "colo-compare"
 typedef struct CompareState CompareState;
@@ -103,6 +105,45 @@ typedef struct SendEntry {
     uint8_t *buf;
 } SendEntry;
 
+/* A packet handed over by the iothread to a compare thread */
+typedef struct ComparePacket {
+    Packet *pkt;
+    ConnectionKey key;
+    int mode;
+} ComparePacket;
+
+/*
+ * Connections are spread over the shards by the hash of their key.  With
+ * a single shard the packets are compared in the iothread, otherwise each
+ * shard has its own compare thread, and the iothread only reads the
+ * packets in and writes the released ones out.
+ */
+typedef struct CompareShard {
+    CompareState *s;
+
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+
+    /* The fields below are only used with compare threads */
+    QemuThread thread;
+    /* Protects the fields below */
+    QemuMutex lock;
+    QemuCond cond;
+    /* Packets waiting for comparison, element type: ComparePacket */
+    GQueue in_list;
+    /* Primary packets to send to outdev, element type: Packet */
+    GQueue out_list;
+    bool check_old;
+    bool flush;
+    bool flush_done;
+    bool quit;
+} CompareShard;
+
 struct CompareState {
     Object parent;
 
@@ -123,13 +164,14 @@ struct CompareState {
     uint64_t compare_timeout;
     uint32_t expired_scan_cycle;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    uint32_t compare_threads;
+    CompareShard *shards;
+    /* Sends the packets released by the compare threads */
+    QEMUBH *out_bh;
+    /* Packets queued by the compare threads and not sent yet */
+    unsigned int out_queued;
+    /* A compare thread found a difference */
+    bool inconsistent;
 
     IOThread *iothread;
     GMainContext *worker_context;
@@ -194,10 +236,30 @@ static void colo_compare_inconsistency_notify(CompareState *s)
     }
 }
 
+/*
+ * Called from the compare thread, when a difference is found between
+ * primary and secondary.
+ */
+static void colo_compare_inconsistency(CompareShard *sh)
+{
+    CompareState *s = sh->s;
+
+    if (s->compare_threads > 1) {
+        /* Leave the notification to the iothread */
+        qatomic_set(&s->inconsistent, true);
+        qemu_bh_schedule(s->out_bh);
+    } else {
+        colo_compare_inconsistency_notify(s);
+    }
+}
+
 /* Use restricted to colo_insert_packet() */
-static gint seq_sorter(Packet *a, Packet *b, gpointer data)
+static gint seq_sorter(gconstpointer a, gconstpointer b, gpointer data)
 {
-    return a->tcp_seq - b->tcp_seq;
+    const Packet *pa = a, *pb = b;
+
+    /* Sequence numbers wrap around, only their distance is meaningful */
+    return (int32_t)(pa->tcp_seq - pb->tcp_seq);
 }
 
 static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
@@ -221,33 +283,68 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
  * Return 1 on success, if return 0 means the
  * packet will be dropped
  */
-static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
+static int colo_insert_packet(GSequence *queue, Packet *pkt, uint32_t *max_ack)
 {
-    if (g_queue_get_length(queue) <= max_queue_size) {
+    if (g_sequence_get_length(queue) <= max_queue_size) {
         if (pkt->ip->ip_p == IPPROTO_TCP) {
             fill_pkt_tcp_info(pkt, max_ack);
-            g_queue_insert_sorted(queue,
-                                  pkt,
-                                  (GCompareDataFunc)seq_sorter,
-                                  NULL);
+            g_sequence_insert_sorted(queue, pkt, seq_sorter, NULL);
         } else {
-            g_queue_push_tail(queue, pkt);
+            g_sequence_append(queue, pkt);
         }
         return 1;
     }
     return 0;
 }
 
+static void colo_compare_connection(void *opaque, void *user_data);
+
+/*
+ * Queue a packet to its connection and compare the connection.  Called
+ * from the compare thread of the shard.
+ */
+static void colo_compare_shard_packet(CompareShard *sh, Packet *pkt,
+                                      ConnectionKey *key, int mode)
+{
+    Connection *conn;
+    int ret;
+
+    conn = connection_get(sh->connection_track_table,
+                          key,
+                          &sh->conn_list);
+
+    if (!conn->processing) {
+        g_queue_push_tail(&sh->conn_list, conn);
+        conn->processing = true;
+    }
+
+    if (mode == PRIMARY_IN) {
+        ret = colo_insert_packet(conn->primary_list, pkt, &conn->pack);
+    } else {
+        ret = colo_insert_packet(conn->secondary_list, pkt, &conn->sack);
+    }
+
+    if (!ret) {
+        trace_colo_compare_drop_packet(colo_mode[mode],
+            "queue size too big, drop packet");
+        packet_destroy(pkt, NULL);
+        pkt = NULL;
+    }
+
+    /* compare packet in the specified connection */
+    colo_compare_connection(conn, sh);
+}
+
 /*
  * Return 0 on success, if return -1 means the pkt
  * is unsupported(arp and ipv6) and will be sent later
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static int packet_enqueue(CompareState *s, int mode)
 {
     ConnectionKey key;
     Packet *pkt = NULL;
-    Connection *conn;
-    int ret;
+    CompareShard *sh;
+    ComparePacket *cp;
 
     if (mode == PRIMARY_IN) {
         pkt = packet_new(s->pri_rs.buf,
@@ -266,29 +363,33 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
     }
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
-                          &key,
-                          &s->conn_list);
-
-    if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
-        conn->processing = true;
+    if (s->compare_threads == 1) {
+        colo_compare_shard_packet(&s->shards[0], pkt, &key, mode);
+        return 0;
     }
 
-    if (mode == PRIMARY_IN) {
-        ret = colo_insert_packet(&conn->primary_list, pkt, &conn->pack);
-    } else {
-        ret = colo_insert_packet(&conn->secondary_list, pkt, &conn->sack);
-    }
+    sh = &s->shards[connection_key_hash(&key) % s->compare_threads];
 
-    if (!ret) {
+    qemu_mutex_lock(&sh->lock);
+    /*
+     * The connection queues are only checked by the compare thread, don't
+     * let a compare thread that falls behind queue packets without bound
+     */
+    if (g_queue_get_length(&sh->in_list) >= max_queue_size) {
+        qemu_mutex_unlock(&sh->lock);
         trace_colo_compare_drop_packet(colo_mode[mode],
-            "queue size too big, drop packet");
+            "compare thread queue size too big, drop packet");
         packet_destroy(pkt, NULL);
-        pkt = NULL;
+        return 0;
     }
 
-    *con = conn;
+    cp = g_slice_new(ComparePacket);
+    cp->pkt = pkt;
+    cp->key = key;
+    cp->mode = mode;
+    g_queue_push_tail(&sh->in_list, cp);
+    qemu_cond_broadcast(&sh->cond);
+    qemu_mutex_unlock(&sh->lock);
 
     return 0;
 }
@@ -298,7 +399,7 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+static void colo_send_primary_pkt(CompareState *s, Packet *pkt)
 {
     int ret;
     ret = compare_chr_send(s,
@@ -310,10 +411,31 @@ static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
     if (ret < 0) {
         error_report("colo send primary packet failed");
     }
-    trace_colo_compare_main("packet same and release packet");
     packet_destroy_partial(pkt, NULL);
 }
 
+static void colo_output_primary_pkt(CompareShard *sh, Packet *pkt)
+{
+    CompareState *s = sh->s;
+
+    if (s->compare_threads > 1) {
+        /* Only the iothread writes to outdev */
+        qatomic_inc(&s->out_queued);
+        qemu_mutex_lock(&sh->lock);
+        g_queue_push_tail(&sh->out_list, pkt);
+        qemu_mutex_unlock(&sh->lock);
+        qemu_bh_schedule(s->out_bh);
+    } else {
+        colo_send_primary_pkt(s, pkt);
+    }
+}
+
+static void colo_release_primary_pkt(CompareShard *sh, Packet *pkt)
+{
+    colo_output_primary_pkt(sh, pkt);
+    trace_colo_compare_main("packet same and release packet");
+}
+
 /*
  * The IP packets sent by primary and secondary
  * will be compared in here
@@ -397,7 +519,7 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     return false;
 }
 
-static void colo_compare_tcp(CompareState *s, Connection *conn)
+static void colo_compare_tcp(CompareShard *sh, Connection *conn)
 {
     Packet *ppkt = NULL, *spkt = NULL;
     int8_t mark;
@@ -416,25 +538,25 @@ static void colo_compare_tcp(CompareState *s, Connection *conn)
     uint32_t min_ack = conn->pack > conn->sack ? conn->sack : conn->pack;
 
 pri:
-    if (g_queue_is_empty(&conn->primary_list)) {
+    if (g_sequence_is_empty(conn->primary_list)) {
         return;
     }
-    ppkt = g_queue_pop_head(&conn->primary_list);
+    ppkt = packet_list_pop_head(conn->primary_list);
 sec:
-    if (g_queue_is_empty(&conn->secondary_list)) {
-        g_queue_push_head(&conn->primary_list, ppkt);
+    if (g_sequence_is_empty(conn->secondary_list)) {
+        g_sequence_prepend(conn->primary_list, ppkt);
         return;
     }
-    spkt = g_queue_pop_head(&conn->secondary_list);
+    spkt = packet_list_pop_head(conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
     if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
         trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
@@ -456,7 +578,7 @@ sec:
             }
         }
         if (!ppkt) {
-            g_queue_push_head(&conn->secondary_list, spkt);
+            g_sequence_prepend(conn->secondary_list, spkt);
             goto pri;
         }
     }
@@ -474,8 +596,8 @@ sec:
 
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
-            g_queue_push_head(&conn->secondary_list, spkt);
+            colo_release_primary_pkt(sh, ppkt);
+            g_sequence_prepend(conn->secondary_list, spkt);
             goto pri;
         } else if (mark == COLO_COMPARE_FREE_SECONDARY) {
             conn->compare_seq = spkt->seq_end;
@@ -483,20 +605,20 @@ sec:
             goto sec;
         } else if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             packet_destroy(spkt, NULL);
             goto pri;
         }
     } else {
-        g_queue_push_head(&conn->primary_list, ppkt);
-        g_queue_push_head(&conn->secondary_list, spkt);
+        g_sequence_prepend(conn->primary_list, ppkt);
+        g_sequence_prepend(conn->secondary_list, spkt);
 
 #ifdef DEBUG_COLO_PACKETS
         qemu_hexdump(stderr, "colo-compare ppkt", ppkt->data, ppkt->size);
         qemu_hexdump(stderr, "colo-compare spkt", spkt->data, spkt->size);
 #endif
 
-        colo_compare_inconsistency_notify(s);
+        colo_compare_inconsistency(sh);
     }
 }
 
@@ -633,28 +755,48 @@ void colo_compare_unregister_notifier(Notifier *notify)
     notifier_remove(notify);
 }
 
+/*
+ * Return the first packet of @list for which @func returns 0 when
+ * called with @user_data, or NULL if there is none.
+ */
+static GSequenceIter *packet_list_find_custom(GSequence *list,
+                                              gconstpointer user_data,
+                                              GCompareFunc func)
+{
+    GSequenceIter *iter;
+
+    for (iter = g_sequence_get_begin_iter(list);
+         !g_sequence_iter_is_end(iter);
+         iter = g_sequence_iter_next(iter)) {
+        if (!func(g_sequence_get(iter), user_data)) {
+            return iter;
+        }
+    }
+    return NULL;
+}
+
 static int colo_old_packet_check_one_conn(Connection *conn,
-                                          CompareState *s)
+                                          CompareShard *sh)
 {
-    if (!g_queue_is_empty(&conn->primary_list)) {
-        if (g_queue_find_custom(&conn->primary_list,
+    CompareState *s = sh->s;
+
+    if (packet_list_find_custom(conn->primary_list,
                                 &s->compare_timeout,
-                                (GCompareFunc)colo_old_packet_check_one))
-            goto out;
+                                (GCompareFunc)colo_old_packet_check_one)) {
+        goto out;
     }
 
-    if (!g_queue_is_empty(&conn->secondary_list)) {
-        if (g_queue_find_custom(&conn->secondary_list,
+    if (packet_list_find_custom(conn->secondary_list,
                                 &s->compare_timeout,
-                                (GCompareFunc)colo_old_packet_check_one))
-            goto out;
+                                (GCompareFunc)colo_old_packet_check_one)) {
+        goto out;
     }
 
     return 1;
 
 out:
     /* Do checkpoint will flush old packet */
-    colo_compare_inconsistency_notify(s);
+    colo_compare_inconsistency(sh);
     return 0;
 }
 
@@ -663,35 +805,33 @@ out:
  * if we have some then we have to checkpoint to wake
  * the secondary up.
  */
-static void colo_old_packet_check(void *opaque)
+static void colo_old_packet_check(CompareShard *sh)
 {
-    CompareState *s = opaque;
-
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, s,
+    g_queue_find_custom(&sh->conn_list, sh,
                         (GCompareFunc)colo_old_packet_check_one_conn);
 }
 
-static void colo_compare_packet(CompareState *s, Connection *conn,
+static void colo_compare_packet(CompareShard *sh, Connection *conn,
                                 int (*HandlePacket)(Packet *spkt,
                                 Packet *ppkt))
 {
     Packet *pkt = NULL;
-    GList *result = NULL;
+    GSequenceIter *result = NULL;
 
-    while (!g_queue_is_empty(&conn->primary_list) &&
-           !g_queue_is_empty(&conn->secondary_list)) {
-        pkt = g_queue_pop_head(&conn->primary_list);
-        result = g_queue_find_custom(&conn->secondary_list,
+    while (!g_sequence_is_empty(conn->primary_list) &&
+           !g_sequence_is_empty(conn->secondary_list)) {
+        pkt = packet_list_pop_head(conn->primary_list);
+        result = packet_list_find_custom(conn->secondary_list,
                  pkt, (GCompareFunc)HandlePacket);
 
         if (result) {
-            colo_release_primary_pkt(s, pkt);
-            packet_destroy(result->data, NULL);
-            g_queue_delete_link(&conn->secondary_list, result);
+            colo_release_primary_pkt(sh, pkt);
+            packet_destroy(g_sequence_get(result), NULL);
+            g_sequence_remove(result);
         } else {
             /*
              * If one packet arrive late, the secondary_list or
@@ -700,9 +840,9 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
              * timeout, it will trigger a checkpoint request.
              */
             trace_colo_compare_main("packet different");
-            g_queue_push_head(&conn->primary_list, pkt);
+            g_sequence_prepend(conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_compare_inconsistency(sh);
             break;
         }
     }
@@ -716,21 +856,21 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  */
 static void colo_compare_connection(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
 
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
-        colo_compare_tcp(s, conn);
+        colo_compare_tcp(sh, conn);
         break;
     case IPPROTO_UDP:
-        colo_compare_packet(s, conn, colo_packet_compare_udp);
+        colo_compare_packet(sh, conn, colo_packet_compare_udp);
         break;
     case IPPROTO_ICMP:
-        colo_compare_packet(s, conn, colo_packet_compare_icmp);
+        colo_compare_packet(sh, conn, colo_packet_compare_icmp);
         break;
     default:
-        colo_compare_packet(s, conn, colo_packet_compare_other);
+        colo_compare_packet(sh, conn, colo_packet_compare_other);
         break;
     }
 }
@@ -905,9 +1045,21 @@ static void compare_notify_chr(void *opaque, const uint8_t *buf, int size)
 static void check_old_packet_regular(void *opaque)
 {
     CompareState *s = opaque;
+    uint32_t i;
 
     /* if have old packet we will notify checkpoint */
-    colo_old_packet_check(s);
+    if (s->compare_threads == 1) {
+        colo_old_packet_check(&s->shards[0]);
+    } else {
+        for (i = 0; i < s->compare_threads; i++) {
+            CompareShard *sh = &s->shards[i];
+
+            qemu_mutex_lock(&sh->lock);
+            sh->check_old = true;
+            qemu_cond_broadcast(&sh->cond);
+            qemu_mutex_unlock(&sh->lock);
+        }
+    }
     timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
               s->expired_scan_cycle);
 }
@@ -959,13 +1111,118 @@ static void colo_compare_timer_del(CompareState *s)
 
 static void colo_flush_packets(void *opaque, void *user_data);
 
+/* Send the packets released by the compare thread of @sh */
+static void colo_compare_shard_output(CompareShard *sh)
+{
+    CompareState *s = sh->s;
+    GQueue out_list;
+    Packet *pkt;
+
+    qemu_mutex_lock(&sh->lock);
+    out_list = sh->out_list;
+    g_queue_init(&sh->out_list);
+    qemu_mutex_unlock(&sh->lock);
+
+    while ((pkt = g_queue_pop_head(&out_list))) {
+        colo_send_primary_pkt(s, pkt);
+        qatomic_dec(&s->out_queued);
+    }
+}
+
+/*
+ * Called from the iothread on behalf of the compare threads, which can't
+ * use the chardevs.
+ */
+static void colo_compare_out_bh(void *opaque)
+{
+    CompareState *s = opaque;
+    uint32_t i;
+
+    for (i = 0; i < s->compare_threads; i++) {
+        colo_compare_shard_output(&s->shards[i]);
+    }
+    if (qatomic_xchg(&s->inconsistent, false)) {
+        colo_compare_inconsistency_notify(s);
+    }
+    aio_wait_kick();
+}
+
+static void *colo_compare_thread(void *opaque)
+{
+    CompareShard *sh = opaque;
+    ComparePacket *cp;
+
+    qemu_mutex_lock(&sh->lock);
+    while (true) {
+        /* Compare everything that was received before handling requests */
+        cp = g_queue_pop_head(&sh->in_list);
+        if (cp) {
+            qemu_mutex_unlock(&sh->lock);
+            colo_compare_shard_packet(sh, cp->pkt, &cp->key, cp->mode);
+            g_slice_free(ComparePacket, cp);
+            qemu_mutex_lock(&sh->lock);
+        } else if (sh->flush) {
+            sh->flush = false;
+            qemu_mutex_unlock(&sh->lock);
+            g_queue_foreach(&sh->conn_list, colo_flush_packets, sh);
+            qemu_mutex_lock(&sh->lock);
+            sh->flush_done = true;
+            qemu_cond_broadcast(&sh->cond);
+        } else if (sh->check_old) {
+            sh->check_old = false;
+            qemu_mutex_unlock(&sh->lock);
+            colo_old_packet_check(sh);
+            qemu_mutex_lock(&sh->lock);
+        } else if (sh->quit) {
+            break;
+        } else {
+            qemu_cond_wait(&sh->cond, &sh->lock);
+        }
+    }
+    qemu_mutex_unlock(&sh->lock);
+
+    return NULL;
+}
+
+/* Release the primary packets and drop the secondary ones */
+static void colo_compare_flush(CompareState *s)
+{
+    uint32_t i;
+
+    if (s->compare_threads == 1) {
+        g_queue_foreach(&s->shards[0].conn_list, colo_flush_packets,
+                        &s->shards[0]);
+        return;
+    }
+
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        qemu_mutex_lock(&sh->lock);
+        sh->flush = true;
+        sh->flush_done = false;
+        qemu_cond_broadcast(&sh->cond);
+        qemu_mutex_unlock(&sh->lock);
+    }
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        qemu_mutex_lock(&sh->lock);
+        while (!sh->flush_done) {
+            qemu_cond_wait(&sh->cond, &sh->lock);
+        }
+        qemu_mutex_unlock(&sh->lock);
+        colo_compare_shard_output(sh);
+    }
+}
+
 static void colo_compare_handle_event(void *opaque)
 {
     CompareState *s = opaque;
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -985,6 +1242,7 @@ static void colo_compare_iothread(CompareState *s)
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     object_ref(OBJECT(s->iothread));
     s->worker_context = iothread_get_g_main_context(s->iothread);
+    s->out_bh = aio_bh_new(ctx, colo_compare_out_bh, s);
 
     qemu_chr_fe_set_handlers(&s->chr_pri_in, compare_chr_can_read,
                              compare_pri_chr_in, NULL, NULL,
@@ -1134,6 +1392,40 @@ static void compare_set_expired_scan_cycle(Object *obj, Visitor *v,
     s->expired_scan_cycle = value;
 }
 
+static void compare_get_threads(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_threads(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    /* The shards are allocated once, in colo_compare_complete() */
+    if (s->shards) {
+        error_setg(errp, "cannot change property '%s' of %s", name,
+                   object_get_typename(obj));
+        return;
+    }
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value) {
+        error_setg(errp, "Property '%s.%s' requires a positive value",
+                   object_get_typename(obj), name);
+        return;
+    }
+    s->compare_threads = value;
+}
+
 static void get_max_queue_size(Object *obj, Visitor *v,
                                const char *name, void *opaque,
                                Error **errp)
@@ -1168,9 +1460,8 @@ out:
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
+    if (packet_enqueue(s, PRIMARY_IN)) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
@@ -1178,22 +1469,15 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          pri_rs->vnet_hdr_len,
                          false,
                          false);
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    if (packet_enqueue(s, SECONDARY_IN)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
@@ -1215,7 +1499,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s);
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1259,6 +1543,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 {
     CompareState *s = COLO_COMPARE(uc);
     Chardev *chr;
+    uint32_t i;
 
     if (!s->pri_indev || !s->sec_indev || !s->outdev || !s->iothread) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
@@ -1330,12 +1615,25 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         g_queue_init(&s->notify_sendco.send_list);
     }
 
-    g_queue_init(&s->conn_list);
-
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+    s->shards = g_new0(CompareShard, s->compare_threads);
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        sh->s = s;
+        g_queue_init(&sh->conn_list);
+        sh->connection_track_table = g_hash_table_new_full(connection_key_hash,
+                                                           connection_key_equal,
+                                                           g_free,
+                                                           connection_destroy);
+        if (s->compare_threads > 1) {
+            qemu_mutex_init(&sh->lock);
+            qemu_cond_init(&sh->cond);
+            g_queue_init(&sh->in_list);
+            g_queue_init(&sh->out_list);
+            qemu_thread_create(&sh->thread, "colo-compare", colo_compare_thread,
+                               sh, QEMU_THREAD_JOINABLE);
+        }
+    }
 
     colo_compare_iothread(s);
 
@@ -1353,26 +1651,42 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 
 static void colo_flush_packets(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
     Packet *pkt = NULL;
 
-    while (!g_queue_is_empty(&conn->primary_list)) {
-        pkt = g_queue_pop_head(&conn->primary_list);
-        compare_chr_send(s,
-                         pkt->data,
-                         pkt->size,
-                         pkt->vnet_hdr_len,
-                         false,
-                         true);
-        packet_destroy_partial(pkt, NULL);
+    while ((pkt = packet_list_pop_head(conn->primary_list))) {
+        colo_output_primary_pkt(sh, pkt);
     }
-    while (!g_queue_is_empty(&conn->secondary_list)) {
-        pkt = g_queue_pop_head(&conn->secondary_list);
+    while ((pkt = packet_list_pop_head(conn->secondary_list))) {
         packet_destroy(pkt, NULL);
     }
 }
 
+/*
+ * Stop the compare threads, and queue their unhandled packets for the
+ * iothread to send them.
+ */
+static void colo_compare_stop_threads(CompareState *s)
+{
+    uint32_t i;
+
+    if (!s->shards || s->compare_threads == 1) {
+        return;
+    }
+
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        qemu_mutex_lock(&sh->lock);
+        sh->quit = true;
+        qemu_cond_broadcast(&sh->cond);
+        qemu_mutex_unlock(&sh->lock);
+        qemu_thread_join(&sh->thread);
+        g_queue_foreach(&sh->conn_list, colo_flush_packets, sh);
+    }
+}
+
 static void colo_compare_class_init(ObjectClass *oc, void *data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
@@ -1410,6 +1724,11 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    s->compare_threads = 1;
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_threads,
+                        compare_set_threads, NULL, NULL);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
@@ -1419,6 +1738,7 @@ static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    uint32_t i;
 
     qemu_mutex_lock(&colo_compare_mutex);
     QTAILQ_FOREACH(tmp, &net_compares, next) {
@@ -1445,28 +1765,42 @@ static void colo_compare_finalize(Object *obj)
 
     qemu_bh_delete(s->event_bh);
 
+    colo_compare_stop_threads(s);
+
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     aio_context_acquire(ctx);
-    AIO_WAIT_WHILE(ctx, !s->out_sendco.done);
+    AIO_WAIT_WHILE(ctx, !s->out_sendco.done || qatomic_read(&s->out_queued));
     if (s->notify_dev) {
         AIO_WAIT_WHILE(ctx, !s->notify_sendco.done);
     }
     aio_context_release(ctx);
 
+    qemu_bh_delete(s->out_bh);
+
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    if (s->shards && s->compare_threads == 1) {
+        g_queue_foreach(&s->shards[0].conn_list, colo_flush_packets,
+                        &s->shards[0]);
+    }
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
 
-    g_queue_clear(&s->conn_list);
+    for (i = 0; s->shards && i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        g_queue_clear(&sh->conn_list);
+        g_hash_table_destroy(sh->connection_track_table);
+        if (s->compare_threads > 1) {
+            qemu_mutex_destroy(&sh->lock);
+            qemu_cond_destroy(&sh->cond);
+        }
+    }
+    g_free(s->shards);
+
     g_queue_clear(&s->out_sendco.send_list);
     if (s->notify_dev) {
         g_queue_clear(&s->notify_sendco.send_list);
     }
 
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
-    }
-
     object_unref(OBJECT(s->iothread));
 
     g_free(s->pri_indev);
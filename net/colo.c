@@ -138,8 +138,8 @@ Connection *connection_new(ConnectionKey *key)
     conn->ip_proto = key->ip_proto;
     conn->processing = false;
     conn->tcp_state = TCPS_CLOSED;
-    g_queue_init(&conn->primary_list);
-    g_queue_init(&conn->secondary_list);
+    conn->primary_list = g_sequence_new(NULL);
+    conn->secondary_list = g_sequence_new(NULL);
 
     return conn;
 }
@@ -148,10 +148,10 @@ void connection_destroy(void *opaque)
 {
     Connection *conn = opaque;
 
-    g_queue_foreach(&conn->primary_list, packet_destroy, NULL);
-    g_queue_clear(&conn->primary_list);
-    g_queue_foreach(&conn->secondary_list, packet_destroy, NULL);
-    g_queue_clear(&conn->secondary_list);
+    g_sequence_foreach(conn->primary_list, packet_destroy, NULL);
+    g_sequence_free(conn->primary_list);
+    g_sequence_foreach(conn->secondary_list, packet_destroy, NULL);
+    g_sequence_free(conn->secondary_list);
     g_slice_free(Connection, conn);
 }
 
@@ -189,6 +189,21 @@ void packet_destroy_partial(void *opaque, void *user_data)
     g_slice_free(Packet, pkt);
 }
 
+/* Remove the first packet of a connection queue, NULL if it is empty */
+Packet *packet_list_pop_head(GSequence *list)
+{
+    GSequenceIter *iter = g_sequence_get_begin_iter(list);
+    Packet *pkt;
+
+    if (g_sequence_iter_is_end(iter)) {
+        return NULL;
+    }
+    pkt = g_sequence_get(iter);
+    g_sequence_remove(iter);
+
+    return pkt;
+}
+
 /*
  * Clear hashtable, stop this hash growing really huge
  */
@@ -66,10 +66,14 @@ typedef struct ConnectionKey {
 } QEMU_PACKED ConnectionKey;
 
 typedef struct Connection {
-    /* connection primary send queue: element type: Packet */
-    GQueue primary_list;
+    /*
+     * connection primary send queue: element type: Packet
+     * TCP packets are kept sorted by sequence number, the others are
+     * in arrival order.
+     */
+    GSequence *primary_list;
     /* connection secondary send queue: element type: Packet */
-    GQueue secondary_list;
+    GSequence *secondary_list;
     /* flag to enqueue unprocessed_connections */
     bool processing;
     uint8_t ip_proto;
@@ -103,5 +107,6 @@ void connection_hashtable_reset(GHashTable *connection_track_table);
 Packet *packet_new(const void *data, int size, int vnet_hdr_len);
 void packet_destroy(void *opaque, void *user_data);
 void packet_destroy_partial(void *opaque, void *user_data);
+Packet *packet_list_pop_head(GSequence *list);
 
 #endif /* NET_COLO_H */
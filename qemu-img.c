@@ -82,6 +82,7 @@ enum {
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
+    OPTION_RANDOM = 277,
 };
 
 typedef enum OutputFormat {
@@ -348,6 +349,26 @@ static int print_block_option_help(const char *filename, const char *fmt)
 }
 
 
+/*
+ * blk_new_open() shares all permissions.  Nobody else needs to write to an
+ * image that is only read here, so take the write permission away from
+ * others unless -U was given.  This also lets file-posix know that the
+ * extents of the file do not change behind its back.
+ */
+static int img_unshare_write(BlockBackend *blk, const char *name)
+{
+    uint64_t perm, shared_perm;
+    Error *local_err = NULL;
+
+    blk_get_perm(blk, &perm, &shared_perm);
+    if (blk_set_perm(blk, perm, shared_perm & ~BLK_PERM_WRITE,
+                     &local_err) < 0) {
+        error_reportf_err(local_err, "Could not open '%s': ", name);
+        return -1;
+    }
+    return 0;
+}
+
 static BlockBackend *img_open_opts(const char *optstr,
                                    QemuOpts *opts, int flags, bool writethrough,
                                    bool quiet, bool force_share)
@@ -370,6 +391,11 @@ static BlockBackend *img_open_opts(const char *optstr,
         error_reportf_err(local_err, "Could not open '%s': ", optstr);
         return NULL;
     }
+    if (!(flags & BDRV_O_RDWR) && !force_share &&
+        img_unshare_write(blk, optstr) < 0) {
+        blk_unref(blk);
+        return NULL;
+    }
     blk_set_enable_write_cache(blk, !writethrough);
 
     return blk;
@@ -399,6 +425,11 @@ static BlockBackend *img_open_file(const char *filename,
         error_reportf_err(local_err, "Could not open '%s': ", filename);
         return NULL;
     }
+    if (!(flags & BDRV_O_RDWR) && !force_share &&
+        img_unshare_write(blk, filename) < 0) {
+        blk_unref(blk);
+        return NULL;
+    }
     blk_set_enable_write_cache(blk, !writethrough);
 
     return blk;
@@ -655,16 +686,72 @@ static void dump_human_image_check(ImageCheck *check, bool quiet)
     }
 }
 
+typedef struct ImgCheckProgress {
+    bool show_phases;
+    const char *phase;
+    int64_t start;
+    int64_t done;
+    int64_t bytes;
+} ImgCheckProgress;
+
+/* Prints how long the current phase took and how fast it read metadata */
+static void check_progress_end_phase(ImgCheckProgress *p)
+{
+    double secs;
+
+    if (!p->phase) {
+        return;
+    }
+
+    secs = (get_clock() - p->start) / (double)NANOSECONDS_PER_SECOND;
+    fprintf(stderr, "%s: done in %.2f s", p->phase, secs);
+    if (p->bytes && secs > 0) {
+        fprintf(stderr, " (%.1f MiB/s)", p->bytes / secs / MiB);
+    }
+    fprintf(stderr, "\n");
+    p->phase = NULL;
+}
+
+static void check_status_cb(BlockDriverState *bs, const char *phase,
+                            int64_t done, int64_t total, int64_t bytes,
+                            void *opaque)
+{
+    ImgCheckProgress *p = opaque;
+
+    if (p->show_phases &&
+        (!p->phase || strcmp(p->phase, phase) || done < p->done)) {
+        if (p->phase) {
+            /* Leave the progress bar of the previous phase at 100% */
+            qemu_progress_end();
+        }
+        check_progress_end_phase(p);
+        p->phase = phase;
+        p->start = get_clock();
+    }
+    p->done = done;
+    p->bytes = bytes;
+
+    /* Each phase runs from 0 to 100% on its own */
+    qemu_progress_print(total > 0 ? 100.f * done / total : 100.f, 0);
+}
+
 static int collect_image_check(BlockDriverState *bs,
                    ImageCheck *check,
                    const char *filename,
                    const char *fmt,
-                   int fix)
+                   int fix,
+                   bool show_phases)
 {
     int ret;
     BdrvCheckResult result;
+    ImgCheckProgress p = { .show_phases = show_phases };
 
-    ret = bdrv_check(bs, &result, fix);
+    /* In case the driver does not call check_status_cb() */
+    qemu_progress_print(0.f, 0);
+    ret = bdrv_check(bs, &result, fix, check_status_cb, &p);
+    qemu_progress_print(100.f, 0);
+    qemu_progress_end();
+    check_progress_end_phase(&p);
     if (ret < 0) {
         return ret;
     }
@@ -717,6 +804,7 @@ static int img_check(int argc, char **argv)
     bool quiet = false;
     bool image_opts = false;
     bool force_share = false;
+    bool progress = false;
 
     fmt = NULL;
     output = NULL;
@@ -734,7 +822,7 @@ static int img_check(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:r:T:qU",
+        c = getopt_long(argc, argv, ":hf:r:T:qUp",
                         long_options, &option_index);
         if (c == -1) {
             break;
@@ -776,6 +864,9 @@ static int img_check(int argc, char **argv)
         case 'U':
             force_share = true;
             break;
+        case 'p':
+            progress = true;
+            break;
         case OPTION_OBJECT:
             user_creatable_process_cmdline(optarg);
             break;
@@ -798,6 +889,12 @@ static int img_check(int argc, char **argv)
         return 1;
     }
 
+    /* The progress bar goes to stdout, where it would break the JSON */
+    if (quiet || output_format == OFORMAT_JSON) {
+        progress = false;
+    }
+    qemu_progress_init(progress, 1.0);
+
     ret = bdrv_parse_cache_mode(cache, &flags, &writethrough);
     if (ret < 0) {
         error_report("Invalid source cache option: %s", cache);
@@ -812,7 +909,7 @@ static int img_check(int argc, char **argv)
     bs = blk_bs(blk);
 
     check = g_new0(ImageCheck, 1);
-    ret = collect_image_check(bs, check, filename, fmt, fix);
+    ret = collect_image_check(bs, check, filename, fmt, fix, progress);
 
     if (ret == -ENOTSUP) {
         error_report("This image format does not support checks");
@@ -841,7 +938,7 @@ static int img_check(int argc, char **argv)
 
         qapi_free_ImageCheck(check);
         check = g_new0(ImageCheck, 1);
-        ret = collect_image_check(bs, check, filename, fmt, 0);
+        ret = collect_image_check(bs, check, filename, fmt, 0, progress);
 
         check->leaks_fixed          = leaks_fixed;
         check->has_leaks_fixed      = has_leaks_fixed;
@@ -4182,6 +4279,9 @@ typedef struct BenchData {
     bool drain_on_flush;
     uint8_t *buf;
     QEMUIOVector *qiov;
+    /* for random requests: generator, and number of possible offsets */
+    GRand *rand;
+    uint64_t random_slots;
 
     int in_flight;
     bool in_flush;
@@ -4247,8 +4347,14 @@ static void bench_cb(void *opaque, int ret)
          * and b->offset is ready for the next submission.
          */
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
+        if (b->rand) {
+            uint64_t slot = g_rand_double(b->rand) * b->random_slots;
+
+            offset += MIN(slot, b->random_slots - 1) * b->bufsize;
+        } else {
+            b->offset += b->step;
+            b->offset %= b->image_size;
+        }
         if (b->write) {
             acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
         } else {
@@ -4282,8 +4388,10 @@ static int img_bench(int argc, char **argv)
     int flags = 0;
     bool writethrough = false;
     struct timeval t1, t2;
+    double elapsed;
     int i;
     bool force_share = false;
+    bool random_access = false;
     size_t buf_size;
 
     for (;;) {
@@ -4293,6 +4401,7 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"random", no_argument, 0, OPTION_RANDOM},
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
@@ -4424,6 +4533,9 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_RANDOM:
+            random_access = true;
+            break;
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
@@ -4445,6 +4557,11 @@ static int img_bench(int argc, char **argv)
         ret = -1;
         goto out;
     }
+    if (random_access && step) {
+        error_report("--random and -S can't be used together");
+        ret = -1;
+        goto out;
+    }
 
     blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet,
                    force_share);
@@ -4471,10 +4588,25 @@ static int img_bench(int argc, char **argv)
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
+    if (random_access) {
+        if (offset + bufsize > image_size) {
+            error_report("No room for requests after offset %" PRId64, offset);
+            ret = -1;
+            goto out;
+        }
+        /* Fixed seed, so that runs can be compared */
+        data.rand = g_rand_new_with_seed(0);
+        data.random_slots = (image_size - offset) / bufsize;
+        printf("Sending %d %s requests, %d bytes each, %d in parallel "
+               "(random offsets after offset %" PRId64 ")\n",
+               data.n, data.write ? "write" : "read", data.bufsize,
+               data.nrreq, data.offset);
+    } else {
+        printf("Sending %d %s requests, %d bytes each, %d in parallel "
+               "(starting at offset %" PRId64 ", step size %d)\n",
+               data.n, data.write ? "write" : "read", data.bufsize,
+               data.nrreq, data.offset, data.step);
+    }
     if (flush_interval) {
         printf("Sending flush every %d requests\n", flush_interval);
     }
@@ -4500,11 +4632,17 @@ static int img_bench(int argc, char **argv)
     }
     gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    elapsed = (t2.tv_sec - t1.tv_sec)
+              + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+    printf("Run completed in %3.3f seconds.\n", elapsed);
+    if (elapsed > 0) {
+        printf("%.0f requests per second\n", count / elapsed);
+    }
 
 out:
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
     if (data.buf) {
         blk_unregister_buf(blk, data.buf);
     }
@@ -0,0 +1,146 @@
+/*
+ * Xor Based Zero Run Length Encoding speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "../migration/xbzrle.h"
+
+#define XBZRLE_PAGE_SIZE 4096
+#define XBZRLE_BENCH_PAGES 4096
+#define XBZRLE_BENCH_LOOPS 64
+
+typedef struct XBZRLEBenchOpts {
+    const char *name;
+    /* number of modified spans per page */
+    int spans;
+    /* maximum length of each modified span */
+    int span_len;
+} XBZRLEBenchOpts;
+
+/*
+ * Fill @old with random pages and derive @new from it by flipping
+ * @spans random byte ranges on every page.
+ */
+static void xbzrle_bench_fill(const XBZRLEBenchOpts *opts,
+                              uint8_t *old, uint8_t *new)
+{
+    size_t total = (size_t)XBZRLE_BENCH_PAGES * XBZRLE_PAGE_SIZE;
+    size_t i;
+    int j, k;
+
+    for (i = 0; i < total; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, total);
+
+    for (i = 0; i < XBZRLE_BENCH_PAGES; i++) {
+        uint8_t *page = new + i * XBZRLE_PAGE_SIZE;
+
+        for (j = 0; j < opts->spans; j++) {
+            int off = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+            int len = g_test_rand_int_range(1, opts->span_len + 1);
+
+            for (k = off; k < off + len && k < XBZRLE_PAGE_SIZE; k++) {
+                page[k] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+}
+
+static double xbzrle_bench_run(int (*encode)(uint8_t *, uint8_t *, int,
+                                             uint8_t *, int),
+                               uint8_t *old, uint8_t *new, uint8_t *out,
+                               int *lens)
+{
+    int loop, i;
+
+    g_test_timer_start();
+    for (loop = 0; loop < XBZRLE_BENCH_LOOPS; loop++) {
+        for (i = 0; i < XBZRLE_BENCH_PAGES; i++) {
+            size_t off = (size_t)i * XBZRLE_PAGE_SIZE;
+
+            lens[i] = encode(old + off, new + off, XBZRLE_PAGE_SIZE,
+                             out + off, XBZRLE_PAGE_SIZE);
+        }
+    }
+    return g_test_timer_elapsed();
+}
+
+static void test_xbzrle_encode_speed(const void *opaque)
+{
+    const XBZRLEBenchOpts *opts = opaque;
+    size_t total = (size_t)XBZRLE_BENCH_PAGES * XBZRLE_PAGE_SIZE;
+    uint8_t *old = qemu_memalign(64, total);
+    uint8_t *new = qemu_memalign(64, total);
+    uint8_t *ref = g_malloc(total);
+    uint8_t *out = g_malloc(total);
+    uint8_t *page = g_malloc(XBZRLE_PAGE_SIZE);
+    int *ref_lens = g_new(int, XBZRLE_BENCH_PAGES);
+    int *lens = g_new(int, XBZRLE_BENCH_PAGES);
+    double ref_time, time;
+    int i;
+
+    xbzrle_bench_fill(opts, old, new);
+
+    ref_time = xbzrle_bench_run(xbzrle_encode_buffer_int, old, new, ref,
+                                ref_lens);
+    g_test_message("xbzrle(%s): int %.2f MB/sec", opts->name,
+                   total * XBZRLE_BENCH_LOOPS / ref_time / MiB);
+
+    do {
+        time = xbzrle_bench_run(xbzrle_encode_buffer, old, new, out, lens);
+        g_test_message("xbzrle(%s): accel %.2f MB/sec (%.2fx)", opts->name,
+                       total * XBZRLE_BENCH_LOOPS / time / MiB,
+                       ref_time / time);
+
+        /* The output must be bit-identical to the reference encoder */
+        for (i = 0; i < XBZRLE_BENCH_PAGES; i++) {
+            size_t off = (size_t)i * XBZRLE_PAGE_SIZE;
+
+            g_assert_cmpint(lens[i], ==, ref_lens[i]);
+            if (lens[i] <= 0) {
+                continue;
+            }
+            g_assert(memcmp(out + off, ref + off, lens[i]) == 0);
+
+            memcpy(page, old + off, XBZRLE_PAGE_SIZE);
+            g_assert_cmpint(xbzrle_decode_buffer(out + off, lens[i], page,
+                                                 XBZRLE_PAGE_SIZE), >, 0);
+            g_assert(memcmp(page, new + off, XBZRLE_PAGE_SIZE) == 0);
+        }
+    } while (xbzrle_encode_test_next_accel());
+
+    g_free(lens);
+    g_free(ref_lens);
+    g_free(page);
+    g_free(out);
+    g_free(ref);
+    qemu_vfree(new);
+    qemu_vfree(old);
+}
+
+int main(int argc, char **argv)
+{
+    static const XBZRLEBenchOpts opts[] = {
+        { .name = "sparse-bytes", .spans = 8, .span_len = 4 },
+        { .name = "scattered-words", .spans = 64, .span_len = 16 },
+        { .name = "dense-runs", .spans = 16, .span_len = 256 },
+        { .name = "full-page", .spans = 64, .span_len = 4096 },
+    };
+    char name[64];
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(opts); i++) {
+        snprintf(name, sizeof(name), "/xbzrle/benchmark/encode/%s",
+                 opts[i].name);
+        g_test_add_data_func(name, &opts[i], test_xbzrle_encode_speed);
+    }
+
+    return g_test_run();
+}
@@ -15,6 +15,7 @@
 #include "libqos/libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -193,6 +194,21 @@ static int64_t read_migrate_property_int(QTestState *who, const char *property)
     return result;
 }
 
+static void check_downtime_stats(QTestState *who, bool source)
+{
+    QDict *rsp_return, *stats;
+    QList *devices;
+
+    rsp_return = migrate_query(who);
+    g_assert(qdict_haskey(rsp_return, "downtime-stats"));
+    stats = qdict_get_qdict(rsp_return, "downtime-stats");
+    g_assert(qdict_haskey(stats, source ? "vm-stop" : "vm-start"));
+    g_assert(qdict_haskey(stats, "non-iterable") == source);
+    devices = qdict_get_qlist(stats, "devices");
+    g_assert(devices && !qlist_empty(devices));
+    qobject_unref(rsp_return);
+}
+
 static uint64_t get_migration_pass(QTestState *who)
 {
     return read_ram_property_int(who, "dirty-sync-count");
@@ -207,6 +223,21 @@ static void read_blocktime(QTestState *who)
     qobject_unref(rsp_return);
 }
 
+static void read_fault_latency(QTestState *who)
+{
+    QDict *rsp_return, *latency;
+    QList *buckets;
+
+    rsp_return = migrate_query(who);
+    latency = qdict_get_qdict(rsp_return, "postcopy-fault-latency");
+    g_assert(latency);
+    g_assert(qdict_haskey(latency, "count"));
+    g_assert(qdict_haskey(latency, "max"));
+    buckets = qdict_get_qlist(latency, "buckets");
+    g_assert(buckets && !qlist_empty(buckets));
+    qobject_unref(rsp_return);
+}
+
 static void wait_for_migration_pass(QTestState *who)
 {
     uint64_t initial_pass = get_migration_pass(who);
@@ -472,6 +503,10 @@ typedef struct {
     bool use_shmem;
     /* only launch the target process */
     bool only_target;
+    /* postcopy only: use a preempt channel for requested pages */
+    bool postcopy_preempt;
+    /* postcopy only: use multifd for the background pages */
+    bool multifd;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -663,6 +698,8 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    bool postcopy_preempt = args->postcopy_preempt;
+    bool multifd = args->multifd;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, args)) {
@@ -673,6 +710,18 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
+    if (multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -704,6 +753,7 @@ static void migrate_postcopy_complete(QTestState *from, QTestState *to)
     if (uffd_feature_thread_id) {
         read_blocktime(to);
     }
+    read_fault_latency(to);
 
     test_migrate_end(from, to, true);
 }
@@ -720,6 +770,32 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_multifd(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->multifd = true;
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -835,10 +911,152 @@ static void test_precopy_unix(void)
     wait_for_serial("dest_serial");
     wait_for_migration_complete(from);
 
+    check_downtime_stats(from, true);
+    check_downtime_stats(to, false);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_precopy_unix_dirty_sync_threads(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "dirty-sync-threads", 4);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    g_assert_cmpint(read_ram_property_int(from, "dirty-sync-time-total"),
+                    >, 0);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static bool arch_is_x86(void)
+{
+    const char *arch = qtest_get_arch();
+
+    return strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0;
+}
+
+/*
+ * On x86, port 0x92 is a device marked as parallel, so its state goes
+ * through MIG_CMD_DEVICE_STATE.  The guest only writes it once at boot.
+ */
+#define PARALLEL_TEST_PORT  0x92
+#define PARALLEL_TEST_VALUE 0x42
+
+static void test_precopy_unix_device_state_threads(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_capability(from, "parallel-device-state", true);
+    migrate_set_capability(to, "parallel-device-state", true);
+    migrate_set_parameter_int(from, "device-state-threads", 4);
+    migrate_set_parameter_int(to, "device-state-threads", 4);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    if (arch_is_x86()) {
+        /* Keeps A20 enabled, and doesn't reset */
+        qtest_outb(from, PARALLEL_TEST_PORT, PARALLEL_TEST_VALUE);
+    }
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    if (arch_is_x86()) {
+        g_assert_cmpint(qtest_inb(to, PARALLEL_TEST_PORT), ==,
+                        PARALLEL_TEST_VALUE);
+    }
+
     test_migrate_end(from, to, true);
     g_free(uri);
 }
 
+/*
+ * The source sends the parallel devices in a MIG_CMD_DEVICE_STATE
+ * command, which the destination refuses without the capability.
+ */
+static void test_precopy_unix_device_state_threads_dst_off(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->hide_stderr = true;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    /* The device state is only sent at the end, so converge quickly */
+    migrate_set_parameter_int(from, "downtime-limit", 1000000);
+    migrate_set_capability(from, "parallel-device-state", true);
+    migrate_set_parameter_int(from, "device-state-threads", 4);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    qtest_set_expected_status(to, 1);
+    wait_for_migration_fail(from, true);
+
+    test_migrate_end(from, to, false);
+    g_free(uri);
+}
+
 #if 0
 /* Currently upset on aarch64 TCG */
 static void test_ignore_shared(void)
@@ -1293,6 +1511,157 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    test_multifd_tcp("lz4");
+}
+#endif
+
+static void test_multifd_tcp_xbzrle(void)
+{
+    test_multifd_tcp("xbzrle");
+}
+
+static uint64_t get_colo_checkpoints(QTestState *who)
+{
+    QDict *rsp, *stats;
+    uint64_t count = 0;
+
+    rsp = wait_command(who, "{ 'execute': 'query-colo-status' }");
+    stats = qdict_get_qdict(rsp, "checkpoint-stats");
+    if (stats) {
+        count = qdict_get_int(stats, "count");
+    }
+    qobject_unref(rsp);
+    return count;
+}
+
+/*
+ * Run COLO with the checkpoint RAM sent over multifd channels, then fail
+ * over to the secondary and check that its memory is consistent.
+ */
+static void test_multifd_tcp_colo(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    char *uri;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    /* Needs QEMU built with replication support */
+    rsp = qtest_qmp(from,
+                    "{ 'execute': 'migrate-set-capabilities',"
+                    "'arguments': { "
+                    "'capabilities': [ { "
+                    "'capability': 'x-colo',"
+                    "'state': true } ] } }");
+    if (!qdict_haskey(rsp, "return")) {
+        g_test_message("Skipping test: COLO not supported");
+        qobject_unref(rsp);
+        test_migrate_end(from, to, false);
+        return;
+    }
+    qobject_unref(rsp);
+    migrate_set_capability(to, "x-colo", "true");
+
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+
+    migrate_set_capability(from, "multifd", "true");
+    migrate_set_capability(to, "multifd", "true");
+
+    migrate_set_parameter_int(from, "x-checkpoint-delay", 100);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_status(from, "colo", NULL);
+
+    /* Both sides run between the checkpoints */
+    while (get_colo_checkpoints(to) < 3) {
+        usleep(1000 * 10);
+    }
+    wait_for_serial("dest_serial");
+
+    rsp = wait_command(to, "{ 'execute': 'x-colo-lost-heartbeat' }");
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_multifd_tcp_background_snapshot(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    char *uri;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+
+    migrate_set_capability(from, "multifd", "true");
+    migrate_set_capability(to, "multifd", "true");
+
+    /* Needs userfaultfd write protection in the host kernel */
+    rsp = qtest_qmp(from,
+                    "{ 'execute': 'migrate-set-capabilities',"
+                    "'arguments': { "
+                    "'capabilities': [ { "
+                    "'capability': 'background-snapshot',"
+                    "'state': true } ] } }");
+    if (!qdict_haskey(rsp, "return")) {
+        g_test_message("Skipping test: background snapshot not supported");
+        qobject_unref(rsp);
+        test_migrate_end(from, to, false);
+        return;
+    }
+    qobject_unref(rsp);
+
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+
+    migrate_qmp(from, uri, "{}");
+
+    /*
+     * The source keeps running, and the destination starts from the
+     * memory as it was when the snapshot was started
+     */
+    wait_for_migration_complete(from);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 /*
  * This test does:
  *  source               target
@@ -1439,9 +1808,19 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/multifd", test_postcopy_multifd);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/precopy/unix/dirty-sync-threads",
+                   test_precopy_unix_dirty_sync_threads);
+    qtest_add_func("/migration/precopy/unix/device-state-threads",
+                   test_precopy_unix_device_state_threads);
+    if (arch_is_x86()) {
+        qtest_add_func("/migration/precopy/unix/device-state-threads/dst-off",
+                       test_precopy_unix_device_state_threads_dst_off);
+    }
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
@@ -1459,6 +1838,13 @@ int main(int argc, char **argv)
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
 #endif
+    qtest_add_func("/migration/multifd/tcp/xbzrle", test_multifd_tcp_xbzrle);
+    qtest_add_func("/migration/multifd/tcp/colo", test_multifd_tcp_colo);
+    qtest_add_func("/migration/multifd/tcp/background-snapshot",
+                   test_multifd_tcp_background_snapshot);
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/multifd/tcp/lz4", test_multifd_tcp_lz4);
+#endif
 
     ret = g_test_run();
 
@@ -16,6 +16,10 @@
 
 #include "qemu/osdep.h"
 #include "libqos/libqtest.h"
+#include "qemu/units.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qstring.h"
 
 static int verbose;
 
@@ -37,6 +41,7 @@ static const char *hmp_cmds[] = {
     "device_del mouse1",
     "dump-guest-memory /dev/null 0 4096",
     "dump-guest-memory /dev/null",
+    "dump-guest-memory -z /dev/null",
     "gdbserver",
     "gva2gpa 0",
     "hostfwd_add tcp::43210-:43210",
@@ -138,6 +143,128 @@ static void test_machine(gconstpointer data)
     g_free((void *)data);
 }
 
+typedef struct KdumpFormat {
+    const char *name;
+    const char *hmp_flag;
+} KdumpFormat;
+
+static const KdumpFormat kdump_formats[] = {
+    { "kdump-zlib", "-z" },
+    { "kdump-lzo", "-l" },
+    { "kdump-snappy", "-s" },
+    { "kdump-zstd", "-Z" },
+};
+
+static bool dump_format_supported(QTestState *qts, const char *format)
+{
+    QDict *resp, *ret;
+    QListEntry *entry;
+    bool found = false;
+
+    resp = qtest_qmp(qts, "{ 'execute': "
+                     "'query-dump-guest-memory-capability' }");
+    ret = qdict_get_qdict(resp, "return");
+    g_assert(ret);
+
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(ret, "formats"), entry) {
+        QString *name = qobject_to(QString, qlist_entry_obj(entry));
+
+        if (!strcmp(qstring_get_str(name), format)) {
+            found = true;
+        }
+    }
+
+    qobject_unref(resp);
+    return found;
+}
+
+/* Zero, compressible and incompressible pages, spread over several batches */
+static void fill_guest_memory(QTestState *qts)
+{
+    GRand *rand = g_rand_new_with_seed(0x4b44554d);
+    uint32_t page[1024];
+    uint64_t addr;
+    int i;
+
+    for (addr = 1 * MiB; addr < 5 * MiB; addr += sizeof(page)) {
+        switch ((addr / sizeof(page)) % 3) {
+        case 0:
+            break;
+        case 1:
+            qtest_memset(qts, addr, addr / sizeof(page), sizeof(page));
+            break;
+        case 2:
+            for (i = 0; i < ARRAY_SIZE(page); i++) {
+                page[i] = g_rand_int(rand);
+            }
+            qtest_memwrite(qts, addr, page, sizeof(page));
+            break;
+        }
+    }
+
+    g_rand_free(rand);
+}
+
+static char *dump_tmp_file(void)
+{
+    char *path;
+    int fd;
+
+    fd = g_file_open_tmp("qtest-dump-XXXXXX", &path, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+    return path;
+}
+
+/*
+ * Dump with one thread through HMP and with several threads through QMP,
+ * the files must be the same
+ */
+static void test_dump_threads(gconstpointer data)
+{
+    const KdumpFormat *format = data;
+    QTestState *qts;
+    char *single_path, *multi_path, *prot, *resp;
+    char *single, *multi;
+    gsize single_len, multi_len;
+
+    qts = qtest_init("-S -m 32");
+    if (!dump_format_supported(qts, format->name)) {
+        g_test_skip("dump format not supported by this build");
+        qtest_quit(qts);
+        return;
+    }
+
+    fill_guest_memory(qts);
+    single_path = dump_tmp_file();
+    multi_path = dump_tmp_file();
+
+    resp = qtest_hmp(qts, "dump-guest-memory %s %s", format->hmp_flag,
+                     single_path);
+    g_assert_cmpstr(resp, ==, "");
+    g_free(resp);
+
+    prot = g_strdup_printf("file:%s", multi_path);
+    qtest_qmp_assert_success(qts, "{ 'execute': 'dump-guest-memory', "
+                             "'arguments': { 'paging': false, "
+                             "'protocol': %s, 'format': %s, "
+                             "'threads': 4 } }", prot, format->name);
+    g_free(prot);
+
+    g_assert(g_file_get_contents(single_path, &single, &single_len, NULL));
+    g_assert(g_file_get_contents(multi_path, &multi, &multi_len, NULL));
+    g_assert_cmpuint(single_len, ==, multi_len);
+    g_assert(memcmp(single, multi, single_len) == 0);
+
+    g_free(single);
+    g_free(multi);
+    unlink(single_path);
+    unlink(multi_path);
+    g_free(single_path);
+    g_free(multi_path);
+    qtest_quit(qts);
+}
+
 static void add_machine_test_case(const char *mname)
 {
     char *path;
@@ -162,5 +289,19 @@ int main(int argc, char **argv)
     /* as none machine has no memory by default, add a test case with memory */
     qtest_add_data_func("hmp/none+2MB", g_strdup("none -m 2"), test_machine);
 
+    /* kdump-compressed dumps need a target that knows how to dump */
+    if (!strcmp(qtest_get_arch(), "x86_64") ||
+        !strcmp(qtest_get_arch(), "i386")) {
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(kdump_formats); i++) {
+            char *path = g_strdup_printf("hmp/dump-threads/%s",
+                                         kdump_formats[i].name);
+
+            qtest_add_data_func(path, &kdump_formats[i], test_dump_threads);
+            g_free(path);
+        }
+    }
+
     return g_test_run();
 }
@@ -20,6 +20,9 @@
 #define L2                         (BITS_PER_LONG * L1)
 #define L3                         (BITS_PER_LONG * L2)
 
+/* Number of bits in a chunk of the last level, see util/hbitmap.c */
+#define CHUNK                      (512 * L1)
+
 typedef struct TestHBitmapData {
     HBitmap       *hb;
     unsigned long *bits;
@@ -378,6 +381,26 @@ static void test_hbitmap_reset(TestHBitmapData *data,
     hbitmap_test_set(data, L3 / 2, L3);
 }
 
+static void test_hbitmap_set_reset_chunks(TestHBitmapData *data,
+                                          const void *unused)
+{
+    uint64_t size = CHUNK * 4 + L1 / 2;
+
+    hbitmap_test_init(data, size, 0);
+    hbitmap_test_set(data, 0, size);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, size), ==, -1);
+    hbitmap_test_reset(data, CHUNK * 2 + 5, 1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, size), ==, CHUNK * 2 + 5);
+    hbitmap_test_reset(data, CHUNK - 1, CHUNK + 2);
+    hbitmap_test_set(data, CHUNK, CHUNK);
+    hbitmap_test_reset(data, 0, CHUNK * 4);
+    hbitmap_test_set(data, CHUNK / 2, CHUNK * 3);
+    hbitmap_test_reset(data, CHUNK * 2, size - CHUNK * 2);
+    hbitmap_test_set(data, CHUNK * 3 - 1, 2);
+    hbitmap_test_reset(data, 0, size);
+    g_assert_cmpint(hbitmap_next_dirty(data->hb, 0, size), ==, -1);
+}
+
 static void test_hbitmap_reset_all(TestHBitmapData *data,
                                    const void *unused)
 {
@@ -1061,6 +1084,7 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
+    hbitmap_test_add("/hbitmap/reset/chunks", test_hbitmap_set_reset_chunks);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
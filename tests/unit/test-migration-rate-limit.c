@@ -0,0 +1,95 @@
+/*
+ * Migration bandwidth limit unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "../migration/rate-limit.h"
+
+static void test_unlimited(void)
+{
+    MigRateLimit rl;
+
+    mig_rate_limit_init(&rl);
+    mig_rate_limit_account(&rl, 1ULL << 30);
+    g_assert_cmpint(mig_rate_limit_delay(&rl), ==, 0);
+
+    /* Removing the limit forgets the debt */
+    mig_rate_limit_set_speed(&rl, 1000);
+    mig_rate_limit_account(&rl, 1ULL << 30);
+    g_assert_cmpint(mig_rate_limit_delay(&rl), >, 0);
+    mig_rate_limit_set_speed(&rl, 0);
+    g_assert_cmpint(mig_rate_limit_delay(&rl), ==, 0);
+    mig_rate_limit_destroy(&rl);
+}
+
+static void test_debt(void)
+{
+    MigRateLimit rl;
+    int64_t delay;
+
+    mig_rate_limit_init(&rl);
+    mig_rate_limit_set_speed(&rl, 1000);
+
+    /* One second worth of data */
+    mig_rate_limit_account(&rl, 1000);
+    delay = mig_rate_limit_delay(&rl);
+    g_assert_cmpint(delay, >, NANOSECONDS_PER_SECOND / 2);
+    g_assert_cmpint(delay, <=, NANOSECONDS_PER_SECOND);
+
+    /* The debt is paid back as time goes */
+    g_usleep(delay / SCALE_US + 1);
+    g_assert_cmpint(mig_rate_limit_delay(&rl), ==, 0);
+    mig_rate_limit_destroy(&rl);
+}
+
+static void test_burst(void)
+{
+    MigRateLimit rl;
+
+    mig_rate_limit_init(&rl);
+    mig_rate_limit_set_speed(&rl, 1000);
+
+    /*
+     * 100ms of idle time would give 100 bytes, but the bucket can't hold
+     * more than MIG_RATE_LIMIT_BURST_NS worth of data.
+     */
+    g_usleep(100 * 1000);
+    mig_rate_limit_account(&rl, 100);
+    g_assert_cmpint(mig_rate_limit_delay(&rl), >, 0);
+    mig_rate_limit_destroy(&rl);
+}
+
+static void test_wait_stop(void)
+{
+    MigRateLimit rl;
+    QemuSemaphore stop;
+
+    mig_rate_limit_init(&rl);
+    qemu_sem_init(&stop, 0);
+    g_assert_true(mig_rate_limit_wait(&rl, 1ULL << 30, &stop));
+
+    /* A debt of a thousand seconds, the wait must end as soon as posted */
+    mig_rate_limit_set_speed(&rl, 1000);
+    qemu_sem_post(&stop);
+    g_assert_false(mig_rate_limit_wait(&rl, 1000 * 1000, &stop));
+
+    /* ...and stay interrupted */
+    g_assert_false(mig_rate_limit_wait(&rl, 1, &stop));
+
+    qemu_sem_destroy(&stop);
+    mig_rate_limit_destroy(&rl);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/migration/rate-limit/unlimited", test_unlimited);
+    g_test_add_func("/migration/rate-limit/debt", test_debt);
+    g_test_add_func("/migration/rate-limit/burst", test_burst);
+    g_test_add_func("/migration/rate-limit/wait-stop", test_wait_stop);
+    return g_test_run();
+}
@@ -174,6 +174,51 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *new = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *ref = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+
+    do {
+        int i, j;
+
+        for (i = 0; i < 1000; i++) {
+            int slen = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE / 8 + 1) * 8;
+            int dlen = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE + 1);
+            int spans = g_test_rand_int_range(0, 64);
+            int ref_len, len;
+
+            for (j = 0; j < slen; j++) {
+                old[j] = g_test_rand_int();
+            }
+            memcpy(new, old, slen);
+            for (j = 0; slen && j < spans; j++) {
+                int off = g_test_rand_int_range(0, slen);
+                int end = MIN(slen, off + g_test_rand_int_range(1, 100));
+
+                for (; off < end; off++) {
+                    new[off] ^= g_test_rand_int_range(0, 4) ? 0xa5 : 0;
+                }
+            }
+
+            /* every implementation must produce the same stream */
+            ref_len = xbzrle_encode_buffer_int(old, new, slen, ref, dlen);
+            len = xbzrle_encode_buffer(old, new, slen, compressed, dlen);
+            g_assert_cmpint(len, ==, ref_len);
+            if (len > 0) {
+                g_assert(memcmp(compressed, ref, len) == 0);
+            }
+        }
+    } while (xbzrle_encode_test_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +231,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
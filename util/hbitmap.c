@@ -50,8 +50,27 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The levels are not allocated as a whole, which for large disks would
+ * cost a lot of memory even for bitmaps with few bits set.  Instead they
+ * are split in chunks of HB_CHUNK_WORDS words (4 KiB on 64-bit hosts),
+ * much like the containers of roaring bitmaps: a chunk whose bits are all
+ * clear points to the shared hb_zero_chunk, and one whose bits are all set
+ * to the shared hb_full_chunk.  Only chunks with both set and clear bits
+ * are allocated.  Therefore memory usage grows with the number of areas
+ * that are dirty, not with the size of the bitmap, and setting, resetting
+ * or merging whole chunks just swaps pointers.
  */
 
+/* Number of words in a chunk of a level */
+#define HB_CHUNK_SHIFT 9
+#define HB_CHUNK_WORDS (1 << HB_CHUNK_SHIFT)
+
+static unsigned long hb_zero_chunk[HB_CHUNK_WORDS];
+static unsigned long hb_full_chunk[HB_CHUNK_WORDS] = {
+    [0 ... HB_CHUNK_WORDS - 1] = ~0UL,
+};
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -94,13 +113,154 @@ struct HBitmap {
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
      * bitmap will still allocate HBITMAP_LEVELS arrays.
+     *
+     * Each level is an array of pointers to its chunks, see hb_word() and
+     * hb_word_ptr() to access the words.
      */
-    unsigned long *levels[HBITMAP_LEVELS];
+    unsigned long **levels[HBITMAP_LEVELS];
 
-    /* The length of each levels[] array. */
+    /* The length of each level, in words. */
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+static inline bool hb_chunk_is_shared(const unsigned long *chunk)
+{
+    return chunk == hb_zero_chunk || chunk == hb_full_chunk;
+}
+
+static inline uint64_t hb_nr_chunks(uint64_t words)
+{
+    return DIV_ROUND_UP(words, HB_CHUNK_WORDS);
+}
+
+/* Number of words of chunk @c of @level; only the last one can be shorter */
+static inline size_t hb_chunk_words(const HBitmap *hb, int level, uint64_t c)
+{
+    return MIN(HB_CHUNK_WORDS, hb->sizes[level] - (c << HB_CHUNK_SHIFT));
+}
+
+/*
+ * Only chunks whose bits all lie within the level can be hb_full_chunk:
+ * the bits past the end of a level must stay clear.  The last level has
+ * one bit per granularity unit, the others one bit per word of the level
+ * below.
+ */
+static inline bool hb_chunk_can_be_full(const HBitmap *hb, int level,
+                                        uint64_t c)
+{
+    uint64_t bits = level == HBITMAP_LEVELS - 1 ? hb->size
+                                                : hb->sizes[level + 1];
+
+    return ((c + 1) << (HB_CHUNK_SHIFT + BITS_PER_LEVEL)) <= bits;
+}
+
+static inline unsigned long hb_word(const HBitmap *hb, int level,
+                                    uint64_t pos)
+{
+    const unsigned long *chunk = hb->levels[level][pos >> HB_CHUNK_SHIFT];
+
+    return chunk[pos & (HB_CHUNK_WORDS - 1)];
+}
+
+/* Return a pointer to a word that can be modified, allocating its chunk */
+static unsigned long *hb_word_ptr(HBitmap *hb, int level, uint64_t pos)
+{
+    uint64_t c = pos >> HB_CHUNK_SHIFT;
+    unsigned long *chunk = hb->levels[level][c];
+
+    if (hb_chunk_is_shared(chunk)) {
+        size_t words = hb_chunk_words(hb, level, c);
+
+        chunk = g_new(unsigned long, words);
+        memcpy(chunk, hb->levels[level][c], words * sizeof(unsigned long));
+        hb->levels[level][c] = chunk;
+    }
+    return &chunk[pos & (HB_CHUNK_WORDS - 1)];
+}
+
+/* Make chunk @c of @level point to @shared, freeing its own memory */
+static void hb_set_chunk(HBitmap *hb, int level, uint64_t c,
+                         unsigned long *shared)
+{
+    if (!hb_chunk_is_shared(hb->levels[level][c])) {
+        g_free(hb->levels[level][c]);
+    }
+    hb->levels[level][c] = shared;
+}
+
+/*
+ * Set the words [@pos, @end) of @level to @value, which is either 0 or
+ * ~0UL, using the shared chunks where whole chunks are covered.  Returns
+ * true if any word changed.
+ */
+static bool hb_fill_words(HBitmap *hb, int level, uint64_t pos, uint64_t end,
+                          unsigned long value)
+{
+    unsigned long *shared = value ? hb_full_chunk : hb_zero_chunk;
+    bool changed = false;
+
+    while (pos < end) {
+        uint64_t c = pos >> HB_CHUNK_SHIFT;
+        uint64_t chunk_start = c << HB_CHUNK_SHIFT;
+        uint64_t chunk_end = chunk_start + hb_chunk_words(hb, level, c);
+
+        if (hb->levels[level][c] == shared) {
+            pos = chunk_end;
+            continue;
+        }
+
+        if (pos == chunk_start && end >= chunk_end &&
+            (!value || hb_chunk_can_be_full(hb, level, c)))
+        {
+            hb_set_chunk(hb, level, c, shared);
+            changed = true;
+            pos = chunk_end;
+            continue;
+        }
+
+        for (; pos < MIN(end, chunk_end); pos++) {
+            if (hb_word(hb, level, pos) != value) {
+                *hb_word_ptr(hb, level, pos) = value;
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+/*
+ * Free chunk @c of @level if it has no bit set any more, which the level
+ * above tells without looking at the chunk.
+ */
+static void hb_release_chunk(HBitmap *hb, int level, uint64_t c)
+{
+    uint64_t pos, end;
+
+    if (level == 0 || hb_chunk_is_shared(hb->levels[level][c])) {
+        return;
+    }
+
+    pos = (c << HB_CHUNK_SHIFT) >> BITS_PER_LEVEL;
+    end = MIN(pos + (HB_CHUNK_WORDS >> BITS_PER_LEVEL), hb->sizes[level - 1]);
+    for (; pos < end; pos++) {
+        if (hb_word(hb, level - 1, pos)) {
+            return;
+        }
+    }
+    hb_set_chunk(hb, level, c, hb_zero_chunk);
+}
+
+static unsigned long **hb_alloc_level(uint64_t words)
+{
+    uint64_t i, chunks = hb_nr_chunks(words);
+    unsigned long **level = g_new(unsigned long *, chunks);
+
+    for (i = 0; i < chunks; i++) {
+        level[i] = hb_zero_chunk;
+    }
+    return level;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -114,7 +274,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
     do {
         i--;
         pos >>= BITS_PER_LEVEL;
-        cur = hbi->cur[i] & hb->levels[i][pos];
+        cur = hbi->cur[i] & hb_word(hb, i, pos);
     } while (cur == 0);
 
     /* Check for end of iteration.  We always use fewer than BITS_PER_LONG
@@ -136,7 +296,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +309,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_word(hbi->hb, HBITMAP_LEVELS - 1, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +342,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -220,8 +380,8 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long **last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -232,6 +392,8 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
         return -1;
     }
 
+    cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
+
     end_bit = count > hb->orig_size - start ?
                 hb->size :
                 ((start + count - 1) >> hb->granularity) + 1;
@@ -245,15 +407,22 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        for (pos++; pos < sz; pos++) {
+            if (!(pos & (HB_CHUNK_WORDS - 1)) &&
+                last_lev[pos >> HB_CHUNK_SHIFT] == hb_full_chunk) {
+                pos += HB_CHUNK_WORDS - 1;
+                continue;
+            }
+            if (hb_word(hb, HBITMAP_LEVELS - 1, pos) != (unsigned long)-1) {
+                break;
+            }
+        }
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -378,19 +547,24 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
 /* Setting starts at the last layer and propagates up if an element
  * changes.
  */
-static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t last)
+static inline bool hb_set_elem(HBitmap *hb, int level, uint64_t start,
+                               uint64_t last)
 {
+    uint64_t pos = start >> BITS_PER_LEVEL;
     unsigned long mask;
     unsigned long old;
 
-    assert((last >> BITS_PER_LEVEL) == (start >> BITS_PER_LEVEL));
+    assert((last >> BITS_PER_LEVEL) == pos);
     assert(start <= last);
 
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
-    old = *elem;
-    *elem |= mask;
-    return old != *elem;
+    old = hb_word(hb, level, pos);
+    if ((old | mask) == old) {
+        return false;
+    }
+    *hb_word_ptr(hb, level, pos) = old | mask;
+    return true;
 }
 
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
@@ -401,23 +575,14 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
     bool changed = false;
-    size_t i;
 
-    i = pos;
-    if (i < lastpos) {
+    if (pos < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
-        }
+        changed |= hb_set_elem(hb, level, start, next - 1);
+        changed |= hb_fill_words(hb, level, pos + 1, lastpos, ~0UL);
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(hb, level, start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -456,19 +621,23 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
 /* Resetting works the other way round: propagate up if the new
  * value is zero.
  */
-static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t last)
+static inline bool hb_reset_elem(HBitmap *hb, int level, uint64_t start,
+                                 uint64_t last)
 {
+    uint64_t pos = start >> BITS_PER_LEVEL;
     unsigned long mask;
-    bool blanked;
+    unsigned long old;
 
-    assert((last >> BITS_PER_LEVEL) == (start >> BITS_PER_LEVEL));
+    assert((last >> BITS_PER_LEVEL) == pos);
     assert(start <= last);
 
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
-    blanked = *elem != 0 && ((*elem & ~mask) == 0);
-    *elem &= ~mask;
-    return blanked;
+    old = hb_word(hb, level, pos);
+    if (old & mask) {
+        *hb_word_ptr(hb, level, pos) = old & ~mask;
+    }
+    return old != 0 && ((old & ~mask) == 0);
 }
 
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
@@ -478,11 +647,11 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
 {
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
+    uint64_t first_chunk = pos >> HB_CHUNK_SHIFT;
+    uint64_t last_chunk = lastpos >> HB_CHUNK_SHIFT;
     bool changed = false;
-    size_t i;
 
-    i = pos;
-    if (i < lastpos) {
+    if (pos < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
 
         /* Here we need a more complex test than when setting bits.  Even if
@@ -490,25 +659,19 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_elem(hb, level, start, next - 1)) {
             changed = true;
         } else {
             pos++;
         }
 
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
-        }
+        changed |= hb_fill_words(hb, level, (start >> BITS_PER_LEVEL) + 1,
+                                 lastpos, 0);
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_elem(hb, level, start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -516,6 +679,12 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
 
     if (level > 0 && changed) {
         hb_reset_between(hb, level - 1, pos, lastpos);
+
+        /* Chunks in between were replaced by hb_fill_words() already */
+        hb_release_chunk(hb, level, first_chunk);
+        if (last_chunk != first_chunk) {
+            hb_release_chunk(hb, level, last_chunk);
+        }
     }
 
     return changed;
@@ -554,12 +723,12 @@ void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
 
-    /* Same as hbitmap_alloc() except for memset() instead of malloc() */
+    /* Same as hbitmap_alloc() except for reusing the arrays of chunks */
     for (i = HBITMAP_LEVELS; --i >= 1; ) {
-        memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
+        hb_fill_words(hb, i, 0, hb->sizes[i], 0);
     }
 
-    hb->levels[0][0] = 1UL << (BITS_PER_LONG - 1);
+    *hb_word_ptr(hb, 0, 0) = 1UL << (BITS_PER_LONG - 1);
     hb->count = 0;
 }
 
@@ -588,7 +757,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_word(hb, HBITMAP_LEVELS - 1, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -605,7 +774,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -619,7 +788,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -627,7 +796,7 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t cur;
 
     if (!count) {
         return 0;
@@ -641,7 +810,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -650,8 +819,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_word(hb, HBITMAP_LEVELS - 1, cur);
+
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
 
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
@@ -664,7 +834,7 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -673,12 +843,19 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        unsigned long el;
+
+        memcpy(&el, buf, sizeof(el));
 
         if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
+            le32_to_cpus((uint32_t *)&el);
         } else {
-            le64_to_cpus((uint64_t *)cur);
+            le64_to_cpus((uint64_t *)&el);
+        }
+
+        /* Don't allocate chunks just to store zeroes in them */
+        if (el != hb_word(hb, HBITMAP_LEVELS - 1, cur)) {
+            *hb_word_ptr(hb, HBITMAP_LEVELS - 1, cur) = el;
         }
 
         buf += sizeof(unsigned long);
@@ -693,14 +870,14 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, HBITMAP_LEVELS - 1, first, first + el_count, 0);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -710,14 +887,14 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, HBITMAP_LEVELS - 1, first, first + el_count, ~0UL);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -734,25 +911,36 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
         prev_size = size;
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
-        memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
+        hb_fill_words(bitmap, lev, 0, size, 0);
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
-                bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
+            /* Clean chunks don't set anything in the level above */
+            if (!(i & (HB_CHUNK_WORDS - 1)) &&
+                bitmap->levels[lev + 1][i >> HB_CHUNK_SHIFT] == hb_zero_chunk)
+            {
+                i += HB_CHUNK_WORDS - 1;
+                continue;
+            }
+            if (hb_word(bitmap, lev + 1, i)) {
+                *hb_word_ptr(bitmap, lev, i >> BITS_PER_LEVEL) |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
         }
     }
 
-    bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    *hb_word_ptr(bitmap, 0, 0) |= 1UL << (BITS_PER_LONG - 1);
     bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
 }
 
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
+    uint64_t c;
     assert(!hb->meta);
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
+        for (c = 0; c < hb_nr_chunks(hb->sizes[i]); c++) {
+            hb_set_chunk(hb, i, c, hb_zero_chunk);
+        }
         g_free(hb->levels[i]);
     }
     g_free(hb);
@@ -775,7 +963,7 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        hb->levels[i] = hb_alloc_level(size);
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -783,16 +971,48 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
      * hbitmap_iter_skip_words.
      */
     assert(size == 1);
-    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    *hb_word_ptr(hb, 0, 0) |= 1UL << (BITS_PER_LONG - 1);
     return hb;
 }
 
+/* Change the length of @level to @words words */
+static void hb_resize_level(HBitmap *hb, int level, uint64_t words)
+{
+    uint64_t old_chunks = hb_nr_chunks(hb->sizes[level]);
+    uint64_t chunks = hb_nr_chunks(words);
+    uint64_t c;
+    size_t old_len, len;
+    unsigned long *chunk;
+
+    for (c = chunks; c < old_chunks; c++) {
+        hb_set_chunk(hb, level, c, hb_zero_chunk);
+    }
+    hb->levels[level] = g_renew(unsigned long *, hb->levels[level], chunks);
+    for (c = old_chunks; c < chunks; c++) {
+        hb->levels[level][c] = hb_zero_chunk;
+    }
+
+    /* The chunk that was the last one before may change its length */
+    c = MIN(chunks, old_chunks) - 1;
+    old_len = hb_chunk_words(hb, level, c);
+    hb->sizes[level] = words;
+    len = hb_chunk_words(hb, level, c);
+
+    chunk = hb->levels[level][c];
+    if (!hb_chunk_is_shared(chunk) && len != old_len) {
+        chunk = g_renew(unsigned long, chunk, len);
+        if (len > old_len) {
+            memset(&chunk[old_len], 0, (len - old_len) * sizeof(*chunk));
+        }
+        hb->levels[level][c] = chunk;
+    }
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
     unsigned i;
     uint64_t num_elements = size;
-    uint64_t old;
 
     assert(size <= INT64_MAX);
     hb->orig_size = size;
@@ -827,13 +1047,7 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         if (hb->sizes[i] == size) {
             break;
         }
-        old = hb->sizes[i];
-        hb->sizes[i] = size;
-        hb->levels[i] = g_realloc(hb->levels[i], size * sizeof(unsigned long));
-        if (!shrink) {
-            memset(&hb->levels[i][old], 0x00,
-                   (size - old) * sizeof(*hb->levels[i]));
-        }
+        hb_resize_level(hb, i, size);
     }
     if (hb->meta) {
         hbitmap_truncate(hb->meta, hb->size << hb->granularity);
@@ -864,6 +1078,41 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/* Chunk @c of @level of @result := A (BITOR) B, for equal granularities */
+static void hb_merge_chunk(const HBitmap *a, const HBitmap *b,
+                           HBitmap *result, int level, uint64_t c)
+{
+    unsigned long *ca = a->levels[level][c];
+    unsigned long *cb = b->levels[level][c];
+    unsigned long *cr;
+    size_t i, words;
+
+    if (ca == hb_full_chunk || cb == hb_full_chunk) {
+        hb_set_chunk(result, level, c, hb_full_chunk);
+        return;
+    }
+    if (ca == hb_zero_chunk && cb == hb_zero_chunk) {
+        hb_set_chunk(result, level, c, hb_zero_chunk);
+        return;
+    }
+
+    words = hb_chunk_words(result, level, c);
+    if (ca == hb_zero_chunk || cb == hb_zero_chunk) {
+        unsigned long *src = ca == hb_zero_chunk ? cb : ca;
+
+        if (result->levels[level][c] != src) {
+            cr = hb_word_ptr(result, level, c << HB_CHUNK_SHIFT);
+            memcpy(cr, src, words * sizeof(unsigned long));
+        }
+        return;
+    }
+
+    cr = hb_word_ptr(result, level, c << HB_CHUNK_SHIFT);
+    for (i = 0; i < words; i++) {
+        cr[i] = ca[i] | cb[i];
+    }
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -875,7 +1124,7 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
-    uint64_t j;
+    uint64_t c;
 
     if (!hbitmap_can_merge(a, b) || !hbitmap_can_merge(a, result)) {
         return false;
@@ -905,14 +1154,13 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* This merge is O(number of chunks), plus O(words) for the chunks that
+     * are neither clean nor fully dirty in both bitmaps.
      */
     assert(a->size == b->size);
     for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
+        for (c = 0; c < hb_nr_chunks(a->sizes[i]); c++) {
+            hb_merge_chunk(a, b, result, i, c);
         }
     }
 
@@ -924,10 +1172,18 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    int level = HBITMAP_LEVELS - 1;
+    uint64_t c, chunks = hb_nr_chunks(bitmap->sizes[level]);
+    struct iovec *iov = g_new(struct iovec, chunks);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+
+    for (c = 0; c < chunks; c++) {
+        iov[c].iov_base = bitmap->levels[level][c];
+        iov[c].iov_len = hb_chunk_words(bitmap, level, c) *
+                         sizeof(unsigned long);
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, chunks, &hash, errp);
+    g_free(iov);
 
     return hash;
 }